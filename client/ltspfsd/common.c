@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
@@ -20,8 +21,6 @@
  * Open up a server socket.
  */
 
-extern int mounted;
-
 int
 bindsocket(int port)
 {
@@ -193,6 +192,89 @@ _writen(register int fd, register char *ptr, register int nbytes,
   return (nbytes - nleft);	/* return >= 0 */
 }
 
+/*
+ * Rate data's been moving at on this connection, in bytes/sec, 0 till
+ * we've timed a big enough transfer.  There's a process per connection,
+ * so this is per connection.
+ */
+
+static double xput;
+
+unsigned long bytes_sent;			/* for the tracepoints */
+
+/*
+ * io_timeout:
+ *
+ * How long to wait for the client to make some progress on a transfer of
+ * nbytes: what the whole thing ought to take, from the round trip time the
+ * kernel keeps for the connection and the rate data's been moving at,
+ * times TIMEOUT_SCALE.  Never less than TIMEOUT_MIN, or more than
+ * LTSPFS_TIMEOUT, which is what it is till we know better.
+ */
+
+static int
+io_timeout(int fd, int nbytes)
+{
+  double t = LTSPFS_TIMEOUT;
+#ifdef TCP_INFO
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+
+  if ((xput || nbytes < XPUT_MIN) &&
+      !getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) && ti.tcpi_rtt) {
+    t = (ti.tcpi_rtt + 4.0 * ti.tcpi_rttvar) / 1e6;
+    if (xput)
+      t += nbytes / xput;
+    t *= TIMEOUT_SCALE;
+    if (t < TIMEOUT_MIN)
+      t = TIMEOUT_MIN;
+    if (t > LTSPFS_TIMEOUT)
+      t = LTSPFS_TIMEOUT;
+  }
+#endif
+
+  return (int)t + 1;				/* round up */
+}
+
+/*
+ * io_timed:
+ *
+ * Feeds a transfer that took from start till now into the rate estimate.
+ */
+
+static void
+io_timed(struct timeval *start, int nbytes)
+{
+  struct timeval now;
+  double t;
+
+  if (nbytes < XPUT_MIN)
+    return;
+
+  gettimeofday(&now, NULL);
+  t = (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+  if (t < 0.001)
+    t = 0.001;
+
+  xput = xput ? (7 * xput + nbytes / t) / 8 : nbytes / t;
+}
+
+/*
+ * usecs_since:
+ *
+ * Microseconds from start till now, for the tracepoints.
+ */
+
+long
+usecs_since(struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000000L +
+         (now.tv_usec - start->tv_usec);
+}
+
 /*
  * These are the user functions.  They handle some things with less parameters.
  */
@@ -200,13 +282,31 @@ _writen(register int fd, register char *ptr, register int nbytes,
 int
 readn(register int fd, register char *ptr, register int maxlen)
 {
-  return _readn(fd, ptr, maxlen, LTSPFS_TIMEOUT, &timeout, TRUE);
+  struct timeval start;
+  int r;
+
+  gettimeofday(&start, NULL);
+  r = _readn(fd, ptr, maxlen, io_timeout(fd, maxlen), &timeout, TRUE);
+  io_timed(&start, r);
+  TRACE3(sock__recv, maxlen, r, usecs_since(&start));
+
+  return r;
 }
 
 int
 writen(register int fd, register char *ptr, register int nbytes)
 {
-  return _writen(fd, ptr, nbytes, LTSPFS_TIMEOUT, &timeout, TRUE);
+  struct timeval start;
+  int r;
+
+  gettimeofday(&start, NULL);
+  r = _writen(fd, ptr, nbytes, io_timeout(fd, nbytes), &timeout, TRUE);
+  io_timed(&start, r);
+  if (r > 0)
+    bytes_sent += r;
+  TRACE3(sock__send, nbytes, r, usecs_since(&start));
+
+  return r;
 }
 
 void
@@ -224,11 +324,10 @@ am_mount(char *mountpoint)
 {
   struct stat buf;
   char cmdline[BUFSIZ];
+  struct timeval start;
 
   if (debug)
     info("am_mount called\n");
-  if (mounted)	/* buh? */
-    return;
 
   /*
    * Check if the mount script exists before calling
@@ -236,9 +335,10 @@ am_mount(char *mountpoint)
 
   if (!stat("/sbin/ltspfs_mount", &buf)) {
     sprintf(cmdline, "/sbin/ltspfs_mount %s", mountpoint);
+    TRACE_CLOCK(start);
     system(cmdline);
+    TRACE2(automount__mount, mountpoint, usecs_since(&start));
   }
-  mounted = 1;
 }
 
 void
@@ -246,21 +346,22 @@ am_umount(char *mountpoint)
 {
   struct stat buf;
   char cmdline[BUFSIZ];
+  struct timeval start;
 
   if (debug)
     info("am_umount called\n");
-  if (!mounted)					/* buh? */
-    return;
 
   /*
    * Check if the mount script exists before calling
    */
 
   if (!stat("/sbin/ltspfs_umount", &buf)) {
+    node_flush(mountpoint);		/* open nodes would keep it busy */
     sprintf(cmdline, "/sbin/ltspfs_umount %s", mountpoint);
+    TRACE_CLOCK(start);
     system(cmdline);
+    TRACE2(automount__umount, mountpoint, usecs_since(&start));
   }
-  mounted = 0;
 }
 
 /*
@@ -17,6 +17,7 @@
 
 extern int syslogopen;
 extern int debug;
+extern unsigned long bytes_sent;
 
 /*
  * function prototypes
@@ -30,6 +31,7 @@ int _readn(register int fd, register char *ptr, register int nbytes,
 int _writen(register int fd, register char *ptr, register int nbytes,
            int timeout_secs, void (*timeout_function)(), int doselect);
 int streq (char *s1, char *s2);
+long usecs_since(struct timeval *start);
 void timeout();
 void am_mount(char *mountpoint);
 void am_umount(char *mountpoint);
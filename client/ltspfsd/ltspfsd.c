@@ -16,6 +16,8 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <sys/time.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -31,9 +33,9 @@ int    debug;			/* Debug level.  0 = no debug */
 int    readonly;		/* If true, make filesystem "read only" */
 int    noauth;			/* If true, skip authentication */
 int    syslogopen;		/* If true, then log to syslog, else stderr */
-char   *mountpoint;		/* Point we're "mounted" to */
+char   *mountpoint;		/* Export the current request is for */
 int    authenticated;	/* Mountpoint length */
-int    mounted;			/* Automounter status */
+int    mounted;			/* Number of exports automounted */
 
 /*
  * mainline
@@ -107,6 +109,13 @@ int main(int argc, char *argv[])
 
   sockfd = bindsocket(SERVER_PORT);
 
+  /*
+   * Session tickets have to outlive the process that issued them, so set
+   * them up before we start forking.
+   */
+
+  ticket_init();
+
   /*
    * Log informational message to indicate program starting
    */
@@ -164,11 +173,14 @@ void handle_connection(int sockfd)
   struct timeval automount_timeout;             /* Timeout */
   int nleft, nread;
   int r;
+  time_t notify_held = 0;			/* when we started holding */
 
 
   for (;;) {
     FD_ZERO(&set);
     FD_SET(sockfd, &set);
+    if (notifyfd >= 0)
+      FD_SET(notifyfd, &set);
     xdrmem_create(&in, line, LTSP_MAXBUF, XDR_DECODE);
     lineptr = line;
 
@@ -185,10 +197,31 @@ void handle_connection(int sockfd)
       error_die("handle_connection: select error\n");
     else if (r == 0) {
       if (mounted)
-        am_umount(mountpoint);		/* this will return */
+        exports_idle();			/* this will return */
       continue;			/* Back to the top of the for(;;) loop */
     }
 
+    /*
+     * Changes on our side get passed on to the client.  We're between
+     * requests here, so this can't get mixed up with a response.  Requests
+     * come first, though: notifications wait while there's a request to
+     * answer, for up to NOTIFY_HOLD seconds.
+     */
+
+    if (notifyfd >= 0 && FD_ISSET(notifyfd, &set)) {
+      if (!FD_ISSET(sockfd, &set) ||
+          (notify_held && time(NULL) - notify_held >= NOTIFY_HOLD)) {
+        ltspfs_notify(sockfd);
+        notify_held = 0;
+      } else if (!notify_held)
+        notify_held = time(NULL);
+
+      if (!FD_ISSET(sockfd, &set)) {
+        xdr_destroy(&in);
+        continue;
+      }
+    }
+
     nleft = BYTES_PER_XDR_UNIT;
 
     while (nleft > 0) {
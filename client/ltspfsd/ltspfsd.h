@@ -6,19 +6,87 @@
  * The maximum sized command we have is the symlink command.
  * We'll need: 1 BYTES_PER_XDR_UNIT for the packet length.
  *             1 BYTES_PER_XDR_UNIT for the packet type
- *             2 * (BYTES_PER_XDR_UNIT + PATH_MAX) for the paths.
+ *             2 * (2 * BYTES_PER_XDR_UNIT + PATH_MAX) for the node ids
+ *             and paths.
  * So:
  *
- * ((4 * BYTES_PER_XDR_UNIT) + (2 * PATH_MAX))
+ * ((6 * BYTES_PER_XDR_UNIT) + (2 * PATH_MAX))
  */
 
 #define SERVER_PORT        9220
-#define LTSP_MAXBUF        ((4 * BYTES_PER_XDR_UNIT) + (2 * PATH_MAX))
-#define LTSPFS_TIMEOUT     120
+#define LTSP_MAXBUF        ((6 * BYTES_PER_XDR_UNIT) + (2 * PATH_MAX))
+#define LTSPFS_TIMEOUT     120			/* longest we'll wait on a client */
+#define TIMEOUT_MIN        10			/* shortest */
+#define TIMEOUT_SCALE      4			/* times as long as it ought to take */
+#define XPUT_MIN           16384		/* smaller transfers aren't timed */
 #define AUTOMOUNT_TIMEOUT  5
+#define NOTIFY_HOLD        1		/* max secs notifications wait on requests */
 #define LTSP_STATUS_OK     0
 #define LTSP_STATUS_FAIL   1
 #define LTSP_STATUS_CONT   2
+#define LTSP_STATUS_NOTIFY 3
+#define NODE_BITS          10			/* slot bits in a node id */
+#define NODE_MAX           (1 << NODE_BITS)	/* size of the node table */
+#define EXPORT_MAX         16			/* exports per connection */
+#define DIRS_MAX           8			/* directory streams kept open */
+#define CHECKSUM_BLOCK     (1024 * 1024)	/* biggest block we'll sum */
+#define CHECKSUM_MAX       256			/* most blocks summed at once */
+#define HEAD_MAX           (128 * 1024)		/* biggest head READHEADS reads */
+#define HEADS_MAX          64			/* most files it reads at once */
+#define PROGRESS_INTERVAL  1			/* secs between progress reports */
+#define CANCEL_CHECK       32			/* entries between looks for CANCEL */
+#define CANCEL_PEEK        (64 * 1024)		/* how far ahead we look for one */
+#define DISPLAY_MAX        12			/* X displays tried by handle_auth */
+#define X_SOCKET           "/tmp/.X11-unix/X%d"	/* and where they listen */
+#define TICKET_LEN         16			/* bytes in a session ticket */
+#define TICKET_MAX         64			/* tickets we'll remember */
+#define TICKET_TTL         (12 * 60 * 60)	/* secs a ticket's good for */
+
+/*
+ * Change notifications.  Sent to the client with an LTSP_STATUS_NOTIFY
+ * status, whenever something in a directory it has a node for changes.
+ */
+
+#define NOTIFY_CHANGED     1		/* contents or attributes changed */
+#define NOTIFY_CREATED     2		/* entry created or moved in */
+#define NOTIFY_REMOVED     3		/* entry deleted or moved away */
+
+#define NOTIFY_EVENTS      (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | \
+                            IN_CREATE | IN_MOVED_TO | IN_DELETE | \
+                            IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF | \
+                            IN_ONLYDIR)
+
+/*
+ * Static tracepoints, for perf and bpftrace (ltspfsd:dispatch__entry and
+ * so on).  They're a nop till something's attached, and without
+ * <sys/sdt.h> they aren't there at all, and neither is the clock reading
+ * for them, TRACE_CLOCK().  TRACE_SYS() wraps a system call made for the
+ * request being dispatched.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_CLOCK(t)            gettimeofday(&(t), NULL)
+#define TRACE2(name, a, b)        DTRACE_PROBE2(ltspfsd, name, a, b)
+#define TRACE3(name, a, b, c)     DTRACE_PROBE3(ltspfsd, name, a, b, c)
+#define TRACE4(name, a, b, c, d)  DTRACE_PROBE4(ltspfsd, name, a, b, c, d)
+#define TRACE_SYS(r, name, size, call) do { \
+    struct timeval trace_start; \
+    gettimeofday(&trace_start, NULL); \
+    TRACE3(syscall__entry, cur_opcode, name, size); \
+    (r) = (call); \
+    TRACE4(syscall__return, cur_opcode, name, (long)(r), \
+           usecs_since(&trace_start)); \
+  } while (0)
+#else
+#define TRACE_CLOCK(t)            ((void)(t))
+#define TRACE2(name, a, b)        do { if (0) (void)(a), (void)(b); } while (0)
+#define TRACE3(name, a, b, c) \
+  do { if (0) (void)(a), (void)(b), (void)(c); } while (0)
+#define TRACE4(name, a, b, c, d) \
+  do { if (0) (void)(a), (void)(b), (void)(c), (void)(d); } while (0)
+#define TRACE_SYS(r, name, size, call) ((r) = (call))
+#endif
 
 /*
  * Packet types
@@ -52,6 +120,19 @@
 #define LTSPFS_MOUNT       25
 #define LTSPFS_PING        26
 #define LTSPFS_QUIT        27
+#define LTSPFS_LOOKUP      28
+#define LTSPFS_UMOUNT      29
+#define LTSPFS_SEEK        30
+#define LTSPFS_FALLOCATE   31
+#define LTSPFS_READDIRPAGE 32
+#define LTSPFS_CHECKSUM    33
+#define LTSPFS_RESUME      34
+#define LTSPFS_CREATE      35
+#define LTSPFS_READHEADS   36
+#define LTSPFS_REMOVE_TREE 37
+#define LTSPFS_GET_TREE    38
+#define LTSPFS_PUT_TREE    39
+#define LTSPFS_CANCEL      40
 
 /*
  * function prototypes
@@ -62,7 +143,11 @@ void sig_chld(int signo);
 void sig_term(int signo);
 void eacces (int sockfd);
 void handle_mount(int sockfd, XDR *in);
+void handle_umount(int sockfd, XDR *in);
+void exports_idle(void);
 void handle_auth(int sockfd, XDR *in);
+void handle_resume(int sockfd, XDR *in);
+void ticket_init(void);
 void ltspfs_dispatch (int sockfd, XDR *in);
 void ltspfs_getattr  (int sockfd, XDR *in);
 void ltspfs_readlink (int sockfd, XDR *in);
@@ -72,6 +157,9 @@ void ltspfs_mkdir    (int sockfd, XDR *in);
 void ltspfs_symlink  (int sockfd, XDR *in);
 void ltspfs_unlink   (int sockfd, XDR *in);
 void ltspfs_rmdir    (int sockfd, XDR *in);
+void ltspfs_removetree (int sockfd, XDR *in);
+void ltspfs_gettree  (int sockfd, XDR *in);
+void ltspfs_puttree  (int sockfd, XDR *in);
 void ltspfs_rename   (int sockfd, XDR *in);
 void ltspfs_link     (int sockfd, XDR *in);
 void ltspfs_chmod    (int sockfd, XDR *in);
@@ -79,11 +167,21 @@ void ltspfs_chown    (int sockfd, XDR *in);
 void ltspfs_truncate (int sockfd, XDR *in);
 void ltspfs_utime    (int sockfd, XDR *in);
 void ltspfs_open     (int sockfd, XDR *in);
+void ltspfs_create   (int sockfd, XDR *in);
 void ltspfs_read     (int sockfd, XDR *in);
 void ltspfs_write    (int sockfd, XDR *in);
 void ltspfs_statfs   (int sockfd, XDR *in);
+void ltspfs_lookup   (int sockfd, XDR *in);
+void ltspfs_seek     (int sockfd, XDR *in);
+void ltspfs_fallocate (int sockfd, XDR *in);
+void ltspfs_readdirpage (int sockfd, XDR *in);
+void ltspfs_checksum (int sockfd, XDR *in);
+void ltspfs_readheads (int sockfd, XDR *in);
 void ltspfs_ping     (int sockfd);
 void ltspfs_quit     (int sockfd);
+void ltspfs_notify   (int sockfd);
+int  get_at          (XDR *in, int *dirfd, char *path);
+void node_flush      (char *path);
 
 /*
  * Global variables
@@ -94,3 +192,4 @@ extern int readonly;
 extern int noauth;
 extern char *mountpoint;
 extern int authenticated;
+extern int notifyfd;
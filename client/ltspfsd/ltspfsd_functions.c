@@ -1,3 +1,5 @@
+#define _GNU_SOURCE			/* for O_PATH and the *at() calls */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,15 +10,46 @@
 #include <fcntl.h>
 #include <utime.h>
 #include <sys/statfs.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <rpc/xdr.h>
 #include <X11/Xlib.h>
 #include <X11/Xauth.h>
 #include "ltspfsd.h"
 #include "common.h"
+#include "transfer.h"
 
 extern int mounted;
 
+int notifyfd = -1;				/* inotify descriptor */
+static int cur_opcode = -1;			/* request being dispatched */
+static unsigned int requests;			/* packets from the client, ever */
+static unsigned int cur_request;		/* the one being dispatched */
+static int cur_cancelled;			/* and a CANCEL's come for it */
+
+/*
+ * Exports.  A connection can mount more than one directory, so that one
+ * ltspfs on the server can look after all the devices on a terminal.  Each
+ * export is addressed by a node id with a slot of 0, and the export number
+ * in the upper bits.  That makes export 0 the same as the old "node 0",
+ * relative to the mountpoint.
+ */
+
+struct export {
+  char *path;					/* NULL if the slot is free */
+  int  mounted;					/* automounter status */
+};
+
+static struct export exports[EXPORT_MAX];
+static int           nexports;			/* exports in use */
+static int           curexport;			/* export of current request */
+
 char *ltspfs_opcode_str[] = {
   "LTSPFS_GETATTR", 
   "LTSPFS_READLINK", 
@@ -45,7 +78,20 @@ char *ltspfs_opcode_str[] = {
   "LTSPFS_XAUTH", 
   "LTSPFS_MOUNT", 
   "LTSPFS_PING", 
-  "LTSPFS_QUIT" };
+  "LTSPFS_QUIT",
+  "LTSPFS_LOOKUP",
+  "LTSPFS_UMOUNT",
+  "LTSPFS_SEEK",
+  "LTSPFS_FALLOCATE",
+  "LTSPFS_READDIRPAGE",
+  "LTSPFS_CHECKSUM",
+  "LTSPFS_RESUME",
+  "LTSPFS_CREATE",
+  "LTSPFS_READHEADS",
+  "LTSPFS_REMOVE_TREE",
+  "LTSPFS_GET_TREE",
+  "LTSPFS_PUT_TREE",
+  "LTSPFS_CANCEL" };
 
 /*
  * eacces:
@@ -64,27 +110,502 @@ eacces (int sockfd)
 }
 
 /*
- * Helper routine to do get a path from the XDR stream, and do all the path
- * adjustment.
+ * cancelled:
+ *
+ * Looks, without waiting, for a CANCEL from the client (ltspfs sends one
+ * when fuse interrupts a request it's waiting on).  Requests are known by
+ * their number, counting the client's packets from 1, the same as the
+ * client does.  The client doesn't wait for answers before sending more, so
+ * the CANCEL can be behind other requests, and everything that's arrived is
+ * looked through for it.  If there's one for the request being worked on,
+ * TRUE is returned, with errno EINTR, so whatever's long-running can stop
+ * and send its answer, short, and it's remembered, for next time we're
+ * asked.  If it's next on the socket, it's taken off; otherwise it's left
+ * for ltspfs_dispatch(), which ignores it, the same as one for anything
+ * else.
+ */
+
+static int
+cancelled(int sockfd)
+{
+  static char ahead[CANCEL_PEEK];
+  XDR  in;
+  fd_set fds;
+  struct timeval tv = { 0, 0 };
+  unsigned int id;
+  int  n, len, opcode;
+  long off;
+
+  if (cur_cancelled) {
+    errno = EINTR;
+    return TRUE;
+  }
+
+  FD_ZERO(&fds);
+  FD_SET(sockfd, &fds);
+  if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0 ||
+      (n = recv(sockfd, ahead, sizeof(ahead), MSG_PEEK | MSG_DONTWAIT)) <= 0)
+    return FALSE;
+
+  for (off = 0; off + 3 * BYTES_PER_XDR_UNIT <= n; off += len) {
+    xdrmem_create(&in, ahead + off, 3 * BYTES_PER_XDR_UNIT, XDR_DECODE);
+    if (!xdr_int(&in, &len) || !xdr_int(&in, &opcode) ||
+        !xdr_u_int(&in, &id) || len < 2 * BYTES_PER_XDR_UNIT ||
+        len > LTSP_MAXBUF)
+      return FALSE;				/* lost track of where we are */
+
+    if (opcode == LTSPFS_CANCEL && len == 3 * BYTES_PER_XDR_UNIT &&
+        id == cur_request)
+      break;
+
+    if (opcode == LTSPFS_WRITE)			/* its data follows it */
+      off += id;
+  }
+
+  if (off + 3 * BYTES_PER_XDR_UNIT > n)
+    return FALSE;
+
+  if (!off) {
+    readn(sockfd, ahead, 3 * BYTES_PER_XDR_UNIT);	/* it's next, take it */
+    requests++;
+  }
+  if (debug)
+    info("request %u cancelled\n", cur_request);
+  cur_cancelled = TRUE;
+  errno = EINTR;
+  return TRUE;
+}
+
+/*
+ * Node table.
+ *
+ * Directories the client looks up are kept open with O_PATH, and the client
+ * is handed back an id for them.  From then on, it can send us the id plus
+ * the last component of a path, instead of the full path, and we can use the
+ * *at() system calls instead of walking the whole thing from / again.
+ *
+ * The low NODE_BITS of an id are the slot in the table, the rest is a
+ * generation count, so an id for a slot that's since been recycled won't
+ * match, and gets ESTALE.
+ */
+
+struct node {
+  unsigned int id;				/* 0 if the slot is free */
+  int          fd;				/* O_PATH descriptor */
+  int          wd;				/* inotify watch, or -1 */
+  int          export;				/* export it's under */
+  dev_t        dev;				/* to spot duplicates */
+  ino_t        ino;
+};
+
+static struct node  nodes[NODE_MAX];
+static unsigned int node_gen;			/* generation counter */
+static int          node_hand = 1;		/* next slot to recycle */
+
+/*
+ * Directory streams.  Big directories get listed a page at a time, and
+ * the stream is kept open between pages, so the next page carries on
+ * from where the last one stopped.  The client holds a handle for the
+ * stream, and a cookie (telldir() position) for where it's got to.  If
+ * the stream's been recycled, or is somewhere else, we reopen or
+ * seekdir() to the cookie.
+ */
+
+struct dirstream {
+  unsigned int handle;				/* 0 if the slot is free */
+  DIR          *dir;
+  off_t        pos;				/* where the stream's at */
+  int          export;				/* export it's under */
+  unsigned int used;				/* for recycling */
+};
+
+static struct dirstream dirs[DIRS_MAX];
+static unsigned int     dir_handle;		/* last handle given out */
+static unsigned int     dir_clock;
+
+/*
+ * A tree that REMOVE_TREE is part way through removing.
+ */
+
+struct removal {
+  int          sockfd;				/* to report progress on */
+  dev_t        dev;				/* filesystem it's on */
+  unsigned int removed;				/* entries gone so far */
+  int          err;				/* first errno, or 0 */
+  char         failed[PATH_MAX];		/* and what it was for */
+  char         path[PATH_MAX];			/* where we've got to */
+  time_t       told;				/* last progress report */
+  int          cancelled;			/* the client's given up */
+};
+
+/*
+ * node_fd:
+ *
+ * Returns the descriptor for a node id, or -1 if the id's stale.
+ */
+
+static int
+node_fd(unsigned int id)
+{
+  int slot = id & (NODE_MAX - 1);
+
+  if (!slot || nodes[slot].id != id)
+    return -1;
+
+  return nodes[slot].fd;
+}
+
+/*
+ * node_watch:
+ *
+ * Start watching a node's directory with inotify, so we can tell the client
+ * when something in it is changed behind its back.  inotify wants a path,
+ * but the /proc link for the O_PATH descriptor will do.
+ */
+
+static void
+node_watch(int slot)
+{
+  char procpath[BUFSIZ];
+
+  nodes[slot].wd = -1;
+
+  if (notifyfd < 0)
+    return;
+
+  sprintf(procpath, "/proc/self/fd/%d", nodes[slot].fd);
+  nodes[slot].wd = inotify_add_watch(notifyfd, procpath, NOTIFY_EVENTS);
+}
+
+/*
+ * node_unwatch:
+ *
+ * Stop watching a node's directory.
+ */
+
+static void
+node_unwatch(int slot)
+{
+  if (nodes[slot].wd >= 0)
+    inotify_rm_watch(notifyfd, nodes[slot].wd);
+  nodes[slot].wd = -1;
+}
+
+/*
+ * node_get:
+ *
+ * Returns a node id for a directory, allocating one if we haven't got one
+ * already.  If the table's full, the oldest slot gets recycled.  Returns 0
+ * if the directory couldn't be opened, or can't be watched: the client
+ * caches what it learns through a node id until it's told otherwise, so
+ * it mustn't have one we can't tell it about.
+ */
+
+static unsigned int
+node_get(int dirfd, char *path, struct stat *st)
+{
+  int i, fd;
+
+  for (i = 1; i < NODE_MAX; i++)
+    if (nodes[i].id && nodes[i].dev == st->st_dev &&
+        nodes[i].ino == st->st_ino) {
+      if (nodes[i].wd >= 0)
+        return nodes[i].id;
+      close(nodes[i].fd);			/* watch is gone, retire it */
+      nodes[i].id = 0;
+      break;
+    }
+
+  fd = openat(dirfd, path, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+  if (fd < 0)
+    return 0;
+
+  for (i = 1; i < NODE_MAX && nodes[i].id; i++)
+    ;
+
+  if (i == NODE_MAX) {				/* full, recycle a slot */
+    i = node_hand;
+    node_unwatch(i);
+    close(nodes[i].fd);
+    if (++node_hand == NODE_MAX)
+      node_hand = 1;
+  }
+
+  if (!++node_gen)				/* keep ids from wrapping to */
+    node_gen++;					/* the slot number alone */
+
+  nodes[i].id  = (node_gen << NODE_BITS) | i;
+  nodes[i].fd  = fd;
+  nodes[i].dev = st->st_dev;
+  nodes[i].ino = st->st_ino;
+  nodes[i].export = curexport;
+  node_watch(i);
+
+  if (nodes[i].wd < 0) {			/* no notifications, no id */
+    close(fd);
+    nodes[i].id = 0;
+    return 0;
+  }
+
+  return nodes[i].id;
+}
+
+/*
+ * node_flush:
+ *
+ * Closes all the node descriptors under an export.  Has to happen before
+ * the automounter unmounts the device, otherwise the descriptors keep it
+ * busy.  Any ids the client holds will come back ESTALE after this.
+ */
+
+void
+node_flush(char *path)
+{
+  int i;
+
+  for (i = 0; i < DIRS_MAX; i++)
+    if (dirs[i].handle && !strcmp(exports[dirs[i].export].path, path)) {
+      closedir(dirs[i].dir);
+      dirs[i].handle = 0;
+    }
+
+  for (i = 1; i < NODE_MAX; i++)
+    if (nodes[i].id && !strcmp(exports[nodes[i].export].path, path)) {
+      node_unwatch(i);
+      close(nodes[i].fd);
+      nodes[i].id = 0;
+    }
+}
+
+/*
+ * notify_send:
+ *
+ * Sends a change notification to the client.  These are only ever sent
+ * between responses, and look like:
+ *
+ * 003|<node>|<kind>|<name>
+ *
+ * Node 0 means we lost track of what changed, and the client should forget
+ * everything it's cached.
+ */
+
+static void
+notify_send(int sockfd, unsigned int id, int kind, char *name)
+{
+  XDR  out;
+  char output[LTSP_MAXBUF];
+  int  i;
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);	 			/* First, the dummy length */
+  i = LTSP_STATUS_NOTIFY;
+  xdr_int(&out, &i);				/* Then the 3 status return */
+  xdr_u_int(&out, &id);				/* Node that changed */
+  xdr_int(&out, &kind);				/* What happened to it */
+  xdr_string(&out, &name, PATH_MAX);		/* Entry within the node */
+  i = xdr_getpos(&out);				/* Get our position */
+  xdr_setpos(&out, 0);				/* Rewind to the beginning */
+  xdr_int(&out, &i);				/* Rewrite with proper length */
+  xdr_destroy(&out);
+
+  if (debug)
+    info("notify node %u kind %d %s\n", id, kind, name);
+
+  writen(sockfd, output, i);
+}
+
+/*
+ * ltspfs_notify:
+ *
+ * Called from handle_connection when the inotify descriptor is readable.
+ * Turns the inotify events into notifications for the client.  Runs of
+ * the same event on the same entry (a file being written to, say) are
+ * only sent once.
+ */
+
+void
+ltspfs_notify(int sockfd)
+{
+  char   buf[LTSP_MAXBUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char   *ptr, *name;
+  struct inotify_event *ev;
+  int    len, i, kind;
+  int    lastwd = -1, lastkind = 0;
+  char   *lastname = "";
+
+  len = read(notifyfd, buf, sizeof(buf));
+  if (len <= 0)
+    return;
+
+  for (ptr = buf; ptr < buf + len;
+       ptr += sizeof(struct inotify_event) + ev->len) {
+    ev = (struct inotify_event *)ptr;
+    name = ev->len ? ev->name : "";
+
+    if (ev->mask & IN_Q_OVERFLOW) {		/* lost events, flush it all */
+      notify_send(sockfd, 0, NOTIFY_REMOVED, "");
+      continue;
+    }
+
+    for (i = 1; i < NODE_MAX; i++)		/* find the node */
+      if (nodes[i].id && nodes[i].wd == ev->wd)
+        break;
+
+    if (i == NODE_MAX)
+      continue;
+
+    if (ev->mask & IN_IGNORED) {		/* watch went away */
+      nodes[i].wd = -1;
+      continue;
+    }
+
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+      kind = NOTIFY_REMOVED;
+    else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+      kind = NOTIFY_REMOVED;
+    else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+      kind = NOTIFY_CREATED;
+    else
+      kind = NOTIFY_CHANGED;
+
+    if (ev->wd == lastwd && kind == lastkind && !strcmp(name, lastname))
+      continue;
+
+    lastwd   = ev->wd;
+    lastkind = kind;
+    lastname = name;
+
+    notify_send(sockfd, nodes[i].id, kind, name);
+  }
+}
+
+/*
+ * export_use:
+ *
+ * Makes an export the current one, automounting it if need be.
+ */
+
+static void
+export_use(int export)
+{
+  curexport  = export;
+  mountpoint = exports[export].path;
+
+  if (!exports[export].mounted) {
+    am_mount(mountpoint);			/* this will return */
+    exports[export].mounted = TRUE;
+    mounted++;
+  }
+}
+
+/*
+ * export_umount:
+ *
+ * Lets the automounter unmount an export.
+ */
+
+static void
+export_umount(int export)
+{
+  if (!exports[export].mounted)
+    return;
+
+  am_umount(exports[export].path);		/* this will return */
+  exports[export].mounted = FALSE;
+  mounted--;
+}
+
+/*
+ * exports_idle:
+ *
+ * Called when the connection's been idle for a while.  Unmounts every
+ * export the automounter mounted.
+ */
+
+void
+exports_idle(void)
+{
+  int i;
+
+  for (i = 0; i < EXPORT_MAX; i++)
+    if (exports[i].path)
+      export_umount(i);
+}
+
+/*
+ * Helper routine to get a path from the XDR stream, and do all the path
+ * adjustment.  Each path is a node id, followed by a name.  A node with a
+ * slot of 0 is an export, and the name is the full path as seen by the
+ * client.  Otherwise, the name is relative to the node's directory.  Either
+ * way, dirfd and path come back ready to hand to the *at() system calls,
+ * and the export is automounted if it isn't already.
+ *
+ * On failure, errno is set, and nothing has been sent to the client.
  */
 
 int
-get_fn(int sockfd, XDR *in, char *path)
+get_at(XDR *in, int *dirfd, char *path)
 {
   char *pathptr = path;
-  int mpl;
+  unsigned int id;
+  int export, slot;
+  int mpl = 0;
 
-  mpl = strlen(mountpoint);
+  if (!xdr_u_int(in, &id)) {
+    errno = EACCES;
+    return FAIL;
+  }
 
-  strncpy(path, mountpoint, mpl);
+  slot = id & (NODE_MAX - 1);
 
-  pathptr += mpl;
+  if (!slot) {
+    export = id >> NODE_BITS;
+    if (export >= EXPORT_MAX || !exports[export].path) {
+      errno = ESTALE;
+      return FAIL;
+    }
+    export_use(export);
+    mpl = strlen(mountpoint);
+    memcpy(path, mountpoint, mpl);		/* xdr_string ends it */
+    pathptr += mpl;
+    *dirfd = AT_FDCWD;
+  } else if ((*dirfd = node_fd(id)) < 0) {
+    errno = ESTALE;
+    return FAIL;
+  } else
+    export_use(nodes[slot].export);
 
   if (!xdr_string(in, &pathptr, (PATH_MAX - mpl))) {
-    eacces(sockfd);
+    errno = EACCES;
     return FAIL;
-  } else
-    return OK;
+  }
+
+  return OK;
+}
+
+/*
+ * xdr_stat:
+ *
+ * Encodes a stat structure.  Used by both getattr and lookup.
+ */
+
+static void
+xdr_stat(XDR *out, struct stat *stbuf)
+{
+  xdr_u_longlong_t(out, &(stbuf->st_dev));	/* device */
+  xdr_u_longlong_t(out, &(stbuf->st_ino));	/* inode */
+  xdr_u_int(out, &(stbuf->st_mode));		/* protection */
+  xdr_u_int(out, &(stbuf->st_nlink));		/* number of hard links */
+  xdr_u_int(out, &(stbuf->st_uid));		/* user ID of owner */
+  xdr_u_int(out, &(stbuf->st_gid));		/* group ID of owner */
+  xdr_u_longlong_t(out, &(stbuf->st_rdev));	/* device type */
+  xdr_longlong_t(out, &(stbuf->st_size));	/* total size, in bytes */
+  xdr_long(out, &(stbuf->st_blksize));		/* blocksize for fs I/O */
+  xdr_longlong_t(out, &(stbuf->st_blocks));	/* number of blocks allocated */
+  xdr_long(out, &(stbuf->st_atime));		/* time of last access */
+  xdr_long(out, &(stbuf->st_mtime));		/* time of last modification */
+  xdr_long(out, &(stbuf->st_ctime));		/* time of last status change */
 }
 
 /*
@@ -99,6 +620,15 @@ void
 ltspfs_dispatch (int sockfd, XDR *in)
 {
   int packet_type;
+  int len;
+  unsigned long sent = bytes_sent;
+  struct timeval start;
+
+  TRACE_CLOCK(start);
+  xdr_setpos(in, 0);
+  xdr_int(in, &len);				/* the length, for tracing */
+  cur_request = ++requests;			/* see cancelled() */
+  cur_cancelled = FALSE;
 
   if (!xdr_int(in, &packet_type)) {
     if (debug)
@@ -107,6 +637,9 @@ ltspfs_dispatch (int sockfd, XDR *in)
     exit(1);
   }
 
+  cur_opcode = packet_type;
+  TRACE2(dispatch__entry, packet_type, len);
+
   if (debug)
     info("Packet type: %s\n", ltspfs_opcode_str[packet_type]);
 
@@ -115,10 +648,17 @@ ltspfs_dispatch (int sockfd, XDR *in)
       case LTSPFS_XAUTH:
         handle_auth(sockfd, in);
 	break;
+      case LTSPFS_RESUME:
+        handle_resume(sockfd, in);
+	break;
       default:
         status_return(sockfd, FAIL);
     }
-  } else if (!mountpoint) {
+  } else if (packet_type == LTSPFS_PING) {
+    ltspfs_ping(sockfd);		/* a multi mount may have no exports */
+  } else if (packet_type == LTSPFS_CANCEL) {
+    ;				/* too late, it's been answered */
+  } else if (!nexports) {
     switch(packet_type) {
       case LTSPFS_MOUNT:
         handle_mount(sockfd, in);	/* Haven't mounted yet */
@@ -126,11 +666,11 @@ ltspfs_dispatch (int sockfd, XDR *in)
       default:
         status_return(sockfd, FAIL);
     }
-  } else if (packet_type == LTSPFS_PING) {
-    ltspfs_ping(sockfd);
   } else {
-    if (!mounted)
-      am_mount(mountpoint);		/* this will return */
+    /*
+     * Exports get automounted by get_at(), when a request turns up for
+     * something in them.
+     */
 
     switch(packet_type) {
       case LTSPFS_GETATTR:
@@ -187,6 +727,42 @@ ltspfs_dispatch (int sockfd, XDR *in)
       case LTSPFS_STATFS:
         ltspfs_statfs(sockfd, in);
         break;
+      case LTSPFS_LOOKUP:
+        ltspfs_lookup(sockfd, in);
+        break;
+      case LTSPFS_MOUNT:
+        handle_mount(sockfd, in);	/* Another export */
+        break;
+      case LTSPFS_UMOUNT:
+        handle_umount(sockfd, in);
+        break;
+      case LTSPFS_SEEK:
+        ltspfs_seek(sockfd, in);
+        break;
+      case LTSPFS_FALLOCATE:
+        ltspfs_fallocate(sockfd, in);
+        break;
+      case LTSPFS_READDIRPAGE:
+        ltspfs_readdirpage(sockfd, in);
+        break;
+      case LTSPFS_CHECKSUM:
+        ltspfs_checksum(sockfd, in);
+        break;
+      case LTSPFS_CREATE:
+        ltspfs_create(sockfd, in);
+        break;
+      case LTSPFS_READHEADS:
+        ltspfs_readheads(sockfd, in);
+        break;
+      case LTSPFS_REMOVE_TREE:
+        ltspfs_removetree(sockfd, in);
+        break;
+      case LTSPFS_GET_TREE:
+        ltspfs_gettree(sockfd, in);
+        break;
+      case LTSPFS_PUT_TREE:
+        ltspfs_puttree(sockfd, in);
+        break;
       case LTSPFS_RELEASE:
       case LTSPFS_RSYNC:
       case LTSPFS_SETXATTR:
@@ -203,6 +779,10 @@ ltspfs_dispatch (int sockfd, XDR *in)
           info("Invalid command: %d\n", packet_type);
     }
   }
+
+  TRACE3(dispatch__return, packet_type, bytes_sent - sent,
+         usecs_since(&start));
+  cur_opcode = -1;
 }
 
 /*
@@ -218,16 +798,19 @@ ltspfs_getattr (int sockfd, XDR *in)
   char        path[PATH_MAX];
   char 	      output[LTSP_MAXBUF];
   int         i;
+  int         dirfd;
   struct stat stbuf;
 
-  if (get_fn(sockfd, in, path)) {
+  if (get_at(in, &dirfd, path)) {
     if (debug)
-      info ("get_fn failed\n");
-    eacces(sockfd);
+      info ("get_at failed\n");
+    status_return(sockfd, FAIL);
     return;
   }
 
-  if (lstat (path, &stbuf) == -1) {
+  TRACE_SYS(i, "fstatat", 0,
+            fstatat (dirfd, path, &stbuf, AT_SYMLINK_NOFOLLOW));
+  if (i == -1) {
     status_return(sockfd, FAIL);
     return;
   }
@@ -236,19 +819,7 @@ ltspfs_getattr (int sockfd, XDR *in)
   i = 0;
   xdr_int(&out, &i);	 			/* First, the dummy length */
   xdr_int(&out, &i);				/* Then the 0 status return */
-  xdr_u_longlong_t(&out, &(stbuf.st_dev));	/* device */
-  xdr_u_longlong_t(&out, &(stbuf.st_ino));	/* inode */
-  xdr_u_int(&out, &(stbuf.st_mode));		/* protection */
-  xdr_u_int(&out, &(stbuf.st_nlink));		/* number of hard links */
-  xdr_u_int(&out, &(stbuf.st_uid));		/* user ID of owner */
-  xdr_u_int(&out, &(stbuf.st_gid));		/* group ID of owner */
-  xdr_u_longlong_t(&out, &(stbuf.st_rdev));	/* device type */
-  xdr_longlong_t(&out, &(stbuf.st_size));	/* total size, in bytes */
-  xdr_long(&out, &(stbuf.st_blksize));		/* blocksize for fs I/O */
-  xdr_longlong_t(&out, &(stbuf.st_blocks));	/* number of blocks allocated */
-  xdr_long(&out, &(stbuf.st_atime));		/* time of last access */
-  xdr_long(&out, &(stbuf.st_mtime));		/* time of last modification */
-  xdr_long(&out, &(stbuf.st_ctime));		/* time of last status change */
+  xdr_stat(&out, &stbuf);			/* Then the attributes */
   i = xdr_getpos(&out);				/* Get our position */
   xdr_setpos(&out, 0);				/* Rewind to the beginning */
   xdr_int(&out, &i);				/* Rewrite with proper length */
@@ -260,6 +831,63 @@ ltspfs_getattr (int sockfd, XDR *in)
   writen(sockfd, output, i);
 }
 
+/*
+ * ltspfs_lookup:
+ *
+ * Same as getattr, but if the path is a directory, also hands back a node
+ * id the client can use to address things inside it.  A node id of 0 means
+ * no node was allocated.  The mtime and ctime nanoseconds come after it,
+ * for clients that need to tell changes within a second apart.
+ */
+
+void
+ltspfs_lookup (int sockfd, XDR *in)
+{
+  XDR          out;
+  char         path[PATH_MAX];
+  char 	       output[LTSP_MAXBUF];
+  int          i;
+  int          dirfd;
+  unsigned int id = 0;
+  long         mnsec, cnsec;
+  struct stat  stbuf;
+
+  if (get_at(in, &dirfd, path)) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  TRACE_SYS(i, "fstatat", 0,
+            fstatat (dirfd, path, &stbuf, AT_SYMLINK_NOFOLLOW));
+  if (i == -1) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  if (S_ISDIR(stbuf.st_mode))
+    id = node_get(dirfd, path, &stbuf);
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);	 			/* First, the dummy length */
+  xdr_int(&out, &i);				/* Then the 0 status return */
+  xdr_stat(&out, &stbuf);			/* Then the attributes */
+  xdr_u_int(&out, &id);				/* Then the node id */
+  mnsec = stbuf.st_mtim.tv_nsec;
+  cnsec = stbuf.st_ctim.tv_nsec;
+  xdr_long(&out, &mnsec);			/* And the nanoseconds, last */
+  xdr_long(&out, &cnsec);			/* so old clients don't see them */
+  i = xdr_getpos(&out);				/* Get our position */
+  xdr_setpos(&out, 0);				/* Rewind to the beginning */
+  xdr_int(&out, &i);				/* Rewrite with proper length */
+  xdr_destroy(&out);
+
+  if (debug)
+    info("lookup returning node %u\n", id);
+
+  writen(sockfd, output, i);
+}
+
 /*
  * ltspfs_readlink:
  *
@@ -275,16 +903,17 @@ ltspfs_readlink (int sockfd, XDR *in)
   char output[LTSP_MAXBUF];
   char *bufptr = buf;
   int  i;
+  int  dirfd;
 
   /* readlink doesn't terminate with a null */
   memset (buf, 0, PATH_MAX);
 
-  if (get_fn(sockfd, in, path)) {		/* Get the link source */
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the link source */
+    status_return(sockfd, FAIL);
     return;
   }
 
-  if (readlink (path, buf, PATH_MAX) == -1) {
+  if (readlinkat (dirfd, path, buf, PATH_MAX) == -1) {
     status_return(sockfd, FAIL);
     return;
   }
@@ -330,21 +959,28 @@ ltspfs_readdir (int sockfd, XDR *in)
   DIR  *dp;
   char *nameptr;
   struct dirent *de;
-  int  i;
+  int  i, n = 0;
+  int  dirfd, fd;
 
-  if (get_fn(sockfd, in, path)) {		/* Get the dir name */ 
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the dir name */ 
+    status_return(sockfd, FAIL);
     return;
   }
 
-  dp = opendir (path);
+  fd = openat (dirfd, path, O_RDONLY | O_DIRECTORY);
+  dp = fd < 0 ? NULL : fdopendir (fd);
 
   if (dp == NULL) {
     status_return(sockfd, FAIL);		/* opendir failed */
+    if (fd >= 0)
+      close (fd);
     return;
   }
 
   while ((de = readdir (dp)) != NULL) {
+    if (!(++n % CANCEL_CHECK) && cancelled(sockfd))
+      break;
+
     xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
     i = 0;
     xdr_int(&out, &i);	 			/* First, the dummy length */
@@ -367,25 +1003,178 @@ ltspfs_readdir (int sockfd, XDR *in)
 
   closedir (dp);
 
-  status_return(sockfd, OK);
+  if (de) {
+    errno = EINTR;
+    status_return(sockfd, FAIL);
+  } else
+    status_return(sockfd, OK);
 }
 
 /*
- * ltspfs_mknod:
+ * dir_stream:
  *
- * Makes filesystem nodes (regular files, pipes, device nodes, etc).
+ * Finds the directory stream for a handle, positioned at cookie.  If
+ * there isn't one, opens the directory, recycling the least recently used
+ * stream if need be.  Returns NULL, with errno set, on failure.
  */
 
-void
-ltspfs_mknod (int sockfd, XDR *in)
+static struct dirstream *
+dir_stream(unsigned int handle, off_t cookie, int dirfd, char *path)
 {
-  char   path[PATH_MAX];
-  mode_t mode;
-  dev_t  rdev;
+  struct dirstream *ds = NULL;
+  DIR *dp;
+  int i, fd;
+
+  for (i = 0; handle && i < DIRS_MAX; i++)
+    if (dirs[i].handle == handle) {
+      ds = &dirs[i];
+      break;
+    }
 
-  if (!xdr_u_int(in, &mode)) {			/* Get the mode */
-    eacces(sockfd);
-    return;
+  if (!ds) {
+    fd = openat (dirfd, path, O_RDONLY | O_DIRECTORY);
+    dp = fd < 0 ? NULL : fdopendir (fd);
+    if (dp == NULL) {
+      if (fd >= 0)
+        close (fd);
+      return NULL;
+    }
+
+    ds = &dirs[0];
+    for (i = 0; i < DIRS_MAX; i++) {
+      if (!dirs[i].handle) {
+        ds = &dirs[i];
+        break;
+      }
+      if (dirs[i].used < ds->used)
+        ds = &dirs[i];
+    }
+
+    if (ds->handle)
+      closedir(ds->dir);
+
+    if (!++dir_handle)				/* 0 means "none" */
+      dir_handle++;
+    ds->handle = dir_handle;
+    ds->dir    = dp;
+    ds->pos    = 0;
+    ds->export = curexport;
+  }
+
+  if (ds->pos != cookie) {
+    if (cookie)
+      seekdir(ds->dir, cookie);
+    else
+      rewinddir(ds->dir);
+    ds->pos = cookie;
+  }
+
+  ds->used = ++dir_clock;
+  return ds;
+}
+
+/*
+ * ltspfs_readdirpage:
+ *
+ * Sends as many directory entries as fit in a packet, starting at a
+ * cookie.  Each entry carries the cookie for the one after it, so the
+ * client can pick up from any of them.  Returns:
+ *
+ * 000|<handle>|1|<ino>|<type>|<name>|<cookie>|1|...|0|<eof>
+ */
+
+void
+ltspfs_readdirpage (int sockfd, XDR *in)
+{
+  XDR  out;
+  char path[PATH_MAX];
+  char output[LTSP_MAXBUF];
+  char *nameptr;
+  struct dirent *de;
+  struct dirstream *ds;
+  unsigned int handle;
+  off_t cookie, here;
+  int  i, dirfd, eof = TRUE;
+
+  if (!xdr_u_int(in, &handle) ||		/* Get the handle */
+      !xdr_longlong_t(in, &cookie)) {		/* Get the cookie */
+    eacces(sockfd);
+    return;
+  }
+
+  if (get_at(in, &dirfd, path)) {		/* Get the dir name */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  if (!(ds = dir_stream(handle, cookie, dirfd, path))) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);				/* dummy length */
+  xdr_int(&out, &i);				/* OK status */
+  xdr_u_int(&out, &ds->handle);			/* stream handle */
+
+  for (;;) {
+    here = telldir (ds->dir);
+    if ((de = readdir (ds->dir)) == NULL)
+      break;
+
+    /*
+     * Room for this entry, the end marker and the eof flag?  If not,
+     * put it back for next time.
+     */
+
+    if (xdr_getpos(&out) + (9 * BYTES_PER_XDR_UNIT) +
+        RNDUP(strlen(de->d_name)) > LTSP_MAXBUF) {
+      seekdir (ds->dir, here);
+      eof = FALSE;
+      break;
+    }
+
+    i = 1;
+    xdr_int(&out, &i);				/* another entry */
+    xdr_u_longlong_t(&out, &(de->d_ino));	/* Inode */
+    xdr_u_char(&out, &(de->d_type));		/* type */
+    nameptr = de->d_name;
+    xdr_string(&out, &nameptr, PATH_MAX);	/* filename */
+    cookie = telldir (ds->dir);
+    xdr_longlong_t(&out, &cookie);		/* where the next one is */
+  }
+
+  ds->pos = telldir (ds->dir);
+
+  i = 0;
+  xdr_int(&out, &i);				/* no more entries */
+  xdr_int(&out, &eof);				/* end of the directory? */
+  i = xdr_getpos(&out);				/* Get current position */
+  xdr_setpos(&out, 0);				/* rewind to the beginning */
+  xdr_int(&out, &i);				/* re-write proper length */
+  xdr_destroy(&out);
+
+  writen(sockfd, output, i);
+}
+
+/*
+ * ltspfs_mknod:
+ *
+ * Makes filesystem nodes (regular files, pipes, device nodes, etc).
+ */
+
+void
+ltspfs_mknod (int sockfd, XDR *in)
+{
+  char   path[PATH_MAX];
+  mode_t mode;
+  dev_t  rdev;
+  int    dirfd;
+
+  if (!xdr_u_int(in, &mode)) {			/* Get the mode */
+    eacces(sockfd);
+    return;
   }
   
   if (!xdr_u_longlong_t(in, &rdev)) {		/* Get the device type */
@@ -393,101 +1182,563 @@ ltspfs_mknod (int sockfd, XDR *in)
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the dir name */
+  if (get_at(in, &dirfd, path)) {		/* Get the dir name */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  status_return (sockfd, mknodat (dirfd, path, mode, rdev));
+}
+
+/*
+ * ltspfs_mkdir:
+ *
+ * Makes directories
+ */
+
+void
+ltspfs_mkdir (int sockfd, XDR *in)
+{
+  char   path[PATH_MAX];
+  mode_t mode;
+  int    dirfd;
+
+  if (!xdr_u_int(in, &mode)) {			/* Get the mode */
+    eacces(sockfd);
+    return;
+  }
+
+  if (get_at(in, &dirfd, path)) {		/* Get the dir name */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  status_return (sockfd, mkdirat (dirfd, path, mode));
+}
+
+/*
+ * ltspfs_symlink:
+ *
+ * Makes symlinks
+ */
+
+void
+ltspfs_symlink (int sockfd, XDR *in)
+{
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+  int  fromfd, tofd;
+
+  if (get_at(in, &fromfd, from)) {		/* Get the source link */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  if (get_at(in, &tofd, to)) {			/* Get the destination link*/
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+
+  status_return (sockfd, symlinkat (from, tofd, to));
+}
+
+/*
+ * ltspfs_unlink:
+ *
+ * Deletes (unlinks) files.
+ */
+
+void
+ltspfs_unlink (int sockfd, XDR *in)
+{
+  char path[PATH_MAX];
+  int  dirfd;
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  status_return (sockfd, unlinkat (dirfd, path, 0));
+}
+
+/*
+ * ltspfs_rmdir:
+ *
+ * Removes directories.
+ */
+
+void
+ltspfs_rmdir (int sockfd, XDR *in)
+{
+  char path[PATH_MAX];
+  int  dirfd;
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  status_return (sockfd, unlinkat (dirfd, path, AT_REMOVEDIR));
+}
+
+/*
+ * remove_fail:
+ *
+ * Notes an error removing something, if it's the first one.
+ */
+
+static void
+remove_fail(struct removal *rm, char *name)
+{
+  if (rm->err)
+    return;
+
+  rm->err = errno;
+  if (snprintf(rm->failed, PATH_MAX, "%s%s%s", rm->path,
+               *rm->path ? "/" : "", name) >= PATH_MAX)
+    strcpy(rm->failed + PATH_MAX - 4, "...");	/* it's only to report */
+}
+
+/*
+ * remove_progress:
+ *
+ * Counts something removed, and lets the client know how we're doing,
+ * every PROGRESS_INTERVAL seconds, so it knows we're still at it:
+ *
+ * 200|<removed>
+ */
+
+static void
+remove_progress(struct removal *rm)
+{
+  XDR    out;
+  char   output[LTSP_MAXBUF];
+  time_t now;
+  int    i;
+
+  rm->removed++;
+
+  if (!(rm->removed % CANCEL_CHECK) && cancelled(rm->sockfd)) {
+    rm->cancelled = TRUE;
+    if (!rm->err) {
+      rm->err = EINTR;
+      strcpy(rm->failed, rm->path);
+    }
+    return;
+  }
+
+  if ((now = time(NULL)) - rm->told < PROGRESS_INTERVAL)
+    return;
+  rm->told = now;
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);	 			/* First, the dummy length */
+  i = LTSP_STATUS_CONT;
+  xdr_int(&out, &i);				/* Then the 2 status return */
+  xdr_u_int(&out, &rm->removed);		/* How many so far */
+  i = xdr_getpos(&out);				/* Get our position */
+  xdr_setpos(&out, 0);				/* Rewind to the beginning */
+  xdr_int(&out, &i);				/* Rewrite with proper length */
+  xdr_destroy(&out);
+
+  writen(rm->sockfd, output, i);
+}
+
+/*
+ * remove_entry:
+ *
+ * Removes name, in dirfd, and if it's a directory, everything in it.
+ * Anything that won't go is left where it is, and the rest carries on.
+ * Never follows a symlink, or goes into another filesystem.  Some
+ * filesystems lose their place in a directory that's being emptied, so
+ * it's gone through again for as long as that gets anywhere.
+ */
+
+static void
+remove_entry(struct removal *rm, int dirfd, char *name, int isdir)
+{
+  struct stat stbuf;
+  struct dirent *de;
+  DIR  *dp;
+  int  fd, len, r;
+  unsigned int before;
+
+  if (!isdir) {
+    if (!unlinkat(dirfd, name, 0)) {
+      remove_progress(rm);
+      return;
+    }
+    if (errno != EISDIR && errno != EPERM) {
+      remove_fail(rm, name);
+      return;
+    }
+  }
+
+  fd = openat (dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  dp = fd < 0 ? NULL : fdopendir (fd);
+
+  if (dp == NULL) {
+    remove_fail(rm, name);
+    if (fd >= 0)
+      close (fd);
+    return;
+  }
+
+  if (!(r = fstat(fd, &stbuf)) && stbuf.st_dev != rm->dev) {
+    errno = EXDEV;				/* a mount point */
+    r = -1;
+  }
+
+  if (r == -1) {
+    remove_fail(rm, name);
+    closedir (dp);
+    return;
+  }
+
+  len = strlen(rm->path);
+  snprintf(rm->path + len, PATH_MAX - len, "%s%s", len ? "/" : "", name);
+
+  for (;;) {
+    before = rm->removed;
+    while (!rm->cancelled && (de = readdir (dp)) != NULL)
+      if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+        remove_entry(rm, fd, de->d_name, de->d_type == DT_DIR);
+
+    rm->path[len] = '\0';
+    if (rm->cancelled)
+      break;
+    if (!unlinkat(dirfd, name, AT_REMOVEDIR)) {
+      remove_progress(rm);
+      break;
+    }
+    if (errno != ENOTEMPTY || rm->removed == before) {
+      remove_fail(rm, name);
+      break;
+    }
+
+    snprintf(rm->path + len, PATH_MAX - len, "%s%s", len ? "/" : "", name);
+    rewinddir (dp);
+  }
+
+  closedir (dp);
+}
+
+/*
+ * ltspfs_removetree:
+ *
+ * Removes a file, or a directory and everything in it, like rm -rf,
+ * without the client having to look at and remove every entry itself, a
+ * round trip at a time.  While it's working, it reports how many entries
+ * are gone (see remove_progress()).  Then:
+ *
+ * 000|<removed>
+ *
+ * or, if anything couldn't be removed, the first error, and where:
+ *
+ * 001|<errno>|<removed>|<path>
+ */
+
+void
+ltspfs_removetree (int sockfd, XDR *in)
+{
+  XDR  out;
+  char path[PATH_MAX];
+  char output[LTSP_MAXBUF];
+  char *ptr;
+  struct removal *rm;
+  struct stat stbuf;
+  int  i, dirfd;
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  if (readonly) {
     eacces(sockfd);
     return;
   }
 
-  status_return (sockfd, mknod (path, mode, rdev));
+  if (fstatat (dirfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) == -1 ||
+      !(rm = calloc(1, sizeof(struct removal)))) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  rm->sockfd = sockfd;
+  rm->dev    = stbuf.st_dev;
+  rm->told   = time(NULL);
+
+  remove_entry(rm, dirfd, path, S_ISDIR(stbuf.st_mode));
+
+  if (debug)
+    info("removetree: %u removed, error %d\n", rm->removed, rm->err);
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);				/* dummy length */
+  if (rm->err) {
+    i = LTSP_STATUS_FAIL;
+    xdr_int(&out, &i);				/* FAIL status */
+    xdr_int(&out, &rm->err);			/* the first error */
+    xdr_u_int(&out, &rm->removed);		/* what did go */
+    ptr = rm->failed;
+    xdr_string(&out, &ptr, PATH_MAX);		/* and what didn't */
+  } else {
+    xdr_int(&out, &i);				/* OK status */
+    xdr_u_int(&out, &rm->removed);		/* what went */
+  }
+  i = xdr_getpos(&out);				/* Get current position */
+  xdr_setpos(&out, 0);				/* rewind to the beginning */
+  xdr_int(&out, &i);				/* re-write proper length */
+  xdr_destroy(&out);
+
+  free (rm);
+  writen(sockfd, output, i);
+}
+
+/*
+ * tree_reply:
+ *
+ * Sends an entry of a tree being copied to the client: a 2 status, and
+ * then the entry, as tree_pack() has it.  The data for a file follows it.
+ */
+
+static void
+tree_reply(struct transfer *tr)
+{
+  XDR  out;
+  char output[LTSP_MAXBUF];
+  int  i;
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);	 			/* First, the dummy length */
+  i = LTSP_STATUS_CONT;
+  xdr_int(&out, &i);				/* Then the 2 status return */
+  tree_pack(&out, tr);				/* What it is */
+  i = xdr_getpos(&out);				/* Get our position */
+  xdr_setpos(&out, 0);				/* Rewind to the beginning */
+  xdr_int(&out, &i);				/* Rewrite with proper length */
+  xdr_destroy(&out);
+
+  writen(tr->fd, output, i);
+}
+
+/*
+ * tree_get, tree_put:
+ *
+ * Move a file's data in a tree, after the entry for it.
+ */
+
+static int
+tree_get(struct transfer *tr, char *buf, int len)
+{
+  return readn(tr->fd, buf, len);
+}
+
+static int
+tree_put(struct transfer *tr, const char *buf, int len)
+{
+  return writen(tr->fd, (char *)buf, len);
+}
+
+/*
+ * tree_stop:
+ *
+ * Has the client sent a CANCEL for the tree we're sending?  It's only
+ * looked for every so many entries.
+ */
+
+static int
+tree_stop(struct transfer *tr)
+{
+  return !(tr->entries % CANCEL_CHECK) && cancelled(tr->fd);
+}
+
+/*
+ * tree_done:
+ *
+ * The answer to GET_TREE or PUT_TREE, once the whole tree's gone by:
+ *
+ * 000|<entries>|<bytes>
+ *
+ * or, if anything didn't get copied, the first error, and where:
+ *
+ * 001|<errno>|<entries>|<path>
+ */
+
+static void
+tree_done(struct transfer *tr)
+{
+  XDR  out;
+  char output[LTSP_MAXBUF];
+  char *ptr;
+  int  i;
+
+  if (debug)
+    info("tree: %u entries, %llu bytes, error %d\n", tr->entries,
+         (unsigned long long)tr->bytes, tr->err);
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);				/* dummy length */
+  if (tr->err) {
+    i = LTSP_STATUS_FAIL;
+    xdr_int(&out, &i);				/* FAIL status */
+    xdr_int(&out, &tr->err);			/* the first error */
+    xdr_u_int(&out, &tr->entries);		/* what did get copied */
+    ptr = tr->failed;
+    xdr_string(&out, &ptr, PATH_MAX);		/* and what didn't */
+  } else {
+    xdr_int(&out, &i);				/* OK status */
+    xdr_u_int(&out, &tr->entries);		/* what got copied */
+    xdr_u_longlong_t(&out, &tr->bytes);
+  }
+  i = xdr_getpos(&out);				/* Get current position */
+  xdr_setpos(&out, 0);				/* rewind to the beginning */
+  xdr_int(&out, &i);				/* re-write proper length */
+  xdr_destroy(&out);
+
+  writen(tr->fd, output, i);
 }
 
 /*
- * ltspfs_mkdir:
+ * ltspfs_gettree:
  *
- * Makes directories
+ * Sends the client a file, or a directory and everything in it, in one go,
+ * rather than a lookup, open and read at a time.  The entries go out one
+ * after another (see tree_reply()), with no waiting for the client in
+ * between, and tree_done() says how it went.
  */
 
 void
-ltspfs_mkdir (int sockfd, XDR *in)
+ltspfs_gettree (int sockfd, XDR *in)
 {
-  char   path[PATH_MAX];
-  mode_t mode;
+  char path[PATH_MAX];
+  char *as;
+  struct transfer *tr;
+  int  dirfd, len;
 
-  if (!xdr_u_int(in, &mode)) {			/* Get the mode */
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the dir name */
-    eacces(sockfd);
+  if (!(tr = calloc(1, sizeof(struct transfer)))) {
+    status_return(sockfd, FAIL);
     return;
   }
 
-  status_return (sockfd, mkdir (path, mode));
+  /*
+   * It goes by the last part of its name, which for the root of an export
+   * is the export's.
+   */
+
+  for (len = strlen(path); len > 1 && path[len - 1] == '/'; len--)
+    path[len - 1] = '\0';
+  as = (as = strrchr(path, '/')) && as[1] ? as + 1 : path;
+
+  tr->fd    = sockfd;
+  tr->entry = tree_reply;
+  tr->put   = tree_put;
+  tr->stop  = tree_stop;
+  tree_send(tr, dirfd, path, as);
+  tree_done(tr);
+
+  free (tr);
 }
 
 /*
- * ltspfs_symlink:
+ * tree_packet:
  *
- * Makes symlinks
+ * Reads the next entry of a tree the client's sending (see
+ * ltspfs_puttree()).  Returns FALSE if it's not one, in which case
+ * there's no telling where the stream's got to.
  */
 
-void
-ltspfs_symlink (int sockfd, XDR *in)
+static int
+tree_packet(struct transfer *tr)
 {
-  char from[PATH_MAX];
-  char to[PATH_MAX];
-
-  if (get_fn(sockfd, in, from)) {		/* Get the source link */
-    eacces(sockfd);
-    return;
-  }
-
-  if (get_fn(sockfd, in, to)) {		/* Get the destination link*/
-    eacces(sockfd);
-    return;
+  XDR  in;
+  char input[LTSP_MAXBUF];
+  int  len, r = FALSE;
+
+  xdrmem_create(&in, input, LTSP_MAXBUF, XDR_DECODE);
+
+  if (readn(tr->fd, input, BYTES_PER_XDR_UNIT) == BYTES_PER_XDR_UNIT &&
+      xdr_int(&in, &len) && len > BYTES_PER_XDR_UNIT && len <= LTSP_MAXBUF &&
+      readn(tr->fd, input + BYTES_PER_XDR_UNIT,
+            len - BYTES_PER_XDR_UNIT) == len - BYTES_PER_XDR_UNIT) {
+    requests++;					/* they're numbered too */
+    r = tree_unpack(&in, tr);
   }
 
-
-  status_return (sockfd, symlink (from, to));
+  xdr_destroy(&in);
+  return r;
 }
 
 /*
- * ltspfs_unlink:
+ * ltspfs_puttree:
  *
- * Deletes (unlinks) files.
+ * Takes a file, or a directory and everything in it, from the client, and
+ * puts it in a directory, in one go, rather than a create and write at a
+ * time.  Once we've said the directory's OK, it sends the entries one
+ * after another, as tree_reply() does, but without the status, and then
+ * TREE_END.  Once they're all in, tree_done() says how it went.  What
+ * comes from the server keeps its setuid and setgid bits.
  */
 
 void
-ltspfs_unlink (int sockfd, XDR *in)
+ltspfs_puttree (int sockfd, XDR *in)
 {
   char path[PATH_MAX];
+  struct transfer *tr;
+  int  dirfd, fd;
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
+  if (readonly) {
     eacces(sockfd);
     return;
   }
 
-  status_return (sockfd, unlink (path));
-}
+  fd = openat (dirfd, path, O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    status_return(sockfd, FAIL);
+    return;
+  }
 
-/*
- * ltspfs_rmdir:
- *
- * Removes directories.
- */
+  if (!(tr = calloc(1, sizeof(struct transfer)))) {
+    status_return(sockfd, FAIL);
+    close (fd);
+    return;
+  }
 
-void
-ltspfs_rmdir (int sockfd, XDR *in)
-{
-  char path[PATH_MAX];
+  status_return(sockfd, OK);			/* send away */
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
-    return;
+  tr->fd   = sockfd;
+  tr->next = tree_packet;
+  tr->get  = tree_get;
+  tr->keep = TRUE;
+  if (!tree_recv(tr, fd)) {
+    if (debug)
+      info("puttree: lost track of the stream\n");
+    free (tr);
+    close (fd);
+    close(sockfd);				/* can't carry on from here */
+    exit(1);
   }
 
-  status_return (sockfd, rmdir (path));
+  close (fd);
+  tree_done(tr);
+  free (tr);
 }
 
 /*
@@ -501,18 +1752,19 @@ ltspfs_rename (int sockfd, XDR *in)
 {
   char from[PATH_MAX];
   char to[PATH_MAX];
+  int  fromfd, tofd;
 
-  if (get_fn(sockfd, in, from)) {		/* Get the source name */
-    eacces(sockfd);
+  if (get_at(in, &fromfd, from)) {		/* Get the source name */
+    status_return(sockfd, FAIL);
     return;
   }
 
-  if (get_fn(sockfd, in, to)) {		/* Get the destination name */
-    eacces(sockfd);
+  if (get_at(in, &tofd, to)) {			/* Get the destination name */
+    status_return(sockfd, FAIL);
     return;
   }
 
-  status_return (sockfd, rename (from, to));
+  status_return (sockfd, renameat (fromfd, from, tofd, to));
 }
 
 /*
@@ -526,17 +1778,18 @@ ltspfs_link (int sockfd, XDR *in)
 {
   char from[PATH_MAX];
   char to[PATH_MAX];
+  int  fromfd, tofd;
 
-  if (get_fn(sockfd, in, from)) {		/* Get the source link */
-    eacces(sockfd);
+  if (get_at(in, &fromfd, from)) {		/* Get the source link */
+    status_return(sockfd, FAIL);
     return;
   }
-  if (get_fn(sockfd, in, to)) {		/* Get the destination link*/
-    eacces(sockfd);
+  if (get_at(in, &tofd, to)) {			/* Get the destination link*/
+    status_return(sockfd, FAIL);
     return;
   }
 
-  status_return (sockfd, link (from, to));
+  status_return (sockfd, linkat (fromfd, from, tofd, to, 0));
 }
 
 /*
@@ -550,18 +1803,19 @@ ltspfs_chmod (int sockfd, XDR *in)
 {
   char   path[PATH_MAX];
   mode_t mode;
+  int    dirfd;
 
   if (!xdr_u_int(in, &mode)) {			/* Get the mode */
     eacces(sockfd);
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
     return;
   }
 
-  status_return (sockfd, chmod (path, mode));
+  status_return (sockfd, fchmodat (dirfd, path, mode, 0));
 }
 
 /*
@@ -576,6 +1830,7 @@ ltspfs_chown (int sockfd, XDR *in)
   char  path[PATH_MAX];
   uid_t uid;
   gid_t gid;
+  int   dirfd;
 
   if (!xdr_u_int(in, &uid)) {			/* Get the mode */
     eacces(sockfd);
@@ -587,12 +1842,12 @@ ltspfs_chown (int sockfd, XDR *in)
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
     return;
   }
 
-  status_return (sockfd, chown (path, uid, gid));
+  status_return (sockfd, fchownat (dirfd, path, uid, gid, 0));
 }
 
 /*
@@ -606,18 +1861,351 @@ ltspfs_truncate (int sockfd, XDR *in)
 {
   char  path[PATH_MAX];
   off_t offset;
+  int   dirfd, fd, result;
 
   if (!xdr_longlong_t(in, &offset)) {		/* Get the mode */
     eacces(sockfd);
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
-    return;
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  /*
+   * There's no truncateat(), so open the file and ftruncate it.
+   */
+
+  fd = openat (dirfd, path, O_WRONLY);
+  if (fd == -1) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  result = ftruncate (fd, offset);
+  status_return (sockfd, result);
+  close (fd);
+}
+
+/*
+ * ltspfs_seek:
+ *
+ * lseek() on a file, so the client can find the holes in sparse files
+ * with SEEK_DATA and SEEK_HOLE, and not have to fetch them.  Returns:
+ *
+ * 000|<offset>
+ */
+
+void
+ltspfs_seek (int sockfd, XDR *in)
+{
+  XDR   out;
+  char  output[LTSP_MAXBUF];
+  char  path[PATH_MAX];
+  off_t offset;
+  int   whence, dirfd, fd, i;
+
+  if (!xdr_longlong_t(in, &offset) ||		/* Get the offset */
+      !xdr_int(in, &whence)) {			/* Get the whence */
+    eacces(sockfd);
+    return;
+  }
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  switch (whence) {
+#ifdef SEEK_DATA
+    case SEEK_DATA:
+    case SEEK_HOLE:
+#endif
+    case SEEK_END:
+      break;
+    default:
+      errno = EINVAL;
+      status_return(sockfd, FAIL);
+      return;
+  }
+
+  fd = openat (dirfd, path, O_RDONLY);
+  if (fd == -1) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  offset = lseek (fd, offset, whence);
+  if (offset == -1) {
+    status_return(sockfd, FAIL);
+    close (fd);
+    return;
+  }
+
+  close (fd);
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);				/* dummy length */
+  xdr_int(&out, &i);				/* OK status */
+  xdr_longlong_t(&out, &offset);		/* where we ended up */
+  i = xdr_getpos(&out);				/* Get current position */
+  xdr_setpos(&out, 0);				/* rewind to the beginning */
+  xdr_int(&out, &i);				/* re-write proper length */
+  xdr_destroy(&out);
+
+  writen(sockfd, output, i);
+}
+
+/*
+ * ltspfs_fallocate:
+ *
+ * Preallocates space in a file, or punches a hole in it.
+ */
+
+void
+ltspfs_fallocate (int sockfd, XDR *in)
+{
+  char  path[PATH_MAX];
+  off_t offset, length;
+  int   mode, dirfd, fd, result;
+
+  if (!xdr_int(in, &mode) ||			/* Get the mode */
+      !xdr_longlong_t(in, &offset) ||		/* Get the offset */
+      !xdr_longlong_t(in, &length)) {		/* Get the length */
+    eacces(sockfd);
+    return;
+  }
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  if (readonly) {
+    eacces(sockfd);
+    return;
+  }
+
+  fd = openat (dirfd, path, O_WRONLY);
+  if (fd == -1) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  TRACE_SYS(result, "fallocate", length,
+            fallocate (fd, mode, offset, length));
+  status_return (sockfd, result);
+  close (fd);
+}
+
+/*
+ * ltspfs_checksum:
+ *
+ * Sums count blocks of a file, starting at offset, so the client can check
+ * data it's got from somewhere else before it uses it.  Reading them here
+ * is a lot cheaper than sending them.  Stops short at end of file:
+ *
+ * 000|<count>|<sum>*
+ */
+
+void
+ltspfs_checksum (int sockfd, XDR *in)
+{
+  XDR      out;
+  char     path[PATH_MAX];
+  char     output[LTSP_MAXBUF];
+  u_int    bsize;
+  off_t    offset;
+  int      count, done = 0;
+  int      i, fd, dirfd, len;
+  u_quad_t sum;
+  unsigned char *buf;
+
+  if (!xdr_u_int(in, &bsize) ||			/* Get the block size */
+      !xdr_longlong_t(in, &offset) ||		/* Get the offset */
+      !xdr_int(in, &count) ||			/* Get the block count */
+      !bsize || bsize > CHECKSUM_BLOCK || count < 0 || count > CHECKSUM_MAX) {
+    eacces(sockfd);
+    return;
+  }
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  if (!(buf = malloc(bsize))) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  fd = openat (dirfd, path, O_RDONLY);
+  if (fd == -1) {
+    status_return(sockfd, FAIL);
+    free (buf);
+    return;
+  }
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);	 			/* First, the dummy length */
+  xdr_int(&out, &i);				/* Then the 0 status return */
+  xdr_int(&out, &count);			/* Room for the count */
+
+  for (done = 0; done < count && !cancelled(sockfd); done++) {
+    TRACE_SYS(len, "pread", bsize,
+              pread (fd, buf, bsize, offset + (off_t)done * bsize));
+    if (len <= 0)
+      break;
+    sum = block_sum(buf, len);
+    xdr_u_longlong_t(&out, &sum);
+    if (len < (int)bsize) {			/* end of file */
+      done++;
+      break;
+    }
+  }
+
+  i = xdr_getpos(&out);				/* Get our position */
+  xdr_setpos(&out, 2 * BYTES_PER_XDR_UNIT);
+  xdr_int(&out, &done);				/* Rewrite with proper count */
+  xdr_setpos(&out, 0);				/* Rewind to the beginning */
+  xdr_int(&out, &i);				/* Rewrite with proper length */
+  xdr_destroy(&out);
+
+  close (fd);
+  free (buf);
+
+  writen(sockfd, output, i);
+}
+
+/*
+ * ltspfs_readheads:
+ *
+ * Reads the first size bytes of up to count files in a directory, the
+ * regular files that come after the one called after, in readdir order.
+ * A thumbnailer going through a folder of photos wants the head of each
+ * in turn, and this saves it a round trip or two apiece.  If after isn't
+ * there, there's nothing to send.  Each file comes back with what an open
+ * would have said about it, then the data:
+ *
+ * 200|<name1>|<len1>|<size1>|<mtime1>|<nsec1>|<ino1>|<volume1> <data1>
+ * ...
+ * 200|<nameN>|<lenN>|<sizeN>|<mtimeN>|<nsecN>|<inoN>|<volumeN> <dataN>
+ * 000
+ */
+
+void
+ltspfs_readheads (int sockfd, XDR *in)
+{
+  XDR   out;
+  char  path[PATH_MAX];
+  char  after[PATH_MAX];
+  char  output[LTSP_MAXBUF];
+  char  *ptr = after;
+  char  *buf;
+  DIR   *dp;
+  struct dirent *de;
+  struct stat stbuf;
+  struct statfs sfs;
+  u_quad_t ino, volume;
+  u_int size;
+  long  nsec;
+  int   count, sent = 0, found = FALSE;
+  int   i, fd, file, dirfd, len;
+
+  if (!xdr_u_int(in, &size) ||			/* Get the head size */
+      !xdr_int(in, &count) ||			/* Get the file count */
+      !xdr_string(in, &ptr, PATH_MAX) ||	/* Get where to start */
+      !size || size > HEAD_MAX || count < 0 || count > HEADS_MAX) {
+    eacces(sockfd);
+    return;
+  }
+
+  if (get_at(in, &dirfd, path)) {		/* Get the dir name */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  if (!(buf = malloc(size))) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  fd = openat (dirfd, path, O_RDONLY | O_DIRECTORY);
+  dp = fd < 0 ? NULL : fdopendir (fd);
+
+  if (dp == NULL) {
+    status_return(sockfd, FAIL);		/* opendir failed */
+    if (fd >= 0)
+      close (fd);
+    free (buf);
+    return;
+  }
+
+  while (sent < count && (de = readdir (dp)) != NULL) {
+    if (!found) {
+      found = !strcmp(de->d_name, after);
+      continue;
+    }
+
+    if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+      continue;
+
+    TRACE_SYS(file, "openat", 0, openat (fd, de->d_name,
+                                         O_RDONLY | O_NOFOLLOW | O_NONBLOCK));
+    if (file == -1)
+      continue;
+
+    if (fstat(file, &stbuf) == -1 || !S_ISREG(stbuf.st_mode)) {
+      close (file);
+      continue;
+    }
+
+    volume = 0;
+    if (!fstatfs(file, &sfs))
+      memcpy(&volume, &sfs.f_fsid, sizeof(volume));
+
+    TRACE_SYS(len, "read", size, read (file, buf, size));
+    close (file);
+    if (len < 0)
+      continue;
+
+    nsec = stbuf.st_mtim.tv_nsec;
+    ino  = stbuf.st_ino;
+
+    xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+    i = 0;
+    xdr_int(&out, &i);	 			/* First, the dummy length */
+    i = LTSP_STATUS_CONT;
+    xdr_int(&out, &i);				/* Then the 2 status return */
+    ptr = de->d_name;
+    xdr_string(&out, &ptr, PATH_MAX);		/* filename */
+    xdr_int(&out, &len);			/* bytes of it that follow */
+    xdr_longlong_t(&out, &stbuf.st_size);	/* size */
+    xdr_long(&out, &stbuf.st_mtime);		/* and mtime */
+    xdr_long(&out, &nsec);
+    xdr_u_longlong_t(&out, &ino);		/* and which file it is */
+    xdr_u_longlong_t(&out, &volume);
+    i = xdr_getpos(&out);			/* Get our position */
+    xdr_setpos(&out, 0);			/* Rewind to the beginning */
+    xdr_int(&out, &i);				/* Rewrite with proper length */
+    xdr_destroy(&out);
+
+    if (debug)
+      info("head of %s, %d bytes", de->d_name, len);
+
+    writen(sockfd, output, i);
+    writen(sockfd, buf, len);			/* then the head itself */
+    if (++sent < count && cancelled(sockfd))
+      break;					/* they've had enough */
   }
 
-  status_return (sockfd, truncate (path, offset));
+  closedir (dp);
+  free (buf);
+
+  status_return(sockfd, OK);
 }
 
 /*
@@ -631,6 +2219,8 @@ ltspfs_utime (int sockfd, XDR *in)
 {
   char path[PATH_MAX];
   struct utimbuf timbuf;
+  struct timespec times[2];
+  int  dirfd;
 
   if (!xdr_long(in, &timbuf.actime)) {		/* Get the actime */
     eacces(sockfd);
@@ -642,18 +2232,77 @@ ltspfs_utime (int sockfd, XDR *in)
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  times[0].tv_sec  = timbuf.actime;
+  times[0].tv_nsec = 0;
+  times[1].tv_sec  = timbuf.modtime;
+  times[1].tv_nsec = 0;
+
+  status_return (sockfd, utimensat (dirfd, path, times, 0));
+}
+
+/*
+ * send_opened:
+ *
+ * Answers an open or a create, for a file we've got open on fd.  The
+ * client gets its size and mtime, so it can tell whether what it's got
+ * cached from the last open is still good, and its inode and filesystem
+ * id, which together say which file it is.  A create also hands back all
+ * its attributes, so the client doesn't have to ask for them.  fd is
+ * closed either way: nothing's kept open between requests.
+ */
+
+static void
+send_opened(int sockfd, int fd, int attrs)
+{
+  XDR  out;
+  char output[LTSP_MAXBUF];
+  int  i;
+  long nsec;
+  u_quad_t ino, volume = 0;
+  struct stat stbuf;
+  struct statfs sfs;
+
+  if (fstat(fd, &stbuf) == -1) {
+    status_return(sockfd, FAIL);
+    close (fd);
     return;
   }
 
-  status_return (sockfd, utime (path, &timbuf));
+  if (!fstatfs(fd, &sfs))
+    memcpy(&volume, &sfs.f_fsid, sizeof(volume));
+  close (fd);
+  nsec = stbuf.st_mtim.tv_nsec;
+  ino  = stbuf.st_ino;
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);	 			/* First, the dummy length */
+  xdr_int(&out, &i);				/* Then the 0 status return */
+  xdr_longlong_t(&out, &stbuf.st_size);		/* Then the size */
+  xdr_long(&out, &stbuf.st_mtime);		/* And the mtime */
+  xdr_long(&out, &nsec);
+  xdr_u_longlong_t(&out, &ino);			/* And which file it is */
+  xdr_u_longlong_t(&out, &volume);
+  if (attrs)
+    xdr_stat(&out, &stbuf);			/* Then the attributes */
+  i = xdr_getpos(&out);				/* Get our position */
+  xdr_setpos(&out, 0);				/* Rewind to the beginning */
+  xdr_int(&out, &i);				/* Rewrite with proper length */
+  xdr_destroy(&out);
+
+  writen(sockfd, output, i);
 }
 
 /*
  * ltspfs_open:
  *
- * Tests whether or not a file may be opened dependant on the flags.
+ * Tests whether or not a file may be opened dependant on the flags, and
+ * if it can, says which file it is.
  */
 
 void
@@ -662,14 +2311,15 @@ ltspfs_open (int sockfd, XDR *in)
   char path[PATH_MAX];
   int  result;
   int  flags;
+  int  dirfd;
 
   if (!xdr_int(in, &flags)) {			/* Get the flags */
     eacces(sockfd);
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
     return;
   }
 
@@ -689,12 +2339,57 @@ ltspfs_open (int sockfd, XDR *in)
    * results if an error occurred.
    */
 
-  result = open (path, flags);
+  TRACE_SYS(result, "openat", 0, openat (dirfd, path, flags));
 
-  status_return (sockfd, result);
+  if (result == -1) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  send_opened(sockfd, result, FALSE);
+}
+
+/*
+ * ltspfs_create:
+ *
+ * Creates a file and opens it, in one go, where the client would have had
+ * to mknod, getattr and open.
+ */
+
+void
+ltspfs_create (int sockfd, XDR *in)
+{
+  char   path[PATH_MAX];
+  int    result;
+  int    flags;
+  mode_t mode;
+  int    dirfd;
+
+  if (!xdr_int(in, &flags) ||			/* Get the flags */
+      !xdr_u_int(in, &mode)) {			/* Get the mode */
+    eacces(sockfd);
+    return;
+  }
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
 
-  if (result != -1)
-    close (result);
+  if (readonly) {
+    eacces(sockfd);
+    return;
+  }
+
+  TRACE_SYS(result, "openat", 0,
+            openat (dirfd, path, flags | O_CREAT, mode));
+
+  if (result == -1) {
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  send_opened(sockfd, result, TRUE);
 }
 
 /*
@@ -711,8 +2406,9 @@ ltspfs_read (int sockfd, XDR *in)
   char output[LTSP_MAXBUF];
   int i;
   int fd;
+  int dirfd;
   int result;
-  size_t size;
+  u_int size;
   off_t offset;
   char *buf;
 
@@ -726,8 +2422,8 @@ ltspfs_read (int sockfd, XDR *in)
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
     return;
   }
 
@@ -743,7 +2439,7 @@ ltspfs_read (int sockfd, XDR *in)
     return;
   }
 
-  fd = open (path, O_RDONLY);
+  fd = openat (dirfd, path, O_RDONLY);
   if (fd == -1) {
     status_return(sockfd, FAIL);
     free (buf);
@@ -751,7 +2447,7 @@ ltspfs_read (int sockfd, XDR *in)
   }
 
   lseek (fd, offset, SEEK_SET);
-  result = read (fd, buf, size);
+  TRACE_SYS(result, "read", size, read (fd, buf, size));
 
   if (result < 0)
     status_return(sockfd, FAIL);
@@ -786,10 +2482,11 @@ ltspfs_write (int sockfd, XDR *in)
   XDR    out;
   char   path[PATH_MAX];
   char   output[LTSP_MAXBUF];
-  int    i;
+  int    i, n;
   int    fd;
+  int    dirfd;
   int    result;
-  size_t size;
+  u_int  size;
   off_t  offset;
   char   *buf;
 
@@ -803,34 +2500,42 @@ ltspfs_write (int sockfd, XDR *in)
     return;
   }
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
-    return;
-  }
-
-
-  buf = malloc (size);
-
   /*
-   * Check result of malloc
+   * Always take the payload off the socket, even if the path's no good or
+   * the open fails, otherwise it'd be read as the next packet.  ltspfs
+   * sends writes without waiting for the answer to the last one, so there
+   * may well be one right behind it.
    */
 
+  buf = malloc (size);
+
   if (!buf) {
+    for (i = 0; i < (int)size; i += n) {
+      n = size - i > sizeof(output) ? sizeof(output) : size - i;
+      readn (sockfd, output, n);
+    }
+    errno = ENOMEM;
     status_return(sockfd, FAIL);
     return;
   }
 
-  fd = open (path, O_WRONLY);
-  if (fd == -1) {
+  readn (sockfd, buf, size);
+
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
     status_return(sockfd, FAIL);
     free (buf);
     return;
   }
 
-  readn (sockfd, buf, size);
+  fd = openat (dirfd, path, O_WRONLY);
+  if (fd == -1) {
+    status_return(sockfd, FAIL);
+    free (buf);
+    return;
+  }
 
   lseek (fd, offset, SEEK_SET);
-  result = write (fd, buf, size);
+  TRACE_SYS(result, "write", size, write (fd, buf, size));
 
   if (result < 0)
     status_return(sockfd, FAIL);
@@ -865,14 +2570,23 @@ ltspfs_statfs (int sockfd, XDR *in)
   char output[LTSP_MAXBUF];
   struct statfs stbuf;
   int i;
+  int dirfd, fd;
 
-  if (get_fn(sockfd, in, path)) {		/* Get the path */
-    eacces(sockfd);
+  if (get_at(in, &dirfd, path)) {		/* Get the path */
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  fd = openat (dirfd, path, O_PATH);
+  if (fd == -1) {
+    status_return(sockfd, FAIL);
     return;
   }
 
+  TRACE_SYS(i, "fstatfs", 0, fstatfs (fd, &stbuf));
+  close (fd);
 
-  if (statfs (path, &stbuf) == -1) {
+  if (i == -1) {
     status_return(sockfd, FAIL);
     return;
   }
@@ -927,11 +2641,24 @@ ltspfs_quit (int sockfd)
   exit(OK);
 }
 
+/*
+ * handle_mount:
+ *
+ * Adds an export to the connection.  The reply carries the node id the
+ * client should use for the root of it:
+ *
+ * 000|<node>
+ */
+
 void
 handle_mount(int sockfd, XDR *in)
 {
+  XDR  out;
+  char output[LTSP_MAXBUF];
   char path[PATH_MAX];
   char *pathptr = path;
+  unsigned int id;
+  int  export, i;
 
   /*
    * Get our mount point
@@ -947,14 +2674,289 @@ handle_mount(int sockfd, XDR *in)
    * file, etc.  For now, we'll assume it's correct.
    */
 
-  mountpoint = strdup(path);
+  for (export = 0; export < EXPORT_MAX && exports[export].path; export++)
+    ;
+
+  if (export == EXPORT_MAX) {
+    errno = ENFILE;
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  exports[export].path    = strdup(path);
+  exports[export].mounted = FALSE;
+
+  /*
+   * Set up inotify, so we can tell the client about changes it didn't
+   * make.  If it doesn't work, we just won't send any notifications.
+   */
+
+  if (!nexports++ && notifyfd < 0) {
+    notifyfd = inotify_init();
+    if (notifyfd >= 0)
+      fcntl(notifyfd, F_SETFL, O_NONBLOCK);
+  }
     
   if (debug)
-    info("mount: %s\n", mountpoint);
+    info("mount: %s as export %d\n", path, export);
+
+  id = export << NODE_BITS;
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  i = 0;
+  xdr_int(&out, &i);				/* dummy length */
+  xdr_int(&out, &i);				/* OK status */
+  xdr_u_int(&out, &id);				/* export's root node */
+  i = xdr_getpos(&out);				/* Get current position */
+  xdr_setpos(&out, 0);				/* rewind to the beginning */
+  xdr_int(&out, &i);				/* re-write proper length */
+  xdr_destroy(&out);
+
+  writen(sockfd, output, i);
+}
+
+/*
+ * handle_umount:
+ *
+ * Removes an export from the connection, given its root node id.
+ */
+
+void
+handle_umount(int sockfd, XDR *in)
+{
+  unsigned int id;
+  int export;
+
+  if (!xdr_u_int(in, &id)) {
+    eacces(sockfd);
+    return;
+  }
+
+  export = id >> NODE_BITS;
+
+  if ((id & (NODE_MAX - 1)) || export >= EXPORT_MAX ||
+      !exports[export].path) {
+    errno = EINVAL;
+    status_return(sockfd, FAIL);
+    return;
+  }
+
+  node_flush(exports[export].path);
+  export_umount(export);
+  free(exports[export].path);
+  exports[export].path = NULL;
+  nexports--;
+
+  if (debug)
+    info("umount: export %d\n", export);
 
   status_return(sockfd, OK);
 }
 
+/*
+ * Session tickets.
+ *
+ * Checking an X cookie is slow: the server has to run xauth to get it to
+ * us, and we have to write it out and try XOpenDisplay() on display after
+ * display till one lets us in.  That's most of the time a mount takes, and
+ * a terminal with several devices plugged in pays it for each one.  So once
+ * a client's cookie has got it in, it's handed a ticket, and next time it
+ * can show us that instead.  A ticket's only good from the address it was
+ * issued to, for TICKET_TTL seconds, and only while the X server that took
+ * the cookie is still the one on that display, i.e. for the same session.
+ *
+ * Every connection gets its own process, so tickets live in memory shared
+ * between them all, along with the display that let someone in last, which
+ * handle_auth() tries first.  Nothing in there is ever held onto for more
+ * than a few stores, so a spinlock does.
+ */
+
+struct ticket {
+  unsigned char  id[TICKET_LEN];
+  struct in_addr peer;				/* who it was issued to */
+  int            display;			/* -1 if we didn't check */
+  dev_t          xdev;				/* the X server's socket */
+  ino_t          xino;
+  time_t         expires;			/* 0 if the slot's free */
+};
+
+struct tickets {
+  volatile int  lock;
+  int           display;			/* last one that let us in */
+  struct ticket slot[TICKET_MAX];
+};
+
+static struct tickets *tickets;			/* NULL if there's none */
+
+/*
+ * ticket_init
+ *
+ * Maps the ticket table.  If we can't, there just won't be any tickets.
+ */
+
+void
+ticket_init(void)
+{
+  void *map;
+
+  map = mmap(NULL, sizeof(struct tickets), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return;
+
+  tickets = map;
+  tickets->display = -1;
+}
+
+static void
+ticket_lock(void)
+{
+  while (__sync_lock_test_and_set(&tickets->lock, 1))
+    sched_yield();
+}
+
+static void
+ticket_unlock(void)
+{
+  __sync_lock_release(&tickets->lock);
+}
+
+/*
+ * x_socket
+ *
+ * Finds the X server's socket for a display, which is new every time the
+ * server's started.
+ */
+
+static int
+x_socket(int display, struct stat *st)
+{
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), X_SOCKET, display);
+  return stat(path, st);
+}
+
+/*
+ * peer_addr
+ *
+ * Who's on the other end of the connection.
+ */
+
+static int
+peer_addr(int sockfd, struct in_addr *addr)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+
+  if (getpeername(sockfd, (struct sockaddr *)&sin, &len) < 0 ||
+      sin.sin_family != AF_INET)
+    return FAIL;
+
+  *addr = sin.sin_addr;
+  return OK;
+}
+
+/*
+ * ticket_issue
+ *
+ * Makes up a new ticket for the client, that got in on display.  The oldest
+ * one goes if the table's full.
+ */
+
+static int
+ticket_issue(int sockfd, int display, unsigned char *id)
+{
+  struct ticket t, *slot;
+  struct stat st;
+  time_t now = time(NULL);
+  int fd, i;
+
+  if (!tickets)
+    return FAIL;
+
+  memset(&t, 0, sizeof(t));
+  t.display = display;
+  if (display >= 0) {
+    if (x_socket(display, &st) < 0)
+      return FAIL;				/* can't tell its sessions apart */
+    t.xdev = st.st_dev;
+    t.xino = st.st_ino;
+  }
+
+  if (peer_addr(sockfd, &t.peer) < 0)
+    return FAIL;
+
+  if ((fd = open("/dev/urandom", O_RDONLY)) < 0)
+    return FAIL;
+  i = read(fd, t.id, TICKET_LEN);
+  close(fd);
+  if (i != TICKET_LEN)
+    return FAIL;
+
+  t.expires = now + TICKET_TTL;
+
+  ticket_lock();
+  slot = &tickets->slot[0];
+  for (i = 0; i < TICKET_MAX; i++) {
+    if (tickets->slot[i].expires <= now) {
+      slot = &tickets->slot[i];			/* free, or as good as */
+      break;
+    }
+    if (tickets->slot[i].expires < slot->expires)
+      slot = &tickets->slot[i];
+  }
+  *slot = t;
+  ticket_unlock();
+
+  memcpy(id, t.id, TICKET_LEN);
+  return OK;
+}
+
+/*
+ * ticket_check
+ *
+ * TRUE if the ticket's one we gave this client, for a session that's still
+ * going.  One that's no good any more is thrown away.
+ */
+
+static int
+ticket_check(int sockfd, unsigned char *id)
+{
+  struct ticket t, *slot = NULL;
+  struct in_addr peer;
+  struct stat st;
+  time_t now = time(NULL);
+  int i;
+
+  if (!tickets || peer_addr(sockfd, &peer) < 0)
+    return 0;
+
+  ticket_lock();
+  for (i = 0; i < TICKET_MAX; i++)
+    if (tickets->slot[i].expires > now &&
+        !memcmp(tickets->slot[i].id, id, TICKET_LEN)) {
+      slot = &tickets->slot[i];
+      t = *slot;
+      break;
+    }
+  ticket_unlock();
+
+  if (!slot || t.peer.s_addr != peer.s_addr)
+    return 0;
+
+  if (t.display < 0 ||
+      (!x_socket(t.display, &st) &&
+       st.st_dev == t.xdev && st.st_ino == t.xino))
+    return 1;
+
+  ticket_lock();
+  if (!memcmp(slot->id, id, TICKET_LEN))
+    slot->expires = 0;				/* session's over */
+  ticket_unlock();
+  return 0;
+}
+
 /*
  * handle_auth
  *
@@ -977,6 +2979,8 @@ handle_mount(int sockfd, XDR *in)
  *    an example)
  * D) If we can open the display, then the user that's on the terminal is
  *    executing the command, and we're ok.
+ * E) We hand back a session ticket, so the next mount can skip all this,
+ *    and remember which display it was, so we try that one first next time.
  *
  * So, if any of the following isn't in place:
  * - /tmp isn't writable
@@ -993,8 +2997,12 @@ handle_auth(int sockfd, XDR *in)
   char displayname[BUFSIZ];
   char *auth_file;
   Display* displ;
-  size_t auth_size;
-  int found = 0, i;
+  u_int auth_size;
+  int found = 0, i = -1, n, first;
+  unsigned char id[TICKET_LEN];
+  char output[LTSP_MAXBUF];
+  XDR out;
+  int len;
 
   /*
    * Get our auth size.
@@ -1042,7 +3050,12 @@ handle_auth(int sockfd, XDR *in)
     gethostname(hostname, BUFSIZ);			/* get our hostname */
     setenv("XAUTHORITY", "/tmp/.tmpxauth", 1);		/* for XOpenDisplay */
 
-    for (i = 0; i < 12; i++) {
+    first = tickets ? tickets->display : -1;
+
+    for (n = -1; n < DISPLAY_MAX; n++) {
+      i = n < 0 ? first : n;			/* last one that worked first */
+      if (i < 0 || (n >= 0 && i == first))
+        continue;
       sprintf(displayname, "%s:%d", hostname, i);		/* displayify it */
 
       /*
@@ -1067,9 +3080,50 @@ handle_auth(int sockfd, XDR *in)
       status_return(sockfd, FAIL);
       exit(OK);
     }
-  
+
+    if (tickets)
+      tickets->display = i;
   }
 
-  status_return(sockfd, OK);				/* Acknowledge auth */
+  free(auth_file);
   authenticated++;					/* Set auth state */
+
+  if (ticket_issue(sockfd, i, id) < 0) {
+    status_return(sockfd, OK);				/* Acknowledge auth */
+    return;
+  }
+
+  xdrmem_create(&out, output, LTSP_MAXBUF, XDR_ENCODE);
+  len = 0;
+  xdr_int(&out, &len);				/* First, the dummy length */
+  xdr_int(&out, &len);				/* Then the 0 status return */
+  xdr_opaque(&out, (char *)id, TICKET_LEN);	/* and the ticket */
+  len = xdr_getpos(&out);
+  xdr_setpos(&out, 0);
+  xdr_int(&out, &len);				/* Rewrite with proper length */
+  xdr_destroy(&out);
+
+  writen(sockfd, output, len);
+}
+
+/*
+ * handle_resume
+ *
+ * Lets a client back in on a ticket handle_auth() gave it earlier.
+ */
+
+void
+handle_resume(int sockfd, XDR *in)
+{
+  unsigned char id[TICKET_LEN];
+
+  if (!xdr_opaque(in, (char *)id, TICKET_LEN) || !ticket_check(sockfd, id)) {
+    if (debug)
+      info("resume: no good\n");
+    eacces(sockfd);
+    return;
+  }
+
+  status_return(sockfd, OK);
+  authenticated++;
 }
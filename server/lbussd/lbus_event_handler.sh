@@ -7,21 +7,30 @@
 #
 # It is called when devices appear or are removed.
 #
+# All the devices on a thin client share one ltspfs, mounted in "multi"
+# mode on ~/.ltspfs/<workstation>.  Each device is a directory in there,
+# and gets a symlink in ~/Drives.
+#
 # On a "add" new device event, it needs to do 3 things:
 #
-#    1)  Create a mountpoint in ~/Drives.
-#    2)  Create a .desktop file in ~/Desktop
-#    3)  Do the FUSE mount to associate the new folder with a device
-#        on the thin client.
+#    1)  Start the ltspfs for the thin client, if it isn't running yet.
+#    2)  Attach the device, by making its directory in the ltspfs mount,
+#        and symlink it into ~/Drives.
+#    3)  Create a .desktop file in ~/Desktop
 #
 #
 # On a "remove" device event does the following:
 #
-#    1)  Unmount the FUSE filesystem
-#    2)  Remove the directory in ~/Drives
+#    1)  Remove the symlink in ~/Drives
+#    2)  Detach the device, by removing its directory in the ltspfs mount,
+#        and if it was the last one, unmount the ltspfs
 #    3)  Remove the .desktop file from the ~/Desktop directory so
 #        the Icon goes away
 #
+# Events can come close together, so starting and stopping the ltspfs,
+# and attaching and detaching devices, happen under a lock per thin
+# client, ~/.ltspfs/.<workstation>.lock.
+#
 
 ACTION=$1
 
@@ -52,7 +61,9 @@ function remove_all {
 
     if [ -d ${HOME}/${DRIVEDIR} ]; then
       for drive in ${HOME}/${DRIVEDIR}/*; do
-        if [ -d ${drive} ]; then
+        if [ -L ${drive} ]; then
+          rm -f ${drive}
+        elif [ -d ${drive} ]; then
           rmdir ${drive}
         fi
       done
@@ -72,6 +83,8 @@ function remove_all {
 }
 
 WS=${DISPLAY/:*/}
+MULTIDIR=${HOME}/.ltspfs/${WS}
+LOCKFILE=${HOME}/.ltspfs/.${WS}.lock
 
 if [ ! -d ${HOME}/${DRIVEDIR} ]; then
   mkdir ${HOME}/${DRIVEDIR}
@@ -84,9 +97,16 @@ case "${ACTION}" in
       SIZE=$4
       DESC=$5
       case "${DEVTYPE}" in
-          block)  mkdir "${HOME}/${DRIVEDIR}/${SHARENAME}"
-                  /usr/bin/ltspfs ${WS}:/tmp/drives/${SHARENAME} \
-                                   "${HOME}/${DRIVEDIR}/${SHARENAME}"
+          block)  mkdir -p "${MULTIDIR}"
+                  (
+                    flock 9
+                    if ! mountpoint -q "${MULTIDIR}"; then
+                      /usr/bin/ltspfs -o multi ${WS}:/tmp/drives "${MULTIDIR}"
+                    fi
+                    mkdir "${MULTIDIR}/${SHARENAME}"
+                  ) 9>"${LOCKFILE}"
+                  ln -s "${MULTIDIR}/${SHARENAME}" \
+                        "${HOME}/${DRIVEDIR}/${SHARENAME}"
                   if [ -d ${HOME}/Desktop ]; then
                     create_icon "${DESC}" "${SHARENAME}" \
                                 "${HOME}/${DRIVEDIR}/${SHARENAME}"
@@ -101,8 +121,18 @@ case "${ACTION}" in
       SIZE=$4
       DESC=$5
       case "${DEVTYPE}" in
-          block)  fusermount -u -z "${HOME}/${DRIVEDIR}/${SHARENAME}"
-                  rmdir "${HOME}/${DRIVEDIR}/${SHARENAME}"
+          block)  rm -f "${HOME}/${DRIVEDIR}/${SHARENAME}"
+                  (
+                    flock 9
+                    rmdir "${MULTIDIR}/${SHARENAME}"
+                    if mountpoint -q "${MULTIDIR}" &&
+                       [ -z "$(ls -A "${MULTIDIR}")" ]; then
+                      fusermount -u "${MULTIDIR}"
+                    fi
+                    if ! mountpoint -q "${MULTIDIR}"; then
+                      rmdir "${MULTIDIR}" 2>/dev/null
+                    fi
+                  ) 9>"${LOCKFILE}"
                   if [ -d ${HOME}/Desktop ]; then
                     rm -f "${HOME}/Desktop/${SHARENAME}.desktop"
                   fi
@@ -11,65 +11,38 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
 #include "common.h"
 #include "ltspfs.h"
 
 /*
- * Open up a client socket.
+ * time_left: how long until the deadline.  FALSE if it's passed.
  */
 
-int
-opensocket(char *hostname, int port)
+static int
+time_left(struct timeval *deadline, struct timeval *left)
 {
-  struct sockaddr_in serv_addr;
-  struct hostent *server;
-  int s;
-
-  /*
-   * Open up our socket
-   */
-
-  s = socket (AF_INET, SOCK_STREAM, 0);
-  if (s < 0) {
-    fprintf (stderr, "ERROR opening socket\n");
-    exit(1);
-  }
+  struct timeval now;
 
-  server = gethostbyname (hostname);
-  if (server == NULL) {
-    fprintf (stderr, "ERROR, no such host\n");
-    exit(1);
-  }
-
-  memset ((char *) &serv_addr, 0, sizeof (serv_addr));
-  serv_addr.sin_family = AF_INET;
-  bcopy ((char *) server->h_addr,
-	 (char *) &serv_addr.sin_addr.s_addr, server->h_length);
-  serv_addr.sin_port = htons (port);
-  if (connect(s, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-    fprintf (stderr, "ERROR connecting\n");
-    exit(1);
-  }
+  gettimeofday(&now, NULL);
+  timersub(deadline, &now, left);
 
-  return s;
+  return left->tv_sec >= 0 && (left->tv_sec || left->tv_usec);
 }
 
 /*
  * _readn: read n bytes from the socket
- * The select() function is used to handle timeouts.  On a timeout, the
- * timeout_function is called.
+ * The select() function is used to handle timeouts.  When the deadline
+ * passes, the timeout_function is called.  If it returns, it's moved the
+ * deadline, and we keep waiting.
  */
 
 int
 _readn(register int fd, register char *ptr, register int nbytes,
-       void (*timeout_function)(), int doselect)
+       struct timeval *deadline, void (*timeout_function)(), int doselect)
 {
   int nleft, nread;
   int r;
@@ -77,22 +50,27 @@ _readn(register int fd, register char *ptr, register int nbytes,
   struct timeval ltspfs_timeout;                /* Timeout */
   struct timeval *timeout_ptr = &ltspfs_timeout;
 
-  FD_ZERO(&set);
-  FD_SET(fd, &set);
-
   if (!doselect)
     timeout_ptr = NULL;
 
   nleft = nbytes;
 
   while (nleft > 0) {
-    ltspfs_timeout.tv_sec  = LTSPFS_TIMEOUT;
-    ltspfs_timeout.tv_usec = 0;
+    if (doselect && !time_left(deadline, &ltspfs_timeout)) {
+      timeout_function();
+      continue;
+    }
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
     r = select(FD_SETSIZE, &set, NULL, NULL, timeout_ptr);
-    if (r < 0)
+    if (r < 0 && errno == EINTR) {
+      interrupted();		/* fuse giving up on a request, maybe */
+      continue;
+    }
+    else if (r < 0)
       return r;
     else if (r == 0)
-      timeout_function();	/* it's expected that this will never return */
+      continue;			/* deadline's checked at the top */
     else {
       nread = read(fd, ptr, nleft);
       if (nread < 0)
@@ -114,7 +92,7 @@ _readn(register int fd, register char *ptr, register int nbytes,
 
 int
 _writen(register int fd, register char *ptr, register int nbytes,
-        void (*timeout_function)(), int doselect)
+        struct timeval *deadline, void (*timeout_function)(), int doselect)
 {
   int nleft, nwritten;
   int r;
@@ -122,22 +100,25 @@ _writen(register int fd, register char *ptr, register int nbytes,
   struct timeval ltspfs_timeout;                /* Timeout */
   struct timeval *timeout_ptr = &ltspfs_timeout;
 
-  FD_ZERO(&set);
-  FD_SET(fd, &set);
-
   if (!doselect)
     timeout_ptr = NULL;
 
   nleft = nbytes;
 
   while (nleft > 0) {
-    ltspfs_timeout.tv_sec  = LTSPFS_TIMEOUT;
-    ltspfs_timeout.tv_usec = 0;
+    if (doselect && !time_left(deadline, &ltspfs_timeout)) {
+      timeout_function();
+      continue;
+    }
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
     r = select(FD_SETSIZE, NULL, &set, NULL, timeout_ptr);
-    if (r < 0)
+    if (r < 0 && errno == EINTR)
+      continue;
+    else if (r < 0)
       return r;
     else if (r == 0)
-      timeout_function();	/* it's expected that this will never return */
+      continue;
     else {
       nwritten = write(fd, ptr, nleft);
       if (nwritten <= 0)
@@ -158,11 +139,11 @@ _writen(register int fd, register char *ptr, register int nbytes,
 int
 readn(register int fd, register char *ptr, register int maxlen)
 {
-  return _readn(fd, ptr, maxlen, &timeout, 1);
+  return _readn(fd, ptr, maxlen, &op_deadline, &timeout, 1);
 }
 
 int
 writen(register int fd, register char *ptr, register int nbytes)
 {
-  return _writen(fd, ptr, nbytes, &timeout, 1);
+  return _writen(fd, ptr, nbytes, &op_deadline, &timeout, 1);
 }
@@ -15,21 +15,22 @@
  */
 
 extern int syslogopen;
+extern struct timeval op_deadline;	/* when the op on the wire times out */
 
 /*
  * function prototypes
  */
 
 int bindsocket(int port);
-int opensocket(char *hostname, int port);
 int readn(register int fd, register char *ptr, register int nbytes);
 int writen(register int fd, register char *ptr, register int nbytes);
 int _readn(register int fd, register char *ptr, register int nbytes,
-          void (*timeout_function)(), int doselect);
+          struct timeval *deadline, void (*timeout_function)(), int doselect);
 int _writen(register int fd, register char *ptr, register int nbytes,
-           void (*timeout_function)(), int doselect);
+           struct timeval *deadline, void (*timeout_function)(), int doselect);
 int streq (char *s1, char *s2);
 void timeout();
+void interrupted();
 
 int status_return(int sockfd, int result);
 void error_die(char *err);
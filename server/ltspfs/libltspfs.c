@@ -0,0 +1,758 @@
+/*
+ * libltspfs: a client for ltspfsd, for tools that don't want to go through
+ * a mount (see libltspfs.h).  The protocol's packet.c's, the same as
+ * ltspfs's, but there are no caches, and no thread of its own: nothing
+ * happens on a connection except what someone's called for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <rpc/types.h>
+#include <rpc/xdr.h>
+#include "ltspfs.h"
+#include "packet.h"
+#include "libltspfs.h"
+
+struct ltspfs {
+  struct pkt_conn conn;			/* first, so get() and put() find us */
+  int             broken;		/* lost the connection, or our place */
+  pthread_mutex_t lock;			/* whoever's talking to ltspfsd */
+};
+
+struct ltspfs_file {
+  LTSPFS *fs;
+  char   *path;
+};
+
+/*
+ * A page of directory entries, waiting on their attributes
+ */
+
+struct page {
+  int         count;
+  int         size;
+  char        **names;
+  char        **paths;
+  struct stat *stbufs;
+  int         *err;
+};
+
+/*
+ * lose:
+ *
+ * Gives up on a connection.  Once a request or an answer's gone missing,
+ * or half of one, there's no telling which answer's which any more.
+ */
+
+static int
+lose(LTSPFS *fs)
+{
+  fs->broken = TRUE;
+  errno = ENOTCONN;
+  return -1;
+}
+
+/*
+ * wait_for:
+ *
+ * Waits for the socket to be readable, or writable.  FALSE if ltspfsd's
+ * kept us waiting longer than TIMEOUT_MAX.
+ */
+
+static int
+wait_for(int fd, int writing)
+{
+  fd_set set;
+  struct timeval tv;
+  int r;
+
+  do {
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    tv.tv_sec  = TIMEOUT_MAX;
+    tv.tv_usec = 0;
+    r = select(fd + 1, writing ? NULL : &set, writing ? &set : NULL,
+               NULL, &tv);
+  } while (r < 0 && errno == EINTR);
+
+  return r > 0;
+}
+
+/*
+ * get, put:
+ *
+ * Read and write exactly len bytes.  len, or -1 and the connection's lost.
+ */
+
+static int
+get(struct pkt_conn *c, char *buf, int len)
+{
+  int     left = len;
+  ssize_t n;
+
+  while (left) {
+    if (!wait_for(c->fd, FALSE))
+      return lose((LTSPFS *)c);
+    n = recv(c->fd, buf, left, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return lose((LTSPFS *)c);
+    buf  += n;
+    left -= n;
+  }
+
+  return len;
+}
+
+static int
+put(struct pkt_conn *c, const char *buf, int len)
+{
+  int     left = len;
+  ssize_t n;
+
+  while (left) {
+    if (!wait_for(c->fd, TRUE))
+      return lose((LTSPFS *)c);
+    n = send(c->fd, buf, left, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return lose((LTSPFS *)c);
+    buf  += n;
+    left -= n;
+  }
+
+  return len;
+}
+
+/*
+ * send_packet:
+ *
+ * Fills in the length of a request, and sends it.
+ */
+
+static int
+send_packet(LTSPFS *fs, XDR *out, char *outbuf)
+{
+  return pkt_send(&fs->conn, out, outbuf) < 0 ? lose(fs) : 0;
+}
+
+/*
+ * recv_packet:
+ *
+ * Reads the next answer, with in left just past the length.  ltspfsd
+ * sends change notifications for the directories it's been asked to
+ * look up, which we only do to list them, and we've no use for them, so
+ * any that turn up are skipped.
+ */
+
+static int
+recv_packet(LTSPFS *fs, XDR *in, char *inbuf)
+{
+  xdrmem_create(in, inbuf, LTSP_MAXBUF, XDR_DECODE);
+
+  do {
+    if (pkt_recv(&fs->conn, in, inbuf) < 0)
+      return lose(fs);
+  } while (packet_word(inbuf, 1) == LTSP_STATUS_NOTIFY);
+
+  return 0;
+}
+
+/*
+ * ltspfs_connect:
+ *
+ * Connects to ltspfsd, authorizes, and mounts dir.
+ */
+
+LTSPFS *
+ltspfs_connect(const char *host, const char *dir)
+{
+  XDR  in;
+  char inbuf[LTSP_MAXBUF];
+  LTSPFS *fs;
+  int  err;
+
+  if (!(fs = calloc(1, sizeof(LTSPFS))))
+    return NULL;
+  fs->conn.get = get;
+  fs->conn.put = put;
+
+  if (pkt_connect(&fs->conn, host, PORT)) {
+    free(fs);
+    return NULL;
+  }
+  pthread_mutex_init(&fs->lock, NULL);
+
+  if (pkt_authorize(&fs->conn, &in, inbuf) || pkt_status(&in) ||
+      pkt_mount(&fs->conn, dir))
+    goto fail;
+
+  return fs;
+
+ fail:
+  err = errno;
+  ltspfs_disconnect(fs);
+  errno = err;
+  return NULL;
+}
+
+/*
+ * ltspfs_disconnect:
+ *
+ * Hangs up.  ltspfsd unmounts what we mounted when it sees us go.
+ */
+
+void
+ltspfs_disconnect(LTSPFS *fs)
+{
+  close(fs->conn.fd);
+  pthread_mutex_destroy(&fs->lock);
+  free(fs);
+}
+
+/*
+ * lock, unlock:
+ *
+ * Take the connection, for one request and its answer, or a batch of
+ * them.  lock() fails if the connection's already been lost.
+ */
+
+static int
+lock(LTSPFS *fs)
+{
+  pthread_mutex_lock(&fs->lock);
+  if (!fs->broken)
+    return 0;
+
+  pthread_mutex_unlock(&fs->lock);
+  errno = ENOTCONN;
+  return -1;
+}
+
+static void
+unlock(LTSPFS *fs)
+{
+  pthread_mutex_unlock(&fs->lock);
+}
+
+/*
+ * stat_batch:
+ *
+ * Asks for the attributes of a batch of names in the directory with node
+ * id, or of paths, if it's 0.  Up to STAT_BATCH of the requests go out
+ * before the first answer's read, and after that one goes out for every
+ * answer that comes in.
+ */
+
+static int
+stat_batch(LTSPFS *fs, int count, unsigned int id, const char **names,
+	   struct stat *stbufs, int *err)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  sent = 0, got, r = 0;
+
+  if (lock(fs))
+    return -1;
+
+  for (got = 0; got < count && !r; got++) {
+    while (sent < count && sent - got < STAT_BATCH && !r) {
+      pkt_start(&out, outbuf, LTSPFS_GETATTR);
+      pkt_path(&out, id, names[sent++]);
+      r = send_packet(fs, &out, outbuf);
+    }
+
+    if (r || (r = recv_packet(fs, &in, inbuf)))
+      break;
+
+    if (pkt_status(&in))
+      err[got] = errno;
+    else if (!parse_stat(&in, &stbufs[got]))
+      err[got] = EIO;
+    else
+      err[got] = 0;
+    xdr_destroy(&in);
+  }
+
+  unlock(fs);
+  return r;
+}
+
+/*
+ * ltspfs_stat_many:
+ *
+ * Asks for the attributes of a batch of paths.
+ */
+
+int
+ltspfs_stat_many(LTSPFS *fs, int count, const char **paths,
+		 struct stat *stbufs, int *err)
+{
+  return stat_batch(fs, count, 0, paths, stbufs, err);
+}
+
+/*
+ * ltspfs_stat:
+ *
+ * lstat().
+ */
+
+int
+ltspfs_stat(LTSPFS *fs, const char *path, struct stat *stbuf)
+{
+  int err;
+
+  if (ltspfs_stat_many(fs, 1, &path, stbuf, &err))
+    return -1;
+
+  errno = err;
+  return err ? -1 : 0;
+}
+
+/*
+ * page_add:
+ *
+ * Adds an entry to a page of the listing of dir.
+ */
+
+static int
+page_add(struct page *pg, const char *dir, const char *name,
+	 u_quad_t ino, unsigned char type)
+{
+  int  size;
+  void *p;
+
+  if (pg->count == pg->size) {
+    size = pg->size ? pg->size * 2 : 64;
+    if (!(p = realloc(pg->names, size * sizeof(char *))))
+      return -1;
+    pg->names = p;
+    if (!(p = realloc(pg->paths, size * sizeof(char *))))
+      return -1;
+    pg->paths = p;
+    if (!(p = realloc(pg->stbufs, size * sizeof(struct stat))))
+      return -1;
+    pg->stbufs = p;
+    if (!(p = realloc(pg->err, size * sizeof(int))))
+      return -1;
+    pg->err = p;
+    pg->size = size;
+  }
+
+  size = strlen(dir) + strlen(name) + 2;
+  if (!(pg->paths[pg->count] = malloc(size)))
+    return -1;
+  snprintf(pg->paths[pg->count], size, "%s%s%s", dir,
+           dir[strlen(dir) - 1] == '/' ? "" : "/", name);
+  pg->names[pg->count] = strrchr(pg->paths[pg->count], '/') + 1;
+
+  memset(&pg->stbufs[pg->count], 0, sizeof(struct stat));
+  pg->stbufs[pg->count].st_ino  = ino;
+  pg->stbufs[pg->count].st_mode = type << 12;	/* DT_ to S_IF */
+  pg->count++;
+
+  return 0;
+}
+
+/*
+ * page_clear:
+ *
+ * Empties a page, for the next one.
+ */
+
+static void
+page_clear(struct page *pg)
+{
+  while (pg->count)
+    free(pg->paths[--pg->count]);
+}
+
+/*
+ * read_page:
+ *
+ * Fetches the next page of a listing, from the cookie on, into pg.  The
+ * handle's ltspfsd's for the directory stream, 0 to start a new one.
+ */
+
+static int
+read_page(LTSPFS *fs, const char *path, unsigned int *handle,
+	  quad_t *cookie, int *eof, struct page *pg)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  char name[PATH_MAX];
+  char *ptr;
+  u_quad_t ino;
+  unsigned char type;
+  int  more, r;
+
+  if (lock(fs))
+    return -1;
+
+  pkt_start(&out, outbuf, LTSPFS_READDIRPAGE);
+  xdr_u_int(&out, handle);			/* build stream handle */
+  xdr_longlong_t(&out, cookie);			/* build cookie */
+  pkt_path(&out, 0, path);
+
+  r = send_packet(fs, &out, outbuf);
+  if (!r)
+    r = recv_packet(fs, &in, inbuf);
+  unlock(fs);
+
+  if (r || pkt_status(&in))
+    return -1;
+
+  if (!xdr_u_int(&in, handle))
+    goto bad;
+
+  while (xdr_int(&in, &more) && more) {
+    ptr = name;
+    if (!xdr_u_longlong_t(&in, &ino) || !xdr_u_char(&in, &type) ||
+        !xdr_string(&in, &ptr, PATH_MAX) || !xdr_longlong_t(&in, cookie))
+      goto bad;
+    if (strcmp(name, ".") && strcmp(name, "..") &&
+        page_add(pg, path, name, ino, type))
+      return -1;
+  }
+
+  if (xdr_int(&in, eof))
+    return 0;
+
+ bad:
+  errno = EIO;
+  return -1;
+}
+
+/*
+ * lookup:
+ *
+ * Gets the node id ltspfsd hands back for a directory, so what's in it can
+ * be asked for by name, which saves ltspfsd going down the whole path for
+ * every entry.  0 if there isn't one.
+ */
+
+static unsigned int
+lookup(LTSPFS *fs, const char *path)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  struct stat stbuf;
+  unsigned int id;
+  int  r;
+
+  if (lock(fs))
+    return 0;
+
+  pkt_start(&out, outbuf, LTSPFS_LOOKUP);
+  pkt_path(&out, 0, path);
+
+  r = send_packet(fs, &out, outbuf);
+  if (!r)
+    r = recv_packet(fs, &in, inbuf);
+  unlock(fs);
+
+  if (r || pkt_status(&in) || !parse_stat(&in, &stbuf) ||
+      !S_ISDIR(stbuf.st_mode) || !xdr_u_int(&in, &id))
+    return 0;
+
+  return id;
+}
+
+/*
+ * ltspfs_readdir:
+ *
+ * Lists a directory a page at a time, and gets the attributes for each
+ * page's entries in a batch, by name in the directory's node.  If ltspfsd
+ * has let the node go since, and says ESTALE, they're asked for again by
+ * their full paths.
+ */
+
+int
+ltspfs_readdir(LTSPFS *fs, const char *path, ltspfs_dir_fn fn, void *arg)
+{
+  struct page pg;
+  unsigned int handle = 0, id;
+  quad_t cookie = 0;
+  int  i, eof = FALSE, stop = FALSE, r = 0;
+
+  memset(&pg, 0, sizeof(pg));
+  id = lookup(fs, path);
+
+  while (!eof && !stop && !r) {
+    if ((r = read_page(fs, path, &handle, &cookie, &eof, &pg)))
+      break;
+
+    if (pg.count && (r = stat_batch(fs, pg.count, id,
+                                    (const char **)(id ? pg.names : pg.paths),
+                                    pg.stbufs, pg.err)))
+      break;
+
+    for (i = 0; i < pg.count && !r; i++)
+      if (id && pg.err[i] == ESTALE) {		/* from here on */
+        id = 0;
+        r = stat_batch(fs, pg.count - i, 0, (const char **)pg.paths + i,
+                       pg.stbufs + i, pg.err + i);
+      }
+    if (r)
+      break;
+
+    for (i = 0; i < pg.count && !stop; i++)
+      stop = fn(arg, pg.names[i], &pg.stbufs[i]);
+    page_clear(&pg);
+  }
+
+  page_clear(&pg);
+  free(pg.names);
+  free(pg.paths);
+  free(pg.stbufs);
+  free(pg.err);
+
+  return r;
+}
+
+/*
+ * ltspfs_open:
+ *
+ * open().  ltspfsd opens the file for every read and write, so this only
+ * checks it can be, and creates or truncates it if it's asked to.
+ */
+
+LTSPFS_FILE *
+ltspfs_open(LTSPFS *fs, const char *path, int flags, mode_t mode)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  u_int m = mode;
+  LTSPFS_FILE *f;
+  int  r;
+
+  if (!(f = calloc(1, sizeof(LTSPFS_FILE))) || !(f->path = strdup(path))) {
+    free(f);
+    return NULL;
+  }
+  f->fs = fs;
+
+  pkt_start(&out, outbuf, flags & O_CREAT ? LTSPFS_CREATE : LTSPFS_OPEN);
+  xdr_int(&out, &flags);			/* build open flags */
+  if (flags & O_CREAT)
+    xdr_u_int(&out, &m);			/* build mode */
+  pkt_path(&out, 0, path);
+
+  if (lock(fs)) {
+    xdr_destroy(&out);
+    r = -1;
+  } else {
+    r = send_packet(fs, &out, outbuf);
+    if (!r)
+      r = recv_packet(fs, &in, inbuf);
+    unlock(fs);
+  }
+
+  if (!r && !(r = pkt_status(&in)))
+    return f;
+
+  ltspfs_close(f);
+  return NULL;
+}
+
+/*
+ * ltspfs_close:
+ *
+ * close().  There's nothing to tell ltspfsd.
+ */
+
+int
+ltspfs_close(LTSPFS_FILE *f)
+{
+  free(f->path);
+  free(f);
+  return 0;
+}
+
+/*
+ * send_read:
+ *
+ * Asks for a piece of a file.
+ */
+
+static int
+send_read(LTSPFS_FILE *f, unsigned int size, off_t offset)
+{
+  XDR  out;
+  char outbuf[LTSP_MAXBUF];
+
+  pkt_start(&out, outbuf, LTSPFS_READ);
+  xdr_u_int(&out, &size);			/* build packet size */
+  xdr_longlong_t(&out, &offset);		/* build file offset */
+  pkt_path(&out, 0, f->path);
+
+  return send_packet(f->fs, &out, outbuf);
+}
+
+/*
+ * ltspfs_pread:
+ *
+ * pread().  Big reads go in READ_CHUNK_MAX pieces, READ_WINDOW of them
+ * asked for at a time, so ltspfsd's reading the next while the last's on
+ * the wire.  The answers come back in order, straight into buf.
+ */
+
+ssize_t
+ltspfs_pread(LTSPFS_FILE *f, void *buf, size_t size, off_t offset)
+{
+  XDR    in;
+  char   inbuf[LTSP_MAXBUF];
+  size_t asked = 0, done = 0, len;
+  int    sent = 0, got, returned, stop = FALSE, err = 0;
+
+  if (lock(f->fs))
+    return -1;
+
+  for (got = 0; got < sent || (!got && size); got++) {
+    while (!stop && asked < size && sent - got < READ_WINDOW) {
+      len = size - asked > READ_CHUNK_MAX ? READ_CHUNK_MAX : size - asked;
+      if (send_read(f, len, offset + asked))
+        goto lost;
+      asked += len;
+      sent++;
+    }
+
+    if (recv_packet(f->fs, &in, inbuf))
+      goto lost;
+
+    if (pkt_status(&in)) {				/* no payload */
+      if (!stop)
+        err = errno;
+      stop = TRUE;
+      continue;
+    }
+    if (!xdr_int(&in, &returned) || returned < 0 ||
+        (size_t)returned > READ_CHUNK_MAX)
+      goto lost;
+
+    /*
+     * Anything after a short piece is read, so the answers stay in step,
+     * but not kept.
+     */
+
+    len = (size_t)got * READ_CHUNK_MAX;
+    if (stop || len + returned > size) {
+      while (returned > 0) {
+        len = returned > LTSP_MAXBUF ? LTSP_MAXBUF : returned;
+        if (get(&f->fs->conn, inbuf, len) < 0)
+          goto lost;
+        returned -= len;
+      }
+      continue;
+    }
+
+    if (get(&f->fs->conn, (char *)buf + len, returned) < 0)
+      goto lost;
+    done += returned;
+
+    len = size - len > READ_CHUNK_MAX ? READ_CHUNK_MAX : size - len;
+    if ((size_t)returned < len)			/* end of file */
+      stop = TRUE;
+  }
+
+  unlock(f->fs);
+
+  if (!done && err) {
+    errno = err;
+    return -1;
+  }
+  return done;
+
+ lost:
+  lose(f->fs);
+  unlock(f->fs);
+  return -1;
+}
+
+/*
+ * ltspfs_pwrite:
+ *
+ * pwrite().  Big writes go in SCHED_CHUNK pieces, and as many are sent
+ * without waiting for the answers as fit in WRITE_WINDOW_MIN.
+ */
+
+ssize_t
+ltspfs_pwrite(LTSPFS_FILE *f, const void *buf, size_t size, off_t offset)
+{
+  XDR    in, out;
+  char   inbuf[LTSP_MAXBUF];
+  char   outbuf[LTSP_MAXBUF];
+  size_t asked = 0, done = 0, acked = 0;
+  u_int  len;
+  off_t  pos;
+  int    res, returned, stop = FALSE, err = 0;
+
+  if (lock(f->fs))
+    return -1;
+
+  do {
+    while (!stop && asked < size && asked - acked < WRITE_WINDOW_MIN) {
+      len = size - asked > SCHED_CHUNK ? SCHED_CHUNK : size - asked;
+      pos = offset + asked;
+      pkt_start(&out, outbuf, LTSPFS_WRITE);
+      xdr_u_int(&out, &len);			/* build packet size */
+      xdr_longlong_t(&out, &pos);		/* build file offset */
+      pkt_path(&out, 0, f->path);
+      if (send_packet(f->fs, &out, outbuf) ||
+          put(&f->fs->conn, (const char *)buf + asked, len) < 0)
+        goto lost;
+      asked += len;
+    }
+
+    if (acked == asked)
+      break;
+
+    if (recv_packet(f->fs, &in, inbuf))
+      goto lost;
+
+    len = asked - acked > SCHED_CHUNK ? SCHED_CHUNK : asked - acked;
+    acked += len;
+
+    if (!xdr_int(&in, &res) || !xdr_int(&in, &returned))
+      goto lost;
+    if (stop)
+      continue;
+
+    if (res) {					/* returned's the errno */
+      err  = returned;
+      stop = TRUE;
+    } else {
+      done += returned;
+      if ((u_int)returned < len)		/* disk's full, say */
+        stop = TRUE;
+    }
+  } while (TRUE);
+
+  unlock(f->fs);
+
+  if (!done && err) {
+    errno = err;
+    return -1;
+  }
+  return done;
+
+ lost:
+  lose(f->fs);
+  unlock(f->fs);
+  return -1;
+}
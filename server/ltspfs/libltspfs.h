@@ -0,0 +1,84 @@
+/*
+ * libltspfs: talks to ltspfsd on a terminal directly, for tools on the
+ * server that would rather not go through an ltspfs mount, and pay for a
+ * trip through the kernel and fuse, a system call at a time.
+ *
+ * Paths are relative to the directory connected to, and start with a /,
+ * the same as in a mount.  Everything returns -1 (or NULL) with errno set
+ * when it fails, like the system calls it stands in for.  A connection can
+ * be used by any number of threads at once; each call has the connection
+ * to itself while it's talking to ltspfsd.  If the connection goes, or
+ * ltspfsd stops answering for two minutes, every call on it fails with
+ * ENOTCONN from then on.
+ *
+ * Build with `pkg-config --cflags --libs libltspfs`: it's compiled with
+ * 64 bit file offsets, and so must whatever uses it be.
+ */
+
+#ifndef LIBLTSPFS_H
+#define LIBLTSPFS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ltspfs      LTSPFS;		/* a connection */
+typedef struct ltspfs_file LTSPFS_FILE;		/* an open file on one */
+
+/*
+ * Called by ltspfs_readdir() for each entry, with its attributes.  A
+ * non-zero return stops the listing there.
+ */
+
+typedef int (*ltspfs_dir_fn)(void *arg, const char *name,
+			     const struct stat *stbuf);
+
+/*
+ * Connects to ltspfsd on host, and mounts dir on the terminal.  It's
+ * authorized the way ltspfs is, with the X cookie for $DISPLAY.
+ */
+
+LTSPFS *ltspfs_connect(const char *host, const char *dir);
+void    ltspfs_disconnect(LTSPFS *fs);
+
+/*
+ * lstat(), for one path, or a whole batch of them, which are all asked for
+ * before the first answer comes back.  ltspfs_stat_many() puts each one's
+ * errno, or 0, in err[], and only fails itself if the connection does.
+ */
+
+int ltspfs_stat(LTSPFS *fs, const char *path, struct stat *stbuf);
+int ltspfs_stat_many(LTSPFS *fs, int count, const char **paths,
+		     struct stat *stbufs, int *err);
+
+/*
+ * Lists a directory, leaving out . and .., and hands each entry to fn with
+ * its attributes, which are fetched a page of entries at a time.  An entry
+ * whose attributes couldn't be had gets just its type and inode number.
+ * No lock is held while fn's called, so it can use the connection too.
+ */
+
+int ltspfs_readdir(LTSPFS *fs, const char *path, ltspfs_dir_fn fn,
+		   void *arg);
+
+/*
+ * open(), pread(), pwrite() and close().  Large reads and writes are split
+ * up, and the pieces sent without waiting on the answers to the last ones.
+ */
+
+LTSPFS_FILE *ltspfs_open(LTSPFS *fs, const char *path, int flags,
+			 mode_t mode);
+ssize_t      ltspfs_pread(LTSPFS_FILE *f, void *buf, size_t size,
+			  off_t offset);
+ssize_t      ltspfs_pwrite(LTSPFS_FILE *f, const void *buf, size_t size,
+			   off_t offset);
+int          ltspfs_close(LTSPFS_FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,1084 +13,6487 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/statfs.h>
+#include <sys/statvfs.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <fuse.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <syslog.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <rpc/xdr.h>
 #include "ltspfs.h"
 #include "common.h"
+#include "packet.h"
+#include "transfer.h"
 
 /*
  * Globals.
  */
 
-static        pthread_mutex_t lock;		/* mutex needed for Fuse */
-static int    sockfd;				/* Global socket */
+static struct pkt_conn sock;			/* Global socket */
 static char   *fuse_mount_point;		/* Local mount point */
 static struct fuse_context *fc = NULL;		/* Fuse context for uid */
+static volatile sig_atomic_t stats_wanted;	/* SIGUSR1 seen */
 
 /*
- * init_pkt()
+ * Socket scheduler.  Only one request can be on the wire at a time, so
+ * everyone waits their turn for the socket here.  Waiters are let in by
+ * class: metadata first, then interactive reads, then bulk data (the rest
+ * of large reads, and writes).  Bulk transfers are sent in SCHED_CHUNK
+ * pieces, giving up the socket in between, so a getattr never waits
+ * behind more than one chunk.  Large reads are the exception: they keep
+ * up to READ_WINDOW pieces in flight, and only stop adding to them once
+ * somebody else wants the socket.
+ */
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sched_cond[SCHED_CLASSES];
+static int             sched_busy;		/* socket's in use */
+static int             sched_waiting[SCHED_CLASSES];	/* queue depths */
+static int             sched_peak[SCHED_CLASSES];	/* deepest they got */
+static unsigned long   sched_sent[SCHED_CLASSES];	/* requests let through */
+static char            *sched_name[SCHED_CLASSES] = { "meta", "read", "bulk" };
+static int             sched_class;		/* the holder's, for tracing */
+static struct timeval  sched_since;		/* when they got it */
+
+/*
+ * Rate limiting.  File data can fill the terminal's link, and then the
+ * user's X session, which shares it, crawls.  With "-o ratelimit=<KB/s>",
+ * reads and writes go through a token bucket.  With "-o adaptive", the
+ * rate also follows the link: while data's flowing, the ping thread times
+ * a PING every second, and if the round trip has grown well past the best
+ * we've seen, the rate's halved.  Otherwise it creeps back up towards the
+ * ceiling.  Metadata is never held up.
+ */
+
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static double          rate_ceiling;		/* bytes/sec, 0 if unlimited */
+static double          rate;			/* current rate, bytes/sec */
+static double          rate_tokens;		/* may go negative */
+static struct timeval  rate_last;		/* last refill */
+static unsigned long   rate_bytes;		/* shaped since the last probe */
+static unsigned long   rate_slept;		/* msecs spent waiting */
+static int             adaptive = FALSE;	/* -o adaptive */
+static double          rtt_min;			/* best round trip, secs */
+static double          rtt_last;		/* latest round trip, secs */
+
+/*
+ * Timeouts.  Each request gets a deadline, worked out from how long
+ * requests have been taking (smoothed the way TCP does its RTO) plus the
+ * time its payload should take at the rate data's been moving, times
+ * TIMEOUT_SCALE.  A getattr to a dead terminal is noticed in a few
+ * seconds.  When a deadline passes, but the terminal's kernel has acked
+ * something since the deadline was last set (keepalive probes get acked
+ * while it's sitting on a request), it's alive, just slow (a DVD spinning
+ * up, say), so it gets another go, up to TIMEOUT_MAX from when the request
+ * started.  Only touched by whoever holds the socket.
+ */
+
+struct timeval         op_deadline;		/* for the request on the wire */
+static struct timeval  op_began;
+static struct timeval  op_slide;		/* deadline's worked out from */
+static int             op_slid;			/* its deadline's been moved */
+static double          rtt_srtt;		/* smoothed round trip, secs */
+static double          rtt_var;			/* and its variation */
+static double          xput;			/* bytes/sec, 0 till we know */
+static unsigned long   op_extended;		/* deadlines we've let slide */
+static int             op_opcode;		/* last one sent, for tracing */
+
+/*
+ * Cancelling.  The packets we send are numbered, from 1, and ltspfsd
+ * counts them too, so that's how a request's known to both of us.  When
+ * fuse interrupts a request we're waiting on ltspfsd for (someone gave up
+ * on a copy, say), we send a CANCEL with its number, and if it's one that
+ * takes a while, ltspfsd stops working on it.  Its answer still comes
+ * back, cut short, so the answers stay in step, and we stop asking for
+ * any more of it.  The numbers come from sock.sent.  ltspfs-get stops the
+ * same way on ^C.  Only touched by whoever holds the socket.
+ */
+
+static unsigned int    op_awaited;		/* the answer we're waiting on */
+static int             op_cancelled;		/* CANCEL sent for this one */
+static unsigned long   op_cancels;		/* CANCELs sent, ever */
+static volatile sig_atomic_t op_stop;		/* ^C, in ltspfs-get */
+
+/*
+ * Node cache.  Maps directory paths to the node ids that ltspfsd hands back
+ * in LOOKUP replies, so we can send "node + last component" instead of the
+ * full path every time.
+ */
+
+struct node {
+  char         *path;				/* directory path */
+  unsigned int id;				/* ltspfsd's node id */
+  struct node  *next;				/* hash chain */
+};
+
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct node     *node_hash[NODE_HASH];
+static int             node_count;
+
+/*
+ * Attribute cache.  getattr answers are kept for up to ATTR_TTL seconds,
+ * and statfs answers for the root of the mount (or of each share) for
+ * STATFS_TTL.  Anything we change is dropped as soon as we've changed it,
+ * and so is anything ltspfsd tells us was changed on the terminal.  With
+ * "-o prewarm", the root of a new mount gets fetched in the background,
+ * so it's all here by the time the user's file manager asks.
+ */
+
+struct attr {
+  char        *path;
+  struct stat st;				/* uid and gid are the terminal's */
+  time_t      expires;
+  struct attr *next;				/* hash chain */
+};
+
+struct fsattr {
+  int      type, bsize, namelen;
+  u_quad_t blocks, bfree, bavail, files, ffree;
+  time_t   expires;				/* 0 if nothing cached */
+};
+
+static pthread_mutex_t attr_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct attr     *attr_hash[NODE_HASH];
+static int             attr_count;
+static unsigned int    attr_gen;		/* bumped by every forget */
+static unsigned long   attr_hits, attr_misses;
+static struct fsattr   fs_cache[SHARE_MAX];	/* one per share, or just [0] */
+static int             prewarm = FALSE;		/* -o prewarm */
+
+/*
+ * Close-to-open.  OPEN tells us a file's size and mtime, and we remember
+ * them.  If they're the same at the next open, nobody's changed the file
+ * in between, so the kernel can keep the pages it's got cached for it
+ * instead of reading it all over again.  If they're not, or we've never
+ * seen it, the cache gets dropped.  Also protected by attr_lock.
+ */
+
+struct fver {
+  char        *path;
+  off_t       size;
+  long        mtime;
+  long        nsec;
+  struct fver *next;				/* hash chain */
+};
+
+static struct fver     *fver_hash[NODE_HASH];
+static int             fver_count;
+static unsigned long   fver_kept, fver_dropped;
+
+/*
+ * Head prefetch.  A thumbnailer goes through a folder reading the start of
+ * one file after another, a round trip or more for each.  Once HEAD_RUN
+ * files in a row in one directory have been read from the start, and no
+ * further, ltspfsd's asked for the heads of the files that come next in
+ * the directory, all in one go, in the background.  They're kept here till
+ * they're read, and used if the file's size and mtime at open are what
+ * they were when its head was fetched.  Once fewer than half of them are
+ * left unread, the next batch goes out.  The batch says everything about
+ * each file that an open would, so for ATTR_TTL seconds, the first open
+ * to read one doesn't have to go over the wire either.
+ */
+
+struct head {
+  char         *path;
+  off_t        size;				/* when the head was read */
+  long         mtime;
+  long         nsec;
+  u_quad_t     volume;				/* which file it is */
+  u_quad_t     ino;
+  time_t       expires;				/* for opening it */
+  unsigned int len;				/* bytes of it we've got */
+  char         *data;
+  int          used;				/* it's been read */
+  struct head  *next;				/* newer */
+};
+
+struct headreq {
+  char         dir[PATH_MAX];
+  char         after[PATH_MAX];			/* fetch what follows this */
+  unsigned int size;
+  int          count;
+};
+
+static pthread_mutex_t head_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct head     *heads, *heads_tail;	/* oldest first */
+static char            head_dir[PATH_MAX];	/* where the run is */
+static char            head_last[PATH_MAX];	/* last file read in it */
+static char            head_end[PATH_MAX];	/* last head fetched from it */
+static int             head_run;		/* files read in a row */
+static unsigned int    head_size;		/* most read from any of them */
+static int             head_busy;		/* a batch is on its way */
+static int             head_stop;		/* no more in this directory */
+static int             head_usable = TRUE;	/* FALSE if ltspfsd can't */
+static unsigned long   head_fetched, head_hits;
+
+/*
+ * Directory listings.  Going back and forth between folders, a file
+ * manager lists the same few over and over.  Once a directory's been read
+ * right through, its listing's kept, with the mtime and ctime it had before
+ * the listing began.  The next time it's read from the start, they're
+ * checked against its attributes, which are usually in the attribute cache,
+ * or a GETATTR away, and if neither's moved, the listing's handed out again.
+ * It carries ltspfsd's cookies, so if the rest of it goes missing part way,
+ * it can still come from ltspfsd.  Whatever forgets a directory's
+ * attributes forgets its listing too, which covers our own changes and
+ * ltspfsd's notifications.  A listing's freed once neither the cache nor
+ * anyone reading it holds it.
+ */
+
+struct dent {
+  u_quad_t      ino;
+  off_t         cookie;				/* where the next one is */
+  unsigned int  name;				/* offset in names */
+  unsigned char type;
+};
+
+struct dirlist {
+  char           *path;
+  struct timespec mtime;			/* the directory's, when listed */
+  struct timespec ctime;
+  ino_t          ino;
+  int            count;
+  struct dent    *ents;
+  char           *names;
+  int            refs;				/* the cache's, and readers' */
+  struct dirlist *next;				/* hash chain */
+};
+
+struct dirfill {				/* a listing being collected */
+  struct stat  st;				/* the directory's, beforehand */
+  unsigned int gen;
+  off_t        next;				/* cookie we've got up to */
+  int          count, size;			/* entries, and room for them */
+  struct dent  *ents;
+  unsigned int used, room;			/* same, for names */
+  char         *names;
+};
+
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dirlist  *dir_hash[NODE_HASH];
+static int             dir_count;
+static unsigned int    dir_gen;			/* bumped by every forget */
+static unsigned long   dir_hits, dir_misses;
+
+/*
+ * Memory budget.  The caches above allocate through mem_get(), which
+ * keeps them all under "-o memlimit=<KB>" between them (MEM_DEFAULT if
+ * that's not given).  When something won't fit, room's made in whichever
+ * cache is worth least for its size: its recent hits, times the round
+ * trips it'd take to get an entry back, over the bytes it's using.  A
+ * cache someone else has locked is passed over.
+ *
+ * With "-o servermemlimit=<MB>", every ltspfs on the server publishes what
+ * it's using, once a second, in a shared segment.  Each can then only grow
+ * into what's left of the server's budget, and when the server's over,
+ * each gives back its share of the excess.  As with the shared cache, the
+ * segment's per user, unless an admin has made MEM_SHM_NAME for everyone.
+ */
+
+struct mem_cache {
+  char            *name;
+  pthread_mutex_t *lock;			/* the cache's own */
+  int             cost;				/* round trips to refetch one */
+  size_t          (*shrink)(size_t want);	/* called with *lock held */
+  size_t          used;				/* bytes */
+  unsigned long   hits;				/* lately: halved every second */
+  unsigned long   evicted;			/* bytes pushed out */
+};
+
+union mem_head {				/* in front of each allocation */
+  struct {
+    size_t size;				/* including this */
+    int    cache;
+  } h;
+  long double align;
+};
+
+struct mem_proc {
+  pid_t  pid;					/* 0 if the slot's free */
+  size_t used;
+};
+
+static size_t node_shrink(size_t want);
+static size_t attr_shrink(size_t want);
+static size_t fver_shrink(size_t want);
+static size_t head_shrink(size_t want);
+static size_t dir_shrink(size_t want);
+
+static pthread_mutex_t  mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mem_cache mem_caches[MEM_CACHES] = {
+  { "nodes",    &node_lock, 1, node_shrink, 0, 0, 0 },
+  { "attrs",    &attr_lock, 1, attr_shrink, 0, 0, 0 },
+  { "versions", &attr_lock, 8, fver_shrink, 0, 0, 0 },	/* a whole file */
+  { "heads",    &head_lock, 2, head_shrink, 0, 0, 0 },
+  { "listings", &dir_lock,  4, dir_shrink,  0, 0, 0 },	/* a page or more */
+};
+static size_t           mem_used;
+static size_t           mem_budget;		/* -o memlimit, bytes */
+static size_t           mem_limit;		/* what we can have right now */
+static double           mem_server;		/* -o servermemlimit, bytes */
+static struct mem_proc  *mem_procs;		/* NULL if not in use */
+static struct mem_proc  *mem_self;		/* our slot */
+static size_t           mem_server_used;	/* everyone's, last we looked */
+static int              mem_server_count;
+
+/*
+ * Shared cache.  With "-o sharedcache=<MB>", file data is also kept in a
+ * shared memory segment that every ltspfs on the server can use, so when a
+ * lab full of terminals all read the same file off the same DVD, it only
+ * crosses the network once.  Blocks are keyed by which file they came
+ * from, as best we can tell: the terminal's filesystem id and inode, and
+ * the size and mtime.  Terminals can easily have files that look alike by
+ * all of those, so before a block's used, ltspfsd sums the real thing and
+ * we check ours against it.
+ *
+ * The segment's size is the budget for everyone using it.  It's cut into
+ * SHM_BLOCK slots, SHM_WAYS to a set.  A block can only go in its own set,
+ * where it pushes out whichever slot was used longest ago.  Anybody who
+ * can map the segment can read everything in it, so each user gets their
+ * own, unless there's one called SHM_NAME: an admin can make that, owned
+ * by a group ltspfs is setgid to, for everyone to share.
+ */
+
+struct shm_key {
+  u_quad_t volume;
+  u_quad_t ino;
+  off_t    size;
+  long     mtime;
+  long     nsec;
+  off_t    block;				/* offset / SHM_BLOCK */
+};
+
+struct shm_slot {
+  struct shm_key key;
+  int            used;
+  unsigned int   len;				/* short at end of file */
+  unsigned long  stamp;				/* when it was last used */
+};
+
+struct shm_head {
+  unsigned int    magic;			/* SHM_MAGIC once set up */
+  unsigned int    sets;
+  pthread_mutex_t lock;				/* process shared, robust */
+  unsigned long   clock;			/* for stamps */
+  unsigned long   hits, misses, bad;		/* everyone's, for stats */
+};
+
+static struct shm_head *shm = NULL;		/* NULL if not in use */
+static struct shm_slot *shm_slots;		/* sets * SHM_WAYS of them */
+static char            *shm_data;		/* SHM_BLOCK per slot */
+static size_t          shm_size;
+static double          shm_budget;		/* -o sharedcache, bytes */
+
+/*
+ * Shares.  With "-o multi", the root of the fuse mount is a directory of
+ * shares, each of them a separate export on the terminal, all over the one
+ * connection.  mkdir in the root attaches a share, and rmdir detaches it.
+ * Protected by node_lock.
+ */
+
+struct share {
+  char         *name;				/* NULL if the slot is free */
+  unsigned int id;				/* node id of the export root */
+};
+
+static int          multi = FALSE;		/* -o multi */
+static char         *export_base;		/* directory shares are under */
+static struct share shares[SHARE_MAX];
+
+/*
+ * Where we're mounted from, for side_open().
+ */
+
+static char         *mount_host;
+static char         *mount_dir;			/* the export, if not multi */
+
+/*
+ * Open files.  We keep the extent around the last read that's known to be
+ * data, so large reads of sparse files can skip the holes rather than
+ * fetch zeros, and which file it is, for the shared cache.  For writes,
+ * where the last one ended, so we can tell a sequential writer, and how
+ * much of what it's written ltspfsd hasn't acknowledged yet.  Hung off
+ * fi->fh.
+ */
+
+struct ofile {
+  off_t    from;				/* known data extent */
+  off_t    to;
+  int      seek;				/* FALSE if ltspfsd can't SEEK */
+  int      ident;				/* TRUE if we know the rest */
+  u_quad_t volume;				/* terminal's filesystem id */
+  u_quad_t ino;
+  off_t    size;				/* size and mtime at open */
+  long     mtime;
+  long     nsec;
+  off_t    wnext;				/* where the last write ended */
+  unsigned int wowed;				/* bytes written, not acked */
+  int      werr;				/* a streamed write's errno */
+};
+
+static pthread_mutex_t ofile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Open directories need ltspfsd's handle for the directory stream, and
+ * the cached listing they're reading, or the one they're collecting.
+ */
+
+struct odir {
+  unsigned int   handle;			/* 0 until ltspfsd gives us one */
+  struct dirlist *list;
+  int            pos;				/* next entry in it */
+  struct dirfill *fill;
+};
+
+/*
+ * Metadata updates (chmod, chown, utime) aren't waited on.  They're sent
+ * right away, and we remember that we're owed an answer.  ltspfsd answers
+ * requests in the order it gets them, so before reading anything else off
+ * the socket, the owed answers get collected.  Any errors are kept, and
+ * handed back at the next flush or fsync of that file.  If too many are
+ * owed already, the update's done there and then instead.
+ *
+ * Sequential writes are streamed the same way, keeping a copy of the data
+ * till they're acknowledged, in case they have to be resent.  Their errors
+ * are kept on the handle that wrote them, and come back at its flush,
+ * fsync or release; after one, the handle's writes wait for their answers.
+ *
+ * An update that comes back ESTALE is resent with the full path, but not
+ * there and then: whoever's collecting may have its own requests on the
+ * wire, whose answers come first.  It waits on the stale list till the
+ * socket's let go, or the next update's sent, when all that can be on the
+ * wire is answers we're owed.
+ *
+ * The lists are only touched by whoever holds the socket.
+ */
+
+struct pending {
+  int            opcode;			/* CHMOD, CHOWN, UTIME or WRITE */
+  char           *path;
+  unsigned int   arg1;				/* mode, or uid */
+  unsigned int   arg2;				/* gid */
+  long           actime;			/* utime times */
+  long           modtime;
+  char           *data;				/* write payload */
+  unsigned int   size;
+  off_t          offset;
+  struct ofile   *of;				/* the file it's owed to */
+  int            resent;			/* resent after ESTALE */
+  struct pending *next;
+};
+
+struct deferred {
+  char            *path;
+  int             err;				/* errno from ltspfsd */
+  struct deferred *next;
+};
+
+static struct pending  *pending_head = NULL;	/* oldest owed answer */
+static struct pending  *pending_tail = NULL;	/* newest owed answer */
+static struct pending  *stale_head = NULL;	/* waiting to be resent */
+static struct pending  *stale_tail = NULL;
+static int             pending_count;
+static struct deferred *deferred_head = NULL;	/* errors not reported yet */
+static int             deferred_count;
+
+/*
+ * Requests in flight that others can share.  When a directory's opened,
+ * the file manager, the thumbnailer and whatever's indexing it all tend
+ * to ask the same things at once.  A read-only request that's byte for
+ * byte the same as one already on its way, and asked for since anything
+ * was last forgotten, waits for that one's answer rather than going over
+ * the wire again.
+ */
+
+struct flight {
+  char          *key;				/* the request, less its length */
+  int           len;
+  unsigned int  gen;				/* attr_gen when it went out */
+  char          *reply;				/* NULL if it's no use to share */
+  int           done;				/* reply's in */
+  int           refs;				/* asker, plus everyone waiting */
+  struct flight *next;
+};
+
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  flight_cond = PTHREAD_COND_INITIALIZER;
+static struct flight   *flights;		/* on their way */
+static unsigned long   flight_shared;		/* answers that saved a trip */
+
+static void collect_pending(void);
+static void resend_stale(void);
+static void head_forget(const char *path, int how);
+static void dir_forget(const char *path, int how);
+static void dir_flush(void);
+static int  head_open(const char *path, struct fuse_file_info *fi);
+static int  notification(XDR *in);
+static void shm_lock(void);
+static void op_start(void);
+static long usecs(struct timeval *from, struct timeval *to);
+#if FUSE_MINOR_VERSION >= 3
+static void prewarm_start(const char *path);
+#endif
+
+/*
+ * sock_lock:
+ *
+ * Waits until the socket's free, and nobody in a more important class is
+ * waiting for it.
+ */
+
+static void
+sock_lock(int class)
+{
+  struct timeval asked;
+  int c;
+
+  TRACE_CLOCK(asked);
+  pthread_mutex_lock(&sched_mutex);
+
+  if (++sched_waiting[class] > sched_peak[class])
+    sched_peak[class] = sched_waiting[class];
+
+  for (;;) {
+    for (c = 0; c < class && !sched_waiting[c]; c++)
+      ;
+    if (!sched_busy && c == class)
+      break;
+    pthread_cond_wait(&sched_cond[class], &sched_mutex);
+  }
+
+  sched_waiting[class]--;
+  sched_sent[class]++;
+  sched_busy = TRUE;
+
+  pthread_mutex_unlock(&sched_mutex);
+
+  op_start();
+  op_cancelled = FALSE;
+  sched_class = class;
+  sched_since = op_began;
+  TRACE2(lock__acquire, class, usecs(&asked, &op_began));
+}
+
+/*
+ * sock_trylock:
+ *
+ * Takes the socket if nobody's using it or waiting for it.  Returns TRUE
+ * if we got it.
+ */
+
+static int
+sock_trylock(void)
+{
+  int c, r = FALSE;
+
+  pthread_mutex_lock(&sched_mutex);
+
+  for (c = 0; c < SCHED_CLASSES && !sched_waiting[c]; c++)
+    ;
+  if (!sched_busy && c == SCHED_CLASSES)
+    r = sched_busy = TRUE;
+
+  pthread_mutex_unlock(&sched_mutex);
+
+  if (r) {
+    op_start();
+    op_cancelled = FALSE;
+    sched_class = SCHED_META;
+    sched_since = op_began;
+    TRACE2(lock__acquire, SCHED_META, 0);
+  }
+
+  return r;
+}
+
+/*
+ * sock_wanted:
+ *
+ * TRUE if anybody's waiting for the socket.  For its holder, to see if it
+ * should let go.
+ */
+
+static int
+sock_wanted(void)
+{
+  int c;
+
+  pthread_mutex_lock(&sched_mutex);
+  for (c = 0; c < SCHED_CLASSES && !sched_waiting[c]; c++)
+    ;
+  pthread_mutex_unlock(&sched_mutex);
+
+  return c < SCHED_CLASSES;
+}
+
+/*
+ * sock_unlock:
+ *
+ * Gives up the socket, and wakes up the most important waiter.
+ */
+
+static void
+sock_unlock(void)
+{
+  struct timeval now;
+  int c;
+
+  if (stale_head)				/* only answers owed on the wire */
+    resend_stale();
+
+  TRACE_CLOCK(now);
+  TRACE2(lock__release, sched_class, usecs(&sched_since, &now));
+
+  pthread_mutex_lock(&sched_mutex);
+
+  sched_busy = FALSE;
+  for (c = 0; c < SCHED_CLASSES && !sched_waiting[c]; c++)
+    ;
+  if (c < SCHED_CLASSES)
+    pthread_cond_signal(&sched_cond[c]);
+
+  pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ * elapsed:
+ *
+ * Seconds from one time to another.
+ */
+
+static double
+elapsed(struct timeval *from, struct timeval *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+/*
+ * usecs:
+ *
+ * The same, in microseconds, for the tracepoints.
+ */
+
+static long
+usecs(struct timeval *from, struct timeval *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000L +
+         (to->tv_usec - from->tv_usec);
+}
+
+/*
+ * op_timeout:
+ *
+ * How long we'll give a request with a payload of bytes.  Until we've
+ * timed something, it's LTSPFS_TIMEOUT.
+ */
+
+static double
+op_timeout(unsigned int bytes)
+{
+  double t;
+
+  if (!rtt_srtt)
+    return LTSPFS_TIMEOUT;
+
+  t = rtt_srtt + 4 * rtt_var;
+  if (xput)
+    t += bytes / xput;
+  t *= TIMEOUT_SCALE;
+
+  if (t < TIMEOUT_MIN)
+    t = TIMEOUT_MIN;
+  if (t > TIMEOUT_MAX)
+    t = TIMEOUT_MAX;
+
+  return t;
+}
+
+/*
+ * op_expect:
+ *
+ * Sets the deadline for the request on the wire, which has a payload of
+ * bytes, either way.
+ */
+
+static void
+op_expect(unsigned int bytes)
+{
+  double t = op_timeout(bytes);
+
+  op_deadline.tv_sec  = op_slide.tv_sec + (long)t;
+  op_deadline.tv_usec = op_slide.tv_usec + (long)((t - (long)t) * 1e6);
+  if (op_deadline.tv_usec >= 1000000) {
+    op_deadline.tv_sec++;
+    op_deadline.tv_usec -= 1000000;
+  }
+}
+
+/*
+ * op_start:
+ *
+ * Starts the clock on a new request.
+ */
+
+static void
+op_start(void)
+{
+  gettimeofday(&op_began, NULL);
+  op_slide = op_began;
+  op_slid  = FALSE;
+  op_expect(0);
+}
+
+/*
+ * op_done:
+ *
+ * Feeds how long a request took into the estimates.  Requests with a big
+ * payload tell us about throughput, the rest about round trips.  One that
+ * stalled long enough to have its deadline moved says nothing about
+ * either.
+ */
+
+static void
+op_done(unsigned int bytes)
+{
+  struct timeval now;
+  double t, err;
+
+  gettimeofday(&now, NULL);
+  t = elapsed(&op_began, &now);
+  TRACE3(request__done, op_opcode, bytes, usecs(&op_began, &now));
+
+  if (op_slid)
+    return;
+
+  if (bytes >= XPUT_MIN) {
+    if ((t -= rtt_srtt) < 0.001)
+      t = 0.001;
+    xput = xput ? (7 * xput + bytes / t) / 8 : bytes / t;
+  } else if (!rtt_srtt) {
+    rtt_srtt = t;
+    rtt_var  = t / 2;
+  } else {
+    err = t - rtt_srtt;
+    rtt_srtt += err / 8;
+    rtt_var  += ((err < 0 ? -err : err) - rtt_var) / 4;
+  }
+}
+
+/*
+ * shape:
+ *
+ * Waits until we're allowed to move this many bytes of file data.  Called
+ * without the socket, so everyone else can carry on while we wait.
+ */
+
+static void
+shape(unsigned int bytes)
+{
+  struct timeval  now;
+  struct timespec nap;
+  double          burst, wait = 0;
+
+  if (!rate_ceiling)
+    return;
+
+  pthread_mutex_lock(&rate_lock);
+
+  gettimeofday(&now, NULL);
+  burst = rate / RATE_BURST > SCHED_CHUNK ? rate / RATE_BURST : SCHED_CHUNK;
+  rate_tokens += elapsed(&rate_last, &now) * rate;
+  if (rate_tokens > burst)
+    rate_tokens = burst;
+  rate_last = now;
+
+  rate_tokens -= bytes;				/* take ours, and queue up */
+  rate_bytes  += bytes;
+  if (rate_tokens < 0) {
+    wait = -rate_tokens / rate;
+    rate_slept += wait * 1000;
+  }
+
+  pthread_mutex_unlock(&rate_lock);
+
+  if (wait > 0) {
+    nap.tv_sec  = wait;
+    nap.tv_nsec = (wait - nap.tv_sec) * 1e9;
+    nanosleep(&nap, NULL);
+  }
+}
+
+/*
+ * rate_probe:
+ *
+ * TRUE if the round trip should be measured, because we're adapting, and
+ * data's been flowing since the last time.
+ */
+
+static int
+rate_probe(void)
+{
+  int r;
+
+  pthread_mutex_lock(&rate_lock);
+  r = adaptive && rate_bytes;
+  rate_bytes = 0;
+  pthread_mutex_unlock(&rate_lock);
+
+  return r;
+}
+
+/*
+ * rate_adapt:
+ *
+ * Adjusts the rate for a new round trip time.  A round trip well past the
+ * best one means queues are building up on the link, so back off hard.
+ * Otherwise, work back up to the ceiling.
+ */
+
+static void
+rate_adapt(double rtt)
+{
+  pthread_mutex_lock(&rate_lock);
+
+  if (!rtt_min || rtt < rtt_min)
+    rtt_min = rtt;
+  rtt_last = rtt;
+
+  if (rtt > RATE_INFLATE * rtt_min + RATE_SLACK / 1000.0) {
+    rate /= 2;
+    if (rate < RATE_FLOOR * 1024.0)
+      rate = RATE_FLOOR * 1024.0;
+  } else {
+    rate += rate_ceiling / 16;
+    if (rate > rate_ceiling)
+      rate = rate_ceiling;
+  }
+
+  pthread_mutex_unlock(&rate_lock);
+}
+
+/*
+ * mem_reclaim:
+ *
+ * Makes room for want more bytes, by pushing out whatever's worth least.
+ * The caller holds the lock for cache, or cache is -1.  Returns TRUE if
+ * there's room now.
+ */
+
+static int
+mem_reclaim(int cache, size_t want)
+{
+  pthread_mutex_t  *held = cache < 0 ? NULL : mem_caches[cache].lock;
+  struct mem_cache *m;
+  size_t target, freed;
+  double score, best = 0;
+  int    c, pick, passed = 0;			/* caches we couldn't shrink */
+
+  for (;;) {
+    pthread_mutex_lock(&mem_lock);
+    if (mem_used + want <= mem_limit) {
+      pthread_mutex_unlock(&mem_lock);
+      return TRUE;
+    }
+
+    target = mem_used + want - mem_limit + mem_limit / MEM_SLACK;
+
+    for (pick = -1, c = 0; c < MEM_CACHES; c++) {
+      m = &mem_caches[c];
+      if (!m->used || (passed & (1 << c)))
+        continue;
+      score = (m->hits + 1.0) * m->cost / m->used;
+      if (pick < 0 || score < best) {
+        pick = c;
+        best = score;
+      }
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    if (pick < 0)
+      return FALSE;				/* nothing more we can do */
+
+    m = &mem_caches[pick];
+    if (m->lock != held && pthread_mutex_trylock(m->lock)) {
+      passed |= 1 << pick;
+      continue;
+    }
+    freed = m->shrink(target);
+    if (m->lock != held)
+      pthread_mutex_unlock(m->lock);
+
+    pthread_mutex_lock(&mem_lock);
+    m->evicted += freed;
+    pthread_mutex_unlock(&mem_lock);
+
+    if (!freed)
+      passed |= 1 << pick;
+  }
+}
+
+/*
+ * mem_get:
+ *
+ * Allocates for a cache, if it'll fit in the budget.  Called with the
+ * cache's lock held.
+ */
+
+static void *
+mem_get(int cache, size_t size)
+{
+  union mem_head *p;
+
+  size += sizeof(union mem_head);
+  if (!mem_reclaim(cache, size) || !(p = malloc(size)))
+    return NULL;
+
+  p->h.size  = size;
+  p->h.cache = cache;
+
+  pthread_mutex_lock(&mem_lock);
+  mem_used += size;
+  mem_caches[cache].used += size;
+  pthread_mutex_unlock(&mem_lock);
+
+  return p + 1;
+}
+
+static char *
+mem_strdup(int cache, const char *str)
+{
+  size_t len = strlen(str) + 1;
+  char   *p;
+
+  if ((p = mem_get(cache, len)))
+    memcpy(p, str, len);
+  return p;
+}
+
+/*
+ * mem_put:
+ *
+ * Gives back something mem_get() handed out.  Returns how much that was.
+ */
+
+static size_t
+mem_put(void *ptr)
+{
+  union mem_head *p;
+  size_t size;
+
+  if (!ptr)
+    return 0;
+
+  p = (union mem_head *)ptr - 1;
+  size = p->h.size;
+
+  pthread_mutex_lock(&mem_lock);
+  mem_used -= size;
+  mem_caches[p->h.cache].used -= size;
+  pthread_mutex_unlock(&mem_lock);
+
+  free(p);
+  return size;
+}
+
+/*
+ * mem_hit:
+ *
+ * Something was found in a cache.  Called with the cache's lock held.
+ */
+
+static void
+mem_hit(int cache)
+{
+  mem_caches[cache].hits++;
+}
+
+/*
+ * mem_detach:
+ *
+ * Gives our slot in the server-wide segment back, at exit.
+ */
+
+static void
+mem_detach(void)
+{
+  if (mem_self)
+    mem_self->pid = 0;
+}
+
+/*
+ * mem_attach:
+ *
+ * Maps the server-wide segment, and takes a slot in it.
+ */
+
+static void
+mem_attach(void)
+{
+  char   name[NAME_MAX];
+  size_t size = MEM_PROCS * sizeof(struct mem_proc);
+  struct stat st;
+  void   *map;
+  pid_t  pid = getpid();
+  int    fd, i;
+
+  if ((fd = shm_open(MEM_SHM_NAME, O_RDWR, 0)) < 0) {	/* everyone's */
+    snprintf(name, sizeof(name), "%s-%d", MEM_SHM_NAME, (int)getuid());
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) < 0)	/* ours */
+      return;
+  }
+
+  flock(fd, LOCK_EX);				/* one of us sizes it */
+  if (fstat(fd, &st) || (st.st_size < (off_t)size && ftruncate(fd, size)))
+    map = MAP_FAILED;
+  else
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return;
+
+  mem_procs = map;
+  for (i = 0; i < MEM_PROCS; i++)
+    if (__sync_bool_compare_and_swap(&mem_procs[i].pid, 0, pid)) {
+      mem_self = &mem_procs[i];
+      mem_self->used = 0;
+      atexit(mem_detach);
+      return;
+    }
+
+  munmap(map, size);				/* no room for us */
+  mem_procs = NULL;
+}
+
+#if FUSE_MINOR_VERSION >= 3
+/*
+ * mem_publish:
+ *
+ * Called every second by the ping thread.  Lets the hit counts decay, and
+ * with a server-wide budget, tells everyone else what we're using, sees
+ * what they are, and works out how much we can have.  Anything over that
+ * gets pushed out.
+ */
+
+static void
+mem_publish(void)
+{
+  double total = 0, limit;
+  size_t used;
+  pid_t  pid;
+  int    i, count = 0;
+
+  pthread_mutex_lock(&mem_lock);
+  for (i = 0; i < MEM_CACHES; i++)
+    mem_caches[i].hits /= 2;
+  used = mem_used;
+  pthread_mutex_unlock(&mem_lock);
+
+  if (!mem_procs)
+    return;
+
+  mem_self->used = used;
+  for (i = 0; i < MEM_PROCS; i++) {
+    if (!(pid = mem_procs[i].pid))
+      continue;
+    if (kill(pid, 0) < 0 && errno == ESRCH) {	/* died without telling us */
+      __sync_bool_compare_and_swap(&mem_procs[i].pid, pid, 0);
+      continue;
+    }
+    total += mem_procs[i].used;
+    count++;
+  }
+
+  if (total > mem_server)			/* give back our share */
+    limit = used - (total - mem_server) * used / total;
+  else						/* or take what's left */
+    limit = used + (mem_server - total);
+  if (limit < MEM_FLOOR * 1024.0)
+    limit = MEM_FLOOR * 1024.0;
+  if (limit > mem_budget)
+    limit = mem_budget;
+
+  pthread_mutex_lock(&mem_lock);
+  mem_limit        = limit;
+  mem_server_used  = total;
+  mem_server_count = count;
+  pthread_mutex_unlock(&mem_lock);
+
+  if (used > limit)
+    mem_reclaim(-1, 0);
+}
+#endif
+
+/*
+ * stats_report:
+ *
+ * Logs what we've been up to.  Triggered by sending us a SIGUSR1.
+ */
+
+static void
+stats_report(void)
+{
+  int c;
+
+  pthread_mutex_lock(&sched_mutex);
+  for (c = 0; c < SCHED_CLASSES; c++)
+    syslog(LOG_INFO, "%s queue: %d waiting, %d peak, %lu sent",
+           sched_name[c], sched_waiting[c], sched_peak[c], sched_sent[c]);
+  pthread_mutex_unlock(&sched_mutex);
+
+  if (rate_ceiling) {
+    pthread_mutex_lock(&rate_lock);
+    syslog(LOG_INFO, "rate: %.0f of %.0f KB/s, %lu ms waited, "
+           "rtt %.1f ms (best %.1f ms)", rate / 1024, rate_ceiling / 1024,
+           rate_slept, rtt_last * 1000, rtt_min * 1000);
+    pthread_mutex_unlock(&rate_lock);
+  }
+
+  pthread_mutex_lock(&mem_lock);
+  syslog(LOG_INFO, "memory: %lu KB of %lu KB allowed (budget %lu KB)",
+         (unsigned long)mem_used / 1024, (unsigned long)mem_limit / 1024,
+         (unsigned long)mem_budget / 1024);
+  for (c = 0; c < MEM_CACHES; c++)
+    syslog(LOG_INFO, "memory: %s %lu KB, %lu hits lately, %lu KB evicted",
+           mem_caches[c].name, (unsigned long)mem_caches[c].used / 1024,
+           mem_caches[c].hits, mem_caches[c].evicted / 1024);
+  if (mem_procs)
+    syslog(LOG_INFO, "memory: server %lu KB of %.0f KB, %d processes",
+           (unsigned long)mem_server_used / 1024, mem_server / 1024,
+           mem_server_count);
+  pthread_mutex_unlock(&mem_lock);
+
+  pthread_mutex_lock(&flight_lock);
+  syslog(LOG_INFO, "coalesced: %lu requests shared another's answer",
+         flight_shared);
+  pthread_mutex_unlock(&flight_lock);
+
+  pthread_mutex_lock(&head_lock);
+  syslog(LOG_INFO, "heads: %lu prefetched, %lu read", head_fetched,
+         head_hits);
+  pthread_mutex_unlock(&head_lock);
+
+  pthread_mutex_lock(&dir_lock);
+  syslog(LOG_INFO, "listings: %d kept, %lu reused, %lu fetched", dir_count,
+         dir_hits, dir_misses);
+  pthread_mutex_unlock(&dir_lock);
+
+  pthread_mutex_lock(&attr_lock);
+  syslog(LOG_INFO, "attr cache: %d entries, %lu hits, %lu misses",
+         attr_count, attr_hits, attr_misses);
+  syslog(LOG_INFO, "opens: %lu kept the page cache, %lu dropped it",
+         fver_kept, fver_dropped);
+  pthread_mutex_unlock(&attr_lock);
+
+  /*
+   * Whoever holds the socket can take attr_lock, to act on a notification,
+   * so it mustn't be held while we wait for the socket.
+   */
+
+  sock_lock(SCHED_META);			/* estimates are the socket's */
+  syslog(LOG_INFO, "timeouts: rtt %.1f ms (+/- %.1f), %.0f KB/s, "
+         "%.1f s for a request, %lu extended, %lu cancelled",
+         rtt_srtt * 1000, rtt_var * 1000, xput / 1024, op_timeout(0),
+         op_extended, op_cancels);
+  sock_unlock();
+
+  if (shm) {
+    shm_lock();
+    syslog(LOG_INFO, "shared cache: %lu KB, %lu hits, %lu misses, "
+           "%lu failed checks (all processes)", (unsigned long)shm_size / 1024,
+           shm->hits, shm->misses, shm->bad);
+    pthread_mutex_unlock(&shm->lock);
+  }
+}
+
+/*
+ * sig_stats:
+ *
+ * SIGUSR1 handler.  The report gets done by the ping thread.
+ */
+
+static void
+sig_stats(int signo __attribute__((unused)))
+{
+  stats_wanted = TRUE;
+}
+
+/*
+ * timeout():
+ * This handles a timeout on a read or write operation.  If the terminal's
+ * kernel has acked something since the deadline was set, it's still there,
+ * so let the deadline slide, as long as the request's been going less
+ * than TIMEOUT_MAX.  Otherwise close the socket, unmount the fuse mount,
+ * and exit the program.
+ */
+
+void
+timeout()
+{
+  struct timeval  now;
+#ifdef TCP_INFO
+  struct tcp_info ti;
+  socklen_t       len = sizeof(ti);
+
+  gettimeofday(&now, NULL);
+  if (elapsed(&op_began, &now) < TIMEOUT_MAX &&
+      !getsockopt(sock.fd, IPPROTO_TCP, TCP_INFO, &ti, &len) &&
+      ti.tcpi_last_ack_recv < usecs(&op_slide, &now) / 1000) {
+    op_slide = now;				/* another go */
+    op_slid  = TRUE;
+    op_expect(0);
+    op_extended++;
+    return;
+  }
+#endif
+
+  close(sock.fd);
+  if (!fuse_mount_point) {			/* ltspfs-get or -put */
+    fprintf(stderr, "Timed out.\n");
+    exit(1);
+  }
+#if FUSE_USE_VERSION >= 26
+  fuse_unmount(fuse_mount_point, NULL);
+#else
+  fuse_unmount(fuse_mount_point);
+#endif
+  exit(0);
+}
+
+/*
+ * sock_get, sock_put:
+ *
+ * How packets get read and written: with readn() and writen(), which wait
+ * as long as the link's worth, and give up on the mount after that.
+ */
+
+static int
+sock_get(struct pkt_conn *c, char *buf, int len)
+{
+  return readn(c->fd, buf, len);
+}
+
+static int
+sock_put(struct pkt_conn *c, const char *buf, int len)
+{
+  return writen(c->fd, (char *)buf, len);
+}
+
+/*
+ * getpacket():
+ * Reads the next packet in.  Returns its length, or -1 if the connection's
+ * been lost.
+ */
+
+static int
+getpacket(XDR *in, char *packetbuffer)
+{
+  int len;
+
+  len = pkt_recv(&sock, in, packetbuffer);
+  TRACE2(packet__recv, packet_word(packetbuffer, 1), len);
+  return len;
+}
+
+/*
+ * _readpacket():
+ * Reads the next response.  ltspfsd may send change notifications in
+ * between responses, so deal with any of those we find along the way.
+ */
+
+static int
+_readpacket(XDR *in, char *packetbuffer)
+{
+  int r;
+
+  while ((r = getpacket(in, packetbuffer)) > 0 && notification(in))
+    xdr_setpos(in, 0);
+
+  return r;
+}
+
+/*
+ * readanswer():
+ * Reads the response to request number request.  Any answers still owed
+ * for earlier requests are in front of it, so collect those first.  If
+ * we're interrupted meanwhile, request is the one that gets cancelled.
+ */
+
+static int
+readanswer(XDR *in, char *packetbuffer, unsigned int request)
+{
+  op_awaited = request;
+  if (pending_head)
+    collect_pending();
+
+  return _readpacket(in, packetbuffer);
+}
+
+/*
+ * readpacket():
+ * Reads the response to the last request we sent.
+ */
+
+int
+readpacket(XDR *in, char *packetbuffer)
+{
+  return readanswer(in, packetbuffer, sock.sent);
+}
+
+/*
+ * packetlen():
+ * Fixes up the length of the packet.  Returns the packet length.
+ */
+
+int
+writepacket(XDR *out, char *packetbuffer)
+{
+  op_opcode = packet_word(packetbuffer, 1);
+  TRACE2(packet__send, op_opcode, xdr_getpos(out));
+  return pkt_send(&sock, out, packetbuffer);	/* Write the packet to socket */
+}
+
+/*
+ * interrupted():
+ * Called when a wait for ltspfsd's interrupted by a signal.  If it's fuse
+ * giving up on the request we're waiting for the answer to, or ^C in
+ * ltspfs-get, tell ltspfsd to stop working on it.  The CANCEL goes straight
+ * out, not through writepacket(), since the request it's for is still the
+ * one on the wire as far as timing and tracing go.
+ */
+
+void
+interrupted()
+{
+#if FUSE_USE_VERSION >= 26
+  struct fuse_context *c;
+#endif
+  XDR  out;
+  char outbuf[LTSP_MAXBUF];
+
+  if (!op_awaited || op_cancelled)
+    return;
+
+  if (!op_stop) {
+#if FUSE_USE_VERSION >= 26
+    if (!fuse_mount_point || !sched_busy)
+      return;					/* not a fuse request */
+
+    c = fuse_get_context();
+    if (!c || !c->fuse || !fuse_interrupted())
+      return;
+#else
+    return;
+#endif
+  }
+
+  op_cancelled = TRUE;
+  op_cancels++;
+
+  pkt_start(&out, outbuf, LTSPFS_CANCEL);
+  xdr_u_int(&out, &op_awaited);			/* the one we're waiting on */
+  pkt_send(&sock, &out, outbuf);
+}
+
+/*
+ * send_recv():
+ *
+ * For most of the functions, this will handle the communications.  Mutexes
+ * handle the locking and unlocking of the communication stream.
+ */
+
+void
+send_recv(XDR *in, XDR *out, char *inbuf, char *outbuf)
+{
+  int owed;
+
+  sock_lock(SCHED_META);			/* Wait our turn */
+  owed = pending_count;
+  writepacket(out, outbuf);			/* Send out packet */
+  readpacket(in, inbuf);			/* Read response */
+  if (!owed)					/* just ours, so time it */
+    op_done(0);
+  sock_unlock();				/* Let the next one go */
+}
+
+#if FUSE_MINOR_VERSION >= 3
+/*
+ * drain_notify:
+ *
+ * When nobody's using the socket, change notifications would just sit there
+ * until the next request.  Read any that have arrived, so our caches don't
+ * hang on to stale data in the meantime.
+ */
+
+static void
+drain_notify(void)
+{
+  XDR    in;
+  char   inbuf[LTSP_MAXBUF];
+  fd_set set;
+  struct timeval poll;
+
+  if (!sock_trylock())				/* busy, they'll get read */
+    return;
+
+  for (;;) {
+    FD_ZERO(&set);
+    FD_SET(sock.fd, &set);
+    poll.tv_sec  = 0;
+    poll.tv_usec = 0;
+    if (select(sock.fd + 1, &set, NULL, NULL, &poll) <= 0)
+      break;
+
+    if (pending_head) {				/* owed answers come first */
+      collect_pending();
+      continue;
+    }
+
+    xdrmem_create(&in, inbuf, LTSP_MAXBUF, XDR_DECODE);
+    if (getpacket(&in, inbuf) <= 0)		/* connection's gone */
+      timeout();
+    notification(&in);
+    xdr_destroy(&in);
+  }
+
+  sock_unlock();
+}
+
+/*
+ * ping_timeout:
+ *
+ * This function will handle sendig a "PING" packet to the server once every
+ * x minutes.   If it doesn't get a response back, then it will exit the
+ * timeout function will unmount the ltspfs filesystem and exit. 
+ * In between pings, it picks up any change notifications.
+ */
+
+void
+ping_timeout(void *nothing __attribute__((unused)))
+{
+  XDR    in, out;
+  int    i;
+  char   pingin[LTSP_MAXBUF];
+  char   pingout[LTSP_MAXBUF];
+  int    ticks = 0;
+  struct timespec notify_interval;
+  struct timeval  sent, back;
+
+  init_pkt(&in, &out, pingin, pingout);		/* Initialize packets */
+
+  i = LTSPFS_PING;
+  xdr_int(&out, &i);
+  i = xdr_getpos(&out);
+  xdr_setpos(&out, 0);
+  xdr_int(&out, &i);
+
+  notify_interval.tv_sec  = NOTIFY_INTERVAL;
+  notify_interval.tv_nsec = 0;
+
+  while (TRUE)
+  {
+    nanosleep(&notify_interval, NULL);
+    mem_publish();
+    if (stats_wanted) {
+      stats_wanted = FALSE;
+      stats_report();
+    }
+    if (rate_probe()) {				/* time a round trip */
+      sock_lock(SCHED_META);
+      gettimeofday(&sent, NULL);
+      writen(sock.fd, pingout, i);
+      sock.sent++;				/* ltspfsd counts these too */
+      readpacket(&in, pingin);
+      gettimeofday(&back, NULL);
+      op_done(0);
+      xdr_setpos(&in, 0);
+      sock_unlock();
+      rate_adapt(elapsed(&sent, &back));
+    }
+    if (++ticks < PING_INTERVAL / NOTIFY_INTERVAL) {
+      drain_notify();
+      continue;
+    }
+    ticks = 0;
+    sock_lock(SCHED_META);			/* Wait our turn */
+    writen(sock.fd, pingout, i);			/* Send command */
+    sock.sent++;
+    readpacket(&in, pingin);			/* Read response */
+    op_done(0);
+    xdr_setpos(&in, 0);
+    sock_unlock();				/* Let the next one go */
+  }
+}
+#endif
+
+/*
+ * parse_return:
+ * Simplifies several functions by handling simple "000" or 001|errno returns.
+ */
+
+static int
+parse_return(XDR *xdr)
+{
+  int res, retcode;
+
+  /*
+   * rewind to the beginning.
+   */
+
+  xdr_setpos(xdr, 0);			/* rewind to the beginning of packet */
+  xdr_int(xdr, &res);			/* read over the length */
+
+  if (!xdr_int(xdr, &res))		/* try to grab the return code */
+    retcode = EACCES;			/* Couldnt grab, so goto out */
+  else if (!res)			/* If OK, goto out */
+    retcode =  OK;
+  else if (!xdr_int(xdr, &retcode)) 	/* If fail, then grab the code */
+    retcode = EACCES;
+
+  xdr_destroy(xdr);			/* Last bit, so destroy the stream */
+  return -retcode;
+}
+
+/*
+ * node_bucket:
+ *
+ * Simple string hash for the node cache.
+ */
+
+static unsigned int
+node_bucket(const char *path)
+{
+  unsigned int h = 0;
+
+  while (*path)
+    h = h * 31 + (unsigned char)*path++;
+
+  return h % NODE_HASH;
+}
+
+/*
+ * node_find:
+ *
+ * Returns the node id for a directory path, or 0 if we don't have one.
+ */
+
+static unsigned int
+node_find(const char *path)
+{
+  struct node *n;
+  unsigned int id = 0;
+
+  pthread_mutex_lock(&node_lock);
+  for (n = node_hash[node_bucket(path)]; n; n = n->next)
+    if (!strcmp(n->path, path)) {
+      id = n->id;
+      mem_hit(MEM_NODE);
+      break;
+    }
+  pthread_mutex_unlock(&node_lock);
+
+  return id;
+}
+
+/*
+ * node_clear:
+ *
+ * Forgets every node.  Called with node_lock held.
+ */
+
+static int
+node_clear(void)
+{
+  struct node *n;
+  int i, count;
+
+  for (i = 0; i < NODE_HASH; i++)
+    while ((n = node_hash[i])) {
+      node_hash[i] = n->next;
+      mem_put(n->path);
+      mem_put(n);
+    }
+  count = node_count;
+  node_count = 0;
+
+  return count;
+}
+
+/*
+ * node_flush:
+ *
+ * Forget every node we know about.  Called when ltspfsd tells us one of our
+ * ids is stale, which normally means the automounter has unmounted the
+ * device, and they're all stale.  Returns the number of nodes dropped.
+ */
+
+static int
+node_flush(void)
+{
+  int count;
+
+  pthread_mutex_lock(&node_lock);
+  count = node_clear();
+  pthread_mutex_unlock(&node_lock);
+
+  return count;
+}
+
+/*
+ * node_add:
+ *
+ * Remember the node id for a directory path.
+ */
+
+static void
+node_add(const char *path, unsigned int id)
+{
+  struct node *n;
+  unsigned int b = node_bucket(path);
+
+  pthread_mutex_lock(&node_lock);
+  for (n = node_hash[b]; n; n = n->next)
+    if (!strcmp(n->path, path)) {		/* already have it, update */
+      n->id = id;
+      pthread_mutex_unlock(&node_lock);
+      return;
+    }
+
+  if (node_count >= NODE_MAX)			/* Full.  Start over. */
+    node_clear();
+
+  if (!(n = mem_get(MEM_NODE, sizeof(struct node))) ||
+      !(n->path = mem_strdup(MEM_NODE, path))) {
+    mem_put(n);
+    pthread_mutex_unlock(&node_lock);
+    return;
+  }
+  n->id = id;
+  n->next = node_hash[b];
+  node_hash[b] = n;
+  node_count++;
+  pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * node_forget:
+ *
+ * Drop a directory, and everything underneath it, from the node cache.
+ * ltspfsd's descriptors follow a directory when it's renamed, so after a
+ * rename or rmdir the old paths can't be trusted.
+ */
+
+static void
+node_forget(const char *path)
+{
+  struct node **np, *n;
+  int i, len = strlen(path);
+
+  pthread_mutex_lock(&node_lock);
+  for (i = 0; i < NODE_HASH; i++) {
+    np = &node_hash[i];
+    while ((n = *np)) {
+      if (!strncmp(n->path, path, len) &&
+          (n->path[len] == '\0' || n->path[len] == '/')) {
+        *np = n->next;
+        mem_put(n->path);
+        mem_put(n);
+        node_count--;
+      } else
+        np = &n->next;
+    }
+  }
+  pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * node_shrink:
+ *
+ * Frees up to want bytes of nodes, for mem_reclaim().  Called with
+ * node_lock held.
+ */
+
+static size_t
+node_shrink(size_t want)
+{
+  static int  hand;
+  struct node *n;
+  size_t      freed = 0;
+  int         i;
+
+  for (i = 0; i < NODE_HASH && freed < want; i++, hand = (hand + 1) % NODE_HASH)
+    while ((n = node_hash[hand]) && freed < want) {
+      node_hash[hand] = n->next;
+      freed += mem_put(n->path);
+      freed += mem_put(n);
+      node_count--;
+    }
+
+  return freed;
+}
+
+/*
+ * node_path:
+ *
+ * Reverse lookup: finds the path for a node id.  Returns TRUE if found.
+ */
+
+static int
+node_path(unsigned int id, char *path)
+{
+  struct node *n;
+  int i, found = FALSE;
+
+  pthread_mutex_lock(&node_lock);
+  for (i = 0; i < NODE_HASH && !found; i++)
+    for (n = node_hash[i]; n; n = n->next)
+      if (n->id == id) {
+        strcpy(path, n->path);
+        found = TRUE;
+        break;
+      }
+  pthread_mutex_unlock(&node_lock);
+
+  return found;
+}
+
+/*
+ * attr_find:
+ *
+ * Looks a path up in the attribute cache.  Returns TRUE, and fills in
+ * stbuf, if we've got attributes for it that haven't expired.
+ */
+
+static int
+attr_find(const char *path, struct stat *stbuf)
+{
+  struct attr *a;
+  int found = FALSE;
+
+  pthread_mutex_lock(&attr_lock);
+  for (a = attr_hash[node_bucket(path)]; a; a = a->next)
+    if (!strcmp(a->path, path)) {
+      if (a->expires > time(NULL)) {
+        *stbuf = a->st;
+        found = TRUE;
+        mem_hit(MEM_ATTR);
+      }
+      break;
+    }
+  if (found)
+    attr_hits++;
+  else
+    attr_misses++;
+  pthread_mutex_unlock(&attr_lock);
+
+  return found;
+}
+
+/*
+ * attr_generation:
+ *
+ * Returns the cache's generation, to be handed to attr_add() once the
+ * answer's back.  If anything was forgotten in the meantime, the answer
+ * may be older than the change, so it doesn't get cached.
+ */
+
+static unsigned int
+attr_generation(void)
+{
+  unsigned int gen;
+
+  pthread_mutex_lock(&attr_lock);
+  gen = attr_gen;
+  pthread_mutex_unlock(&attr_lock);
+
+  return gen;
+}
+
+/*
+ * attr_clear:
+ *
+ * Empties the attribute cache.  Must be called with attr_lock held.
+ */
+
+static void
+attr_clear(void)
+{
+  struct attr *a;
+  int i;
+
+  for (i = 0; i < NODE_HASH; i++)
+    while ((a = attr_hash[i])) {
+      attr_hash[i] = a->next;
+      mem_put(a->path);
+      mem_put(a);
+    }
+  attr_count = 0;
+  memset(fs_cache, 0, sizeof(fs_cache));
+  attr_gen++;
+}
+
+/*
+ * attr_flush:
+ *
+ * Forgets all the attributes we've got, and the listings that go by them.
+ */
+
+static void
+attr_flush(void)
+{
+  pthread_mutex_lock(&attr_lock);
+  attr_clear();
+  pthread_mutex_unlock(&attr_lock);
+
+  dir_flush();
+}
+
+/*
+ * attr_add:
+ *
+ * Remembers the attributes for a path, fetched at generation gen.
+ */
+
+static void
+attr_add(const char *path, struct stat *stbuf, unsigned int gen)
+{
+  struct attr *a;
+  unsigned int b = node_bucket(path);
+
+  pthread_mutex_lock(&attr_lock);
+  if (gen != attr_gen) {			/* changed since, don't trust it */
+    pthread_mutex_unlock(&attr_lock);
+    return;
+  }
+
+  for (a = attr_hash[b]; a; a = a->next)
+    if (!strcmp(a->path, path))
+      break;
+
+  if (!a) {
+    if (!(a = mem_get(MEM_ATTR, sizeof(struct attr))) ||
+        !(a->path = mem_strdup(MEM_ATTR, path))) {
+      mem_put(a);
+      pthread_mutex_unlock(&attr_lock);
+      return;
+    }
+    a->next = attr_hash[b];
+    attr_hash[b] = a;
+    attr_count++;
+  }
+
+  a->st      = *stbuf;
+  a->expires = time(NULL) + ATTR_TTL;
+  pthread_mutex_unlock(&attr_lock);
+}
+
+/*
+ * attr_drop:
+ *
+ * Drops one path from the attribute cache.  Must be called with attr_lock
+ * held.
+ */
+
+static void
+attr_drop(const char *path, int len)
+{
+  struct attr **ap, *a;
+  char   key[PATH_MAX];
+
+  memcpy(key, path, len);
+  key[len] = '\0';
+
+  for (ap = &attr_hash[node_bucket(key)]; (a = *ap); ap = &a->next)
+    if (!strcmp(a->path, key)) {
+      *ap = a->next;
+      mem_put(a->path);
+      mem_put(a);
+      attr_count--;
+      break;
+    }
+}
+
+/*
+ * attr_forget:
+ *
+ * Something's been changed.  Drops its attributes, and with FORGET_PARENT,
+ * the attributes of the directory it's in, whose mtime will have moved.
+ * With FORGET_TREE, everything underneath it goes too.  Free space will
+ * have moved as well, so the statfs answers always go, and so does any
+ * head we've prefetched, and any listing that's been kept.
+ */
+
+static void
+attr_forget(const char *path, int how)
+{
+  struct attr **ap, *a;
+  char   *slash;
+  int    i, len = strlen(path);
+
+  pthread_mutex_lock(&attr_lock);
+
+  attr_drop(path, len);
+
+  if ((how & FORGET_PARENT) && (slash = strrchr(path, '/')))
+    attr_drop(path, slash == path ? 1 : slash - path);
+
+  if (how & FORGET_TREE)
+    for (i = 0; i < NODE_HASH; i++) {
+      ap = &attr_hash[i];
+      while ((a = *ap)) {
+        if (!strncmp(a->path, path, len) && a->path[len] == '/') {
+          *ap = a->next;
+          mem_put(a->path);
+          mem_put(a);
+          attr_count--;
+        } else
+          ap = &a->next;
+      }
+    }
+
+  memset(fs_cache, 0, sizeof(fs_cache));
+  attr_gen++;
+
+  pthread_mutex_unlock(&attr_lock);
+
+  head_forget(path, how);
+  dir_forget(path, how);
+}
+
+/*
+ * attr_shrink:
+ *
+ * Frees up to want bytes of attributes, for mem_reclaim().  Called with
+ * attr_lock held.  Expired ones go first.
+ */
+
+static size_t
+attr_shrink(size_t want)
+{
+  static int  hand;
+  struct attr **ap, *a;
+  time_t      now = time(NULL);
+  size_t      freed = 0;
+  int         i, pass;
+
+  for (pass = 0; pass < 2 && freed < want; pass++)
+    for (i = 0; i < NODE_HASH && freed < want;
+         i++, hand = (hand + 1) % NODE_HASH) {
+      ap = &attr_hash[hand];
+      while ((a = *ap) && freed < want)
+        if (pass || a->expires <= now) {
+          *ap = a->next;
+          freed += mem_put(a->path);
+          freed += mem_put(a);
+          attr_count--;
+        } else
+          ap = &a->next;
+    }
+
+  return freed;
+}
+
+/*
+ * fver_check:
+ *
+ * Records the size and mtime OPEN handed back for a file.  Returns TRUE if
+ * they're what they were at the last open.
+ */
+
+static int
+fver_check(const char *path, off_t size, long mtime, long nsec)
+{
+  struct fver *v;
+  unsigned int b = node_bucket(path);
+  int same = FALSE;
+
+  pthread_mutex_lock(&attr_lock);
+
+  for (v = fver_hash[b]; v; v = v->next)
+    if (!strcmp(v->path, path))
+      break;
+
+  if (v)
+    same = v->size == size && v->mtime == mtime && v->nsec == nsec;
+  else if ((v = mem_get(MEM_FVER, sizeof(struct fver))) &&
+           (v->path = mem_strdup(MEM_FVER, path))) {
+    v->next = fver_hash[b];
+    fver_hash[b] = v;
+    fver_count++;
+  } else {
+    mem_put(v);
+    v = NULL;
+  }
+
+  if (v) {
+    v->size  = size;
+    v->mtime = mtime;
+    v->nsec  = nsec;
+  }
+
+  if (same) {
+    fver_kept++;
+    mem_hit(MEM_FVER);
+  } else
+    fver_dropped++;
+
+  pthread_mutex_unlock(&attr_lock);
+
+  return same;
+}
+
+/*
+ * fver_shrink:
+ *
+ * Frees up to want bytes of versions, for mem_reclaim().  Called with
+ * attr_lock held.  Carries on round the table from where it left off last
+ * time.
+ */
+
+static size_t
+fver_shrink(size_t want)
+{
+  static int  hand;
+  struct fver *v;
+  size_t      freed = 0;
+  int         i;
+
+  for (i = 0; i < NODE_HASH && freed < want; i++, hand = (hand + 1) % NODE_HASH)
+    while ((v = fver_hash[hand]) && freed < want) {
+      fver_hash[hand] = v->next;
+      freed += mem_put(v->path);
+      freed += mem_put(v);
+      fver_count--;
+    }
+
+  return freed;
+}
+
+/*
+ * dir_put:
+ *
+ * Lets go of a listing.  Must be called with dir_lock held.  Returns how
+ * much was freed, if that was the last hold on it.
+ */
+
+static size_t
+dir_put(struct dirlist *l)
+{
+  if (--l->refs)
+    return 0;
+
+  return mem_put(l);
+}
+
+/*
+ * dir_unlink:
+ *
+ * Takes the listing at *lp out of the cache.  Must be called with dir_lock
+ * held.
+ */
+
+static size_t
+dir_unlink(struct dirlist **lp)
+{
+  struct dirlist *l = *lp;
+
+  *lp = l->next;
+  dir_count--;
+
+  return dir_put(l);
+}
+
+/*
+ * same_time:
+ *
+ * Returns TRUE if two times are the same, to the nanosecond.  Listings are
+ * only good if the directory hasn't changed at all, and it can change more
+ * than once a second.
+ */
+
+static int
+same_time(const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/*
+ * dir_find:
+ *
+ * Looks for a listing of path that's still good, going by the directory's
+ * attributes in st.  If there's one, it's held for the caller, who lets go
+ * of it with dir_release().  One that's no good any more is dropped.
+ */
+
+static struct dirlist *
+dir_find(const char *path, struct stat *st)
+{
+  struct dirlist **lp, *l;
+
+  pthread_mutex_lock(&dir_lock);
+  for (lp = &dir_hash[node_bucket(path)]; (l = *lp); lp = &l->next)
+    if (!strcmp(l->path, path)) {
+      if (same_time(&l->mtime, &st->st_mtim) &&
+          same_time(&l->ctime, &st->st_ctim) && l->ino == st->st_ino) {
+        l->refs++;
+        mem_hit(MEM_DIR);
+      } else {
+        dir_unlink(lp);				/* it's changed since */
+        l = NULL;
+      }
+      break;
+    }
+  if (l)
+    dir_hits++;
+  else
+    dir_misses++;
+  pthread_mutex_unlock(&dir_lock);
+
+  return l;
+}
+
+/*
+ * dir_start:
+ *
+ * Starts collecting a listing of a directory with attributes st, as it's
+ * read from the start.
+ */
+
+static struct dirfill *
+dir_start(struct stat *st)
+{
+  struct dirfill *f;
+
+  if (!(f = calloc(1, sizeof(struct dirfill))))
+    return NULL;
+
+  f->st = *st;
+  pthread_mutex_lock(&dir_lock);
+  f->gen = dir_gen;
+  pthread_mutex_unlock(&dir_lock);
+
+  return f;
+}
+
+/*
+ * dir_end:
+ *
+ * Throws away a listing that was being collected.
+ */
+
+static void
+dir_end(struct dirfill *f)
+{
+  if (!f)
+    return;
+
+  free(f->ents);
+  free(f->names);
+  free(f);
+}
+
+/*
+ * dir_collect:
+ *
+ * Adds an entry to a listing being collected.  Returns FALSE if there's
+ * no room for it, in which case the listing won't be kept.
+ */
+
+static int
+dir_collect(struct dirfill *f, struct stat *st, unsigned char type,
+	    const char *name, off_t cookie)
+{
+  unsigned int len = strlen(name) + 1;
+  struct dent *ents;
+  char *names;
+
+  if (f->count >= DIRLIST_MAX)			/* too big to keep */
+    return FALSE;
+
+  if (f->count == f->size) {
+    if (!(ents = realloc(f->ents, (f->size * 2 + 64) * sizeof(struct dent))))
+      return FALSE;
+    f->ents = ents;
+    f->size = f->size * 2 + 64;
+  }
+
+  if (f->used + len > f->room) {
+    if (!(names = realloc(f->names, f->room * 2 + len + 1024)))
+      return FALSE;
+    f->names = names;
+    f->room = f->room * 2 + len + 1024;
+  }
+
+  f->ents[f->count].ino    = st->st_ino;
+  f->ents[f->count].cookie = cookie;
+  f->ents[f->count].name   = f->used;
+  f->ents[f->count].type   = type;
+  f->count++;
+
+  memcpy(f->names + f->used, name, len);
+  f->used += len;
+  f->next = cookie;
+
+  return TRUE;
+}
+
+/*
+ * dir_add:
+ *
+ * A listing's been collected, right to the end.  Keeps it, unless
+ * something's been forgotten since it was started, and could have been in
+ * the directory before it was listed.
+ */
+
+static void
+dir_add(const char *path, struct dirfill *f)
+{
+  struct dirlist **lp, *l;
+  unsigned int b = node_bucket(path);
+  size_t size;
+
+  size = sizeof(struct dirlist) + f->count * sizeof(struct dent) +
+         f->used + strlen(path) + 1;
+
+  pthread_mutex_lock(&dir_lock);
+  if (f->gen != dir_gen || !(l = mem_get(MEM_DIR, size))) {
+    pthread_mutex_unlock(&dir_lock);
+    return;
+  }
+
+  l->ents  = (struct dent *)(l + 1);		/* all in one piece */
+  l->names = (char *)(l->ents + f->count);
+  l->path  = l->names + f->used;
+  memcpy(l->ents, f->ents, f->count * sizeof(struct dent));
+  memcpy(l->names, f->names, f->used);
+  strcpy(l->path, path);
+  l->mtime = f->st.st_mtim;
+  l->ctime = f->st.st_ctim;
+  l->ino   = f->st.st_ino;
+  l->count = f->count;
+  l->refs  = 1;
+
+  for (lp = &dir_hash[b]; *lp; lp = &(*lp)->next)
+    if (!strcmp((*lp)->path, path)) {		/* replaces the old one */
+      dir_unlink(lp);
+      break;
+    }
+
+  l->next = dir_hash[b];
+  dir_hash[b] = l;
+  dir_count++;
+  pthread_mutex_unlock(&dir_lock);
+}
+
+/*
+ * dir_release:
+ *
+ * An open directory's done with its listings, cached or being collected.
+ */
+
+static void
+dir_release(struct odir *od)
+{
+  if (od->list) {
+    pthread_mutex_lock(&dir_lock);
+    dir_put(od->list);
+    pthread_mutex_unlock(&dir_lock);
+    od->list = NULL;
+  }
+
+  dir_end(od->fill);
+  od->fill = NULL;
+}
+
+/*
+ * dir_drop:
+ *
+ * Drops the listing of one path.  Must be called with dir_lock held.
+ */
+
+static void
+dir_drop(const char *path, int len)
+{
+  struct dirlist **lp;
+  char   key[PATH_MAX];
+
+  memcpy(key, path, len);
+  key[len] = '\0';
+
+  for (lp = &dir_hash[node_bucket(key)]; *lp; lp = &(*lp)->next)
+    if (!strcmp((*lp)->path, key)) {
+      dir_unlink(lp);
+      break;
+    }
+}
+
+/*
+ * dir_forget:
+ *
+ * Drops listings the way attr_forget() drops attributes.  Listings being
+ * collected that were started before this won't be kept.
+ */
+
+static void
+dir_forget(const char *path, int how)
+{
+  struct dirlist **lp, *l;
+  char   *slash;
+  int    i, len = strlen(path);
+
+  pthread_mutex_lock(&dir_lock);
+
+  dir_drop(path, len);
+
+  if ((how & FORGET_PARENT) && (slash = strrchr(path, '/')))
+    dir_drop(path, slash == path ? 1 : slash - path);
+
+  if (how & FORGET_TREE)
+    for (i = 0; i < NODE_HASH; i++) {
+      lp = &dir_hash[i];
+      while ((l = *lp)) {
+        if (!strncmp(l->path, path, len) && l->path[len] == '/')
+          dir_unlink(lp);
+        else
+          lp = &l->next;
+      }
+    }
+
+  dir_gen++;
+
+  pthread_mutex_unlock(&dir_lock);
+}
+
+/*
+ * dir_flush:
+ *
+ * Forgets all the listings we've got.
+ */
+
+static void
+dir_flush(void)
+{
+  int i;
+
+  pthread_mutex_lock(&dir_lock);
+  for (i = 0; i < NODE_HASH; i++)
+    while (dir_hash[i])
+      dir_unlink(&dir_hash[i]);
+  dir_gen++;
+  pthread_mutex_unlock(&dir_lock);
+}
+
+/*
+ * dir_shrink:
+ *
+ * Frees up to want bytes of listings, for mem_reclaim().  Called with
+ * dir_lock held.  Listings someone's in the middle of reading are left
+ * alone.
+ */
+
+static size_t
+dir_shrink(size_t want)
+{
+  static int     hand;
+  struct dirlist **lp, *l;
+  size_t         freed = 0;
+  int            i;
+
+  for (i = 0; i < NODE_HASH && freed < want; i++, hand = (hand + 1) % NODE_HASH) {
+    lp = &dir_hash[hand];
+    while ((l = *lp) && freed < want)
+      if (l->refs == 1)
+        freed += dir_unlink(lp);
+      else
+        lp = &l->next;
+  }
+
+  return freed;
+}
+
+/*
+ * invalidate:
+ *
+ * Something changed on the terminal that we didn't do.  Throw away
+ * anything we've cached about it.
+ */
+
+static void
+invalidate(const char *path, int kind)
+{
+  if (kind == NOTIFY_REMOVED)
+    node_forget(path);
+
+  attr_forget(path, kind == NOTIFY_CHANGED ? 0 : FORGET_PARENT | FORGET_TREE);
+}
+
+/*
+ * notification:
+ *
+ * Checks whether a packet is a change notification from ltspfsd, and if
+ * so, invalidates whatever it refers to and returns TRUE.  Otherwise, the
+ * packet is left as it was found.  Notifications look like:
+ *
+ * 003|<node>|<kind>|<name>
+ */
+
+static int
+notification(XDR *in)
+{
+  char         name[PATH_MAX];
+  char         path[PATH_MAX];
+  char         *ptr = name;
+  unsigned int id;
+  int          pos = xdr_getpos(in);
+  int          res, kind;
+
+  if (!xdr_int(in, &res) || res != LTSP_STATUS_NOTIFY) {
+    xdr_setpos(in, pos);
+    return FALSE;
+  }
+
+  if (!xdr_u_int(in, &id) || !xdr_int(in, &kind) ||
+      !xdr_string(in, &ptr, PATH_MAX))
+    return TRUE;				/* garbled, ignore it */
+
+  if (!id) {					/* lost track, forget it all */
+    node_flush();
+    attr_flush();
+  } else if (node_path(id, path)) {
+    if (*name) {
+      if (strcmp(path, "/"))
+        strcat(path, "/");
+      strncat(path, name, PATH_MAX - strlen(path) - 1);
+    }
+    invalidate(path, kind);
+  }
+
+  return TRUE;
+}
+
+/*
+ * at_root:
+ *
+ * TRUE if a path is the root of a multi mount, or one of the shares in it.
+ */
+
+static int
+at_root(const char *path)
+{
+  return multi && !strchr(path + 1, '/');
+}
+
+/*
+ * share_find:
+ *
+ * Finds the share a path is in.  Returns the share's slot, or -1, and
+ * fills in the node id of the share's root, and the path inside the share.
+ */
+
+static int
+share_find(const char *path, unsigned int *id, char **rest)
+{
+  const char *end;
+  int i, len;
+
+  path++;					/* skip leading '/' */
+  if (!(end = strchr(path, '/')))
+    end = path + strlen(path);
+  len = end - path;
+
+  pthread_mutex_lock(&node_lock);
+  for (i = 0; i < SHARE_MAX; i++)
+    if (shares[i].name && !strncmp(shares[i].name, path, len) &&
+        shares[i].name[len] == '\0')
+      break;
+  if (i < SHARE_MAX && id)
+    *id = shares[i].id;
+  pthread_mutex_unlock(&node_lock);
+
+  if (rest)
+    *rest = *end ? (char *)end : "/";
+
+  return i < SHARE_MAX ? i : -1;
+}
+
+/*
+ * build_path:
+ *
+ * Encodes a path into the output packet.  If we've got a node id for the
+ * parent directory, send that plus the last component, otherwise send
+ * node 0 and the full path.  In a multi mount, "node 0" is the root of the
+ * share the path is in, and the path is the rest of it.
+ */
+
+static void
+build_path(XDR *out, const char *path)
+{
+  char         parent[PATH_MAX];
+  char         *name = (char *)path;
+  char         *slash;
+  unsigned int id = 0;
+  int          len;
+
+  slash = strrchr(path, '/');
+  if (slash && slash[1]) {
+    len = slash - path;
+    if (!len)					/* parent is the root */
+      len = 1;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    if ((id = node_find(parent)))
+      name = slash + 1;
+  }
+
+  if (!id && multi && share_find(path, &id, &name) < 0)
+    id = SHARE_NONE;				/* ltspfsd will say ESTALE */
+
+  xdr_u_int(out, &id);				/* build node */
+  xdr_string(out, &name, PATH_MAX);		/* build name */
+}
+
+/*
+ * stale:
+ *
+ * Peeks at a response.  If ltspfsd told us a node id was stale, flush the
+ * node cache and return TRUE, so the caller can resend with full paths.
+ */
+
+static int
+stale(XDR *in)
+{
+  return pkt_stale(in) && node_flush() > 0;
+}
+
+/*
+ * build_meta:
+ *
+ * Builds the packet for a queued metadata update.
+ */
+
+static void
+build_meta(XDR *out, struct pending *p)
+{
+  xdr_int(out, &p->opcode);			/* build opcode */
+
+  switch (p->opcode) {
+    case LTSPFS_CHMOD:
+      xdr_u_int(out, &p->arg1);			/* build mode */
+      break;
+    case LTSPFS_CHOWN:
+      xdr_u_int(out, &p->arg1);			/* build uid */
+      xdr_u_int(out, &p->arg2);			/* build gid */
+      break;
+    case LTSPFS_UTIME:
+      xdr_long(out, &p->actime);		/* build accesstime */
+      xdr_long(out, &p->modtime);		/* build modtime */
+      break;
+    case LTSPFS_WRITE:
+      xdr_u_int(out, &p->size);			/* build packet size */
+      xdr_longlong_t(out, &p->offset);		/* build file offset */
+      break;
+  }
+
+  build_path(out, p->path);			/* build path */
+}
+
+/*
+ * send_pending:
+ *
+ * Sends a queued update, and puts it on the end of the owed list.  Must be
+ * called with the socket held.
+ */
+
+static void
+send_pending(struct pending *p)
+{
+  XDR  out;
+  char outbuf[LTSP_MAXBUF];
+  int  i = 0;
+
+  xdrmem_create(&out, outbuf, LTSP_MAXBUF, XDR_ENCODE);
+  xdr_int(&out, &i);				/* reserve length field */
+  build_meta(&out, p);
+  writepacket(&out, outbuf);
+  if (p->data)
+    writen(sock.fd, p->data, p->size);		/* Send data buffer */
+  if (p->of)
+    p->of->wowed += p->size;
+
+  p->next = NULL;
+  if (pending_tail)
+    pending_tail->next = p;
+  else
+    pending_head = p;
+  pending_tail = p;
+  pending_count++;
+}
+
+/*
+ * defer_error:
+ *
+ * Remember an error for a path, to be reported at the next flush or fsync.
+ * If we've got too many, the oldest ones get dropped, and logged, since
+ * nobody else will hear about them.
+ */
+
+static void
+defer_error(char *path, int err)
+{
+  struct deferred *d, **dp;
+
+  if (!(d = malloc(sizeof(struct deferred)))) {
+    syslog(LOG_WARNING, "%s: %s", path, strerror(err));
+    free(path);
+    return;
+  }
+
+  d->path = path;
+  d->err  = err;
+  d->next = deferred_head;
+  deferred_head = d;
+
+  if (++deferred_count > PENDING_MAX) {		/* drop the oldest */
+    for (dp = &deferred_head; (*dp)->next; dp = &(*dp)->next)
+      ;
+    syslog(LOG_WARNING, "%s: %s", (*dp)->path, strerror((*dp)->err));
+    free((*dp)->path);
+    free(*dp);
+    *dp = NULL;
+    deferred_count--;
+  }
+}
+
+/*
+ * collect_one:
+ *
+ * Reads the oldest answer we're owed.  A stale node puts the update on the
+ * stale list, to be resent.  A write that came up short ran out of room.
+ * Must be called with the socket held.
+ */
+
+static void
+collect_one(void)
+{
+  XDR  in;
+  char inbuf[LTSP_MAXBUF];
+  struct pending *p = pending_head;
+  int  res, retcode;
+  unsigned int written;
+
+  xdrmem_create(&in, inbuf, LTSP_MAXBUF, XDR_DECODE);
+  _readpacket(&in, inbuf);
+
+  if ((pending_head = p->next) == NULL)
+    pending_tail = NULL;
+  pending_count--;
+  if (p->of)
+    p->of->wowed -= p->size;
+
+  if (!xdr_int(&in, &res))
+    res = LTSP_STATUS_FAIL;
+
+  if (res != LTSP_STATUS_OK) {
+    if (!xdr_int(&in, &retcode))
+      retcode = EACCES;
+  } else if (p->data && (!xdr_u_int(&in, &written) || written < p->size)) {
+    res = LTSP_STATUS_FAIL;			/* short write, disk full */
+    retcode = ENOSPC;
+  }
+
+  if (res == LTSP_STATUS_OK) {
+    free(p->path);
+    free(p->data);
+    free(p);
+  } else if (retcode == ESTALE && !p->resent) {
+    node_flush();
+    p->resent = TRUE;
+    p->next = NULL;
+    if (stale_tail)
+      stale_tail->next = p;
+    else
+      stale_head = p;
+    stale_tail = p;
+    if (p->of)
+      p->of->wowed += p->size;			/* still owed, till it's resent */
+  } else if (p->of) {
+    if (!p->of->werr)				/* the first one's what counts */
+      p->of->werr = retcode;
+    free(p->path);
+    free(p->data);
+    free(p);
+  } else {
+    defer_error(p->path, retcode);
+    free(p->data);
+    free(p);
+  }
+
+  xdr_destroy(&in);
+}
+
+/*
+ * collect_pending:
+ *
+ * Reads all the answers we're owed.  Must be called with the socket held.
+ */
+
+static void
+collect_pending(void)
+{
+  while (pending_head)
+    collect_one();
+}
+
+/*
+ * resend_stale:
+ *
+ * Resends the updates on the stale list, with the full path, in the order
+ * they were first sent.  Must be called with the socket held, and only
+ * answers we're owed on the wire.
+ */
+
+static void
+resend_stale(void)
+{
+  struct pending *p;
+
+  while ((p = stale_head)) {
+    stale_head = p->next;
+    if (p->of)
+      p->of->wowed -= p->size;			/* send_pending() counts it */
+    send_pending(p);
+  }
+  stale_tail = NULL;
+}
+
+/*
+ * collect_all:
+ *
+ * Reads all the answers we're owed, resends included.  Must be called with
+ * the socket held, and only answers we're owed on the wire.
+ */
+
+static void
+collect_all(void)
+{
+  do {
+    collect_pending();
+    resend_stale();
+  } while (pending_head);
+}
+
+/*
+ * meta_sync:
+ *
+ * Does a metadata update there and then, waiting for the answer.
+ */
+
+static int
+meta_sync(struct pending *p)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+    build_meta(&out, p);
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
+
+  return parse_return(&in);
+}
+
+/*
+ * queue_meta:
+ *
+ * Sends off a metadata update without waiting for the answer.  If we've
+ * got as many answers owed as we'll keep track of, it's done with
+ * meta_sync() instead, which collects them, and the error, if there is
+ * one, comes straight back.
+ */
+
+static int
+queue_meta(struct pending *p, const char *path)
+{
+  int res = OK;
+
+  p->next   = NULL;
+  p->resent = FALSE;
+  if (!(p->path = strdup(path))) {
+    free(p);
+    return -ENOMEM;
+  }
+
+  sock_lock(SCHED_META);			/* Wait our turn */
+  if (pending_count < PENDING_MAX) {
+    send_pending(p);
+    p = NULL;
+  }
+  sock_unlock();				/* Let the next one go */
+
+  if (p) {					/* too many owed */
+    res = meta_sync(p);
+    free(p->path);
+    free(p);
+  }
+
+  attr_forget(path, 0);				/* ctime, at least, moved */
+  return res;
+}
+
+/*
+ * path_move, pending_move:
+ *
+ * A rename's gone through, so updates queued for what was renamed, or
+ * anything under it, are for the new path now, if they have to be resent,
+ * and so are errors waiting to be reported.  Must be called with the
+ * socket held.
+ */
+
+static void
+path_move(char **path, const char *from, const char *to)
+{
+  int  len = strlen(from);
+  char *moved;
+
+  if (strncmp(*path, from, len) || ((*path)[len] && (*path)[len] != '/'))
+    return;
+
+  if (!(moved = malloc(strlen(to) + strlen(*path + len) + 1)))
+    return;
+  sprintf(moved, "%s%s", to, *path + len);
+  free(*path);
+  *path = moved;
+}
+
+static void
+pending_move(const char *from, const char *to)
+{
+  struct pending  *p;
+  struct deferred *d;
+
+  for (p = pending_head; p; p = p->next)
+    path_move(&p->path, from, to);
+  for (p = stale_head; p; p = p->next)
+    path_move(&p->path, from, to);
+  for (d = deferred_head; d; d = d->next)
+    path_move(&d->path, from, to);
+}
+
+/*
+ * take_error:
+ *
+ * Returns, as -errno, the first error a queued update for this path ran
+ * into, and forgets it.  Must be called with the socket held.
+ */
+
+static int
+take_error(const char *path)
+{
+  struct deferred **dp, *d;
+  int err = 0;
+
+  for (dp = &deferred_head; (d = *dp); )
+    if (!strcmp(d->path, path)) {
+      err = d->err;				/* the oldest wins */
+      *dp = d->next;
+      free(d->path);
+      free(d);
+      deferred_count--;
+    } else
+      dp = &d->next;
+
+  return -err;
+}
+
+/*
+ * sync_meta:
+ *
+ * A sync point for a file.  Collects any answers we're still owed, and
+ * returns the first error a streamed write through of ran into, or else
+ * one a queued update for this path did.
+ */
+
+static int
+sync_meta(const char *path, struct ofile *of)
+{
+  int err, werr = 0;
+
+  sock_lock(SCHED_META);			/* Wait our turn */
+
+  if (pending_head)
+    collect_all();
+  err = take_error(path);
+  if (of && of->werr) {
+    werr = -of->werr;
+    of->werr = 0;
+  }
+
+  sock_unlock();				/* Let the next one go */
+
+  return werr ? werr : err;
+}
+
+/*
+ * ticket_path:
+ *
+ * Where we keep the session ticket a terminal gave us for our display.  In
+ * $XDG_RUNTIME_DIR if there is one, since that goes when we log out, or
+ * else in $HOME.
+ */
+
+static int
+ticket_path(const char *host, const char *display, char *path, size_t size)
+{
+  char *dir, *p;
+
+  if (!(dir = getenv("XDG_RUNTIME_DIR")) && !(dir = getenv("HOME")))
+    return -1;
+
+  if (snprintf(path, size, "%s/.ltspfs-%s-%s", dir, host, display) >=
+      (int)size)
+    return -1;
+
+  for (p = path + strlen(dir) + 1; *p; p++)
+    if (*p == '/')
+      *p = '_';
+
+  return 0;
+}
+
+/*
+ * ticket_load:
+ *
+ * Reads our ticket back, if we've got one, and nobody else could have
+ * touched it.
+ */
+
+static int
+ticket_load(const char *path, unsigned char *id)
+{
+  struct stat st;
+  int fd, ok;
+
+  if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) < 0)
+    return FALSE;
+
+  ok = !fstat(fd, &st) && st.st_uid == getuid() && !(st.st_mode & 077) &&
+       read(fd, id, TICKET_LEN) == TICKET_LEN;
+
+  close(fd);
+  return ok;
+}
+
+/*
+ * ticket_save:
+ *
+ * Keeps a new ticket.  It's renamed into place, as another mount might be
+ * reading the old one.
+ */
+
+static void
+ticket_save(const char *path, unsigned char *id)
+{
+  char tmp[PATH_MAX];
+  int fd;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >=
+      (int)sizeof(tmp))
+    return;					/* nowhere to put it */
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) < 0)
+    return;
+
+  if (write(fd, id, TICKET_LEN) != TICKET_LEN || close(fd) ||
+      rename(tmp, path))
+    unlink(tmp);
+}
+
+/*
+ * ticket_resume:
+ *
+ * Shows the terminal the ticket it gave us last time, if we've got one.
+ * Returns TRUE if that got us in.  One it won't take any more is thrown
+ * away.
+ */
+
+static int
+ticket_resume(struct pkt_conn *c, const char *ticket)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  unsigned char id[TICKET_LEN];
+
+  if (!ticket_load(ticket, id))
+    return FALSE;
+
+  pkt_start(&out, outbuf, LTSPFS_RESUME);
+  xdr_opaque(&out, (char *)id, TICKET_LEN);
+
+  xdrmem_create(&in, inbuf, LTSP_MAXBUF, XDR_DECODE);
+  if (pkt_send(c, &out, outbuf) < 0 || pkt_recv(c, &in, inbuf) < 0)
+    return FALSE;
+  if (!pkt_status(&in))
+    return TRUE;				/* straight back in */
+
+  unlink(ticket);				/* session's over */
+  return FALSE;
+}
+
+/*
+ * ltspfs_sendauth:
+ *
+ * Grabs our $DISPLAY, and sends our XAUTH info for verification on the other
+ * side.  If the terminal's let this display in before, and gave us a
+ * ticket, we try that first, which saves running xauth, and the terminal
+ * checking the cookie.
+ */
+
+int
+ltspfs_sendauth(const char *host)
+{
+  XDR  in;
+  char inbuf[LTSP_MAXBUF];
+  char *display;				/* DISPLAY environment var */
+  char ticket[PATH_MAX];			/* where our ticket's kept */
+  unsigned char id[TICKET_LEN];
+  int  tickets, len, res;
+
+  display = getenv("DISPLAY");
+  if (!display) {
+    fprintf(stderr, "Error: $DISPLAY variable not set!\n");
+    exit(1);
+  }
+
+  tickets = !ticket_path(host, display, ticket, sizeof(ticket));
+
+  if (tickets && ticket_resume(&sock, ticket))
+    return OK;
+
+  /*
+   * Now, send the authorization.
+   */
+
+  if (pkt_authorize(&sock, &in, inbuf)) {
+    fprintf(stderr, "Error: couldn't send our X authorization: %s\n",
+            strerror(errno));
+    exit(1);
+  }
+
+  /*
+   * A terminal that hands out tickets puts one after the OK.
+   */
+
+  xdr_setpos(&in, 0);
+  xdr_int(&in, &len);
+  if (tickets && len >= 2 * BYTES_PER_XDR_UNIT + TICKET_LEN &&
+      xdr_int(&in, &res) && !res && xdr_opaque(&in, (char *)id, TICKET_LEN))
+    ticket_save(ticket, id);
+
+  return parse_return(&in);
+}
+
+/*
+ * root_getattr:
+ *
+ * Makes up the attributes for the root of a multi mount, which doesn't
+ * exist on the terminal.
+ */
+
+static int
+root_getattr(struct stat *stbuf)
+{
+  if (!fc)					/* Initialized fc? */
+    fc = fuse_get_context();			/* Grab the context */
+
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_mode  = S_IFDIR | 0755;
+  stbuf->st_nlink = 2;
+  stbuf->st_uid   = fc->uid;
+  stbuf->st_gid   = fc->gid;
+  stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = time(NULL);
+
+  return OK;
+}
+
+/*
+ * flight_put:
+ *
+ * Lets go of a request in flight, freeing it when nobody wants it any
+ * more.  Called with flight_lock held.
+ */
+
+static void
+flight_put(struct flight *f)
+{
+  if (--f->refs)
+    return;
+
+  free(f->key);
+  free(f->reply);
+  free(f);
+}
+
+/*
+ * send_recv_shared:
+ *
+ * send_recv(), for read-only requests.  If the same request's already on
+ * its way, waits for its answer instead.  A stale answer isn't shared:
+ * the asker flushes the node cache, and everyone resends on their own.
+ */
+
+static void
+send_recv_shared(XDR *in, XDR *out, char *inbuf, char *outbuf)
+{
+  struct flight *f, **fp;
+  unsigned int  gen = attr_generation();
+  int           len = xdr_getpos(out) - BYTES_PER_XDR_UNIT;
+  char          *key = outbuf + BYTES_PER_XDR_UNIT;
+  int           shared;
+
+  pthread_mutex_lock(&flight_lock);
+
+  for (f = flights; f; f = f->next)
+    if (f->gen == gen && f->len == len && !memcmp(f->key, key, len))
+      break;
+
+  if (f) {					/* somebody's asked already */
+    f->refs++;
+    while (!f->done)
+      pthread_cond_wait(&flight_cond, &flight_lock);
+    if ((shared = f->reply != NULL)) {
+      memcpy(inbuf, f->reply, packet_word(f->reply, 0));
+      xdr_setpos(in, BYTES_PER_XDR_UNIT);	/* as if we'd read it */
+      xdr_destroy(out);
+      flight_shared++;
+    }
+    flight_put(f);
+    pthread_mutex_unlock(&flight_lock);
+    if (!shared)
+      send_recv(in, out, inbuf, outbuf);	/* no good, ask ourselves */
+    return;
+  }
+
+  if ((f = calloc(1, sizeof(struct flight))) && (f->key = malloc(len))) {
+    memcpy(f->key, key, len);
+    f->len  = len;
+    f->gen  = gen;
+    f->refs = 1;
+    f->next = flights;
+    flights = f;
+  } else {
+    free(f);
+    f = NULL;
+  }
+
+  pthread_mutex_unlock(&flight_lock);
+
+  send_recv(in, out, inbuf, outbuf);		/* send output, recv response */
+
+  if (!f)
+    return;
+
+  len = packet_word(inbuf, 0);
+
+  pthread_mutex_lock(&flight_lock);
+
+  if (!(packet_word(inbuf, 1) == LTSP_STATUS_FAIL &&
+        packet_word(inbuf, 2) == ESTALE) && (f->reply = malloc(len)))
+    memcpy(f->reply, inbuf, len);
+  f->done = TRUE;
+
+  for (fp = &flights; *fp; fp = &(*fp)->next)
+    if (*fp == f) {
+      *fp = f->next;
+      break;
+    }
+
+  pthread_cond_broadcast(&flight_cond);
+  flight_put(f);
+
+  pthread_mutex_unlock(&flight_lock);
+}
+
+/*
+ * getattr_remote:
+ *
+ * Asks ltspfsd for a path's attributes.  The uid and gid are left as the
+ * terminal's.
+ */
+
+static int
+getattr_remote(const char *path, struct stat *stbuf)
+{
+  XDR   out, in;
+  char  outbuf[LTSP_MAXBUF];
+  char  inbuf[LTSP_MAXBUF];
+  int   opcode = LTSPFS_LOOKUP;
+  int   res;
+  unsigned int id;
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    build_path(&out, path);			/* build path */
+  
+    send_recv_shared(&in, &out, inbuf, outbuf);	/* or share an answer */
+  } while (stale(&in));
+
+  if (!xdr_int(&in, &res))		 	/* Did we get error? */
+    return -EACCES;				/* bad arg */
+  if (res)
+    return parse_return(&in);			/* bad result */
+
+  if (!parse_stat(&in, stbuf))			/* populate the structure */
+    return -EACCES;
+
+  /*
+   * Directories come back with a node id.  Remember it, so requests for
+   * things inside this directory can use it.
+   */
+
+  if (xdr_u_int(&in, &id) && id && S_ISDIR(stbuf->st_mode))
+    node_add(path, id);
+  parse_nsec(&in, inbuf, stbuf);		/* if there are any */
+  xdr_destroy(&in);
+
+  return OK;
+}
+
+/*
+ * getattr_cached:
+ *
+ * Gets a path's attributes from the cache if we can, or from ltspfsd if
+ * we can't.
+ */
+
+static int
+getattr_cached(const char *path, struct stat *stbuf)
+{
+  unsigned int gen;
+  int res;
+
+  if (attr_find(path, stbuf))
+    return OK;
+
+  gen = attr_generation();
+  if ((res = getattr_remote(path, stbuf)))
+    return res;
+  attr_add(path, stbuf, gen);
+
+  return OK;
+}
+
+/*
+ * ltspfs_getattr:
+ *
+ * Handles the getattr filesystem call.  
+ */
+
+static int
+ltspfs_getattr(const char *path, struct stat *stbuf)
+{
+  int res;
+
+  if (multi) {
+    if (!strcmp(path, "/"))
+      return root_getattr(stbuf);
+    if (share_find(path, NULL, NULL) < 0)	/* not attached */
+      return -ENOENT;
+  }
+
+  if ((res = getattr_cached(path, stbuf)))
+    return res;
+
+  if (!fc)					/* Initialized fc? */
+    fc = fuse_get_context();			/* Grab the context */
+
+  /* 
+   * We get back the uid and gid from the remote filesystem, but we don't
+   * use it.  Basically, we use the fuse context, which tells us who
+   * mounted the filesystem.  This way, the user always "owns" the files
+   * on the remote media.  This should probably by an overridable option,
+   * just on the off chance that someone DOES have a "real" filesystem
+   * (i.e. one that knows about userids) on the remote side.
+   */
+
+  stbuf->st_uid = fc->uid;
+  stbuf->st_gid = fc->gid;
+
+  return OK;
+}
+
+/*
+ * ltspfs_readlink:
+ *
+ * Handles the readlink filesystem call.  
+ */
+
+static int
+ltspfs_readlink(const char *path, char *buf, size_t size)
+{
+  XDR  out, in;
+  char outbuf[LTSP_MAXBUF];
+  char inbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_READLINK;
+  int  ret, retcode;
+  char *ptr;
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    build_path(&out, path);			/* build path */
+
+    send_recv_shared(&in, &out, inbuf, outbuf);	/* or share an answer */
+  } while (stale(&in));
+
+  /*
+   * Parse the return and populate returning link name buffer.
+   */
+
+  if (!xdr_int(&in, &ret))
+    return -EACCES;
+  if (ret) {
+    if (!xdr_int(&in, &retcode)) {
+      retcode = EACCES;
+    } 
+    xdr_destroy(&in);
+    return -retcode;
+  }
+  
+  ptr = buf;
+
+  if (!xdr_string(&in, &ptr, PATH_MAX))		/* return link target */
+    return -EACCES;
+	
+  xdr_destroy(&in);
+
+  return OK;
+}
+
+/*
+ * share_names:
+ *
+ * Copies out the names of the attached shares, for listing the root of a
+ * multi mount.  The caller frees them.
+ */
+
+static int
+share_names(char **names)
+{
+  int i, count = 0;
+
+  pthread_mutex_lock(&node_lock);
+  for (i = 0; i < SHARE_MAX; i++)
+    if (shares[i].name && (names[count] = strdup(shares[i].name)))
+      count++;
+  pthread_mutex_unlock(&node_lock);
+
+  return count;
+}
+
+#if FUSE_MINOR_VERSION < 3
+/*
+ * ltspfs_getdir:
+ *
+ * Handles the readdir filesystem call.  
+ * The logic's a little complicated on this one.  You've got a few different
+ * scenarios here:
+ * 1) filler returns nonzero, server's still sending direntries.  You want
+ *    to stop calling the filler command, but keep reading from the server
+ *    so you don't have "leftovers" next function call.
+ * 2) filler's ok, but the server on the remote end sends us a "001" error.
+ * 3) (hopefully 99.99% of the time) everything's a-ok.
+ */
+
+static int
+ltspfs_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_READDIR;
+  int  r = 0;
+  int  statcode;
+  char *ptr;
+  char *names[SHARE_MAX];
+  int  i, count;
+
+  if (multi && !strcmp(path, "/")) {		/* list the shares */
+    count = share_names(names);
+    r = filler(h, ".", DT_DIR, 0);
+    if (!r)
+      r = filler(h, "..", DT_DIR, 0);
+    for (i = 0; i < count; i++) {
+      if (!r)
+        r = filler(h, names[i], DT_DIR, 0);
+      free(names[i]);
+    }
+    return r;
+  }
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    build_path(&out, path);			/* build path */
+
+    sock_lock(SCHED_META);			/* Wait our turn */
+    writepacket(&out, outbuf);
+    readpacket(&in, inbuf);			/* Read response */
+    if (!stale(&in))
+      break;
+    sock_unlock();				/* resend with full path */
+  } while (TRUE);
+
+  xdr_int(&in, &statcode);
+  while (statcode == LTSP_STATUS_CONT) {	/* Continue? */
+    if (!r) {
+      ino_t inode;
+      unsigned char type;
+      char dirpath[PATH_MAX];
+
+      ptr = dirpath;
+      xdr_u_longlong_t(&in, &inode);
+      xdr_u_char(&in, &type);
+      xdr_string(&in, &ptr, PATH_MAX); 
+      r = filler(h, dirpath, type, inode);
+    }
+
+    xdr_setpos(&in, 0);				/* rewind data packet */
+    readpacket(&in, inbuf);			/* Read the next line */
+    xdr_int(&in, &statcode);			/* And grab the statcode */
+  }
+
+  sock_unlock();				/* Let the next one go */
+
+  if (r)					/* if filler died */
+    return r;					/* return it first */
+  else
+    return parse_return(&in);			/* Return result */
+}
+#else
+/*
+ * ltspfs_opendir:
+ *
+ * Handles the opendir filesystem call.  Nothing goes over the wire yet;
+ * we just need somewhere to keep ltspfsd's handle for the directory
+ * stream.
+ */
+
+static int
+ltspfs_opendir(const char *path __attribute__((unused)),
+	       struct fuse_file_info *fi)
+{
+  fi->fh = (unsigned long)calloc(1, sizeof(struct odir));
+  return OK;
+}
+
+/*
+ * ltspfs_releasedir:
+ *
+ * Handles the releasedir filesystem call.  ltspfsd recycles its streams
+ * on its own, so there's nothing to tell it.
+ */
+
+static int
+ltspfs_releasedir(const char *path __attribute__((unused)),
+		  struct fuse_file_info *fi)
+{
+  struct odir *od = (struct odir *)(unsigned long)fi->fh;
+
+  if (od)
+    dir_release(od);
+  free(od);
+  return OK;
+}
+
+/*
+ * readdir_cached:
+ *
+ * Hands entries from a cached listing to the filler, from the one after
+ * the cookie offset.  Returns -1 if the cookie isn't in it.
+ */
+
+static int
+readdir_cached(struct odir *od, void *buf, fuse_fill_dir_t filler,
+	       off_t offset)
+{
+  struct dirlist *l = od->list;
+  struct stat    st;
+  int            i = od->pos;
+
+  if (!offset)
+    i = 0;
+  else if (i < 1 || i > l->count || l->ents[i - 1].cookie != offset) {
+    for (i = 0; i < l->count; i++)		/* not where we left off */
+      if (l->ents[i].cookie == offset)
+        break;
+    if (i++ == l->count)
+      return -1;
+  }
+
+  for (; i < l->count; i++) {
+    memset(&st, 0, sizeof (st));
+    st.st_ino  = l->ents[i].ino;
+    st.st_mode = l->ents[i].type << 12;
+    if (filler(buf, l->names + l->ents[i].name, &st, l->ents[i].cookie))
+      break;					/* full, fuse will be back */
+  }
+  od->pos = i;
+
+  return OK;
+}
+
+/*
+ * ltspfs_readdir:
+ *
+ * Handles the readdir filesystem call.  Directories come over a page at
+ * a time, starting from offset, which is a cookie from ltspfsd.  Every
+ * entry gets handed to the filler with the cookie for the entry after it,
+ * so when the filler's full, we can just stop: fuse will come back with
+ * the right offset for the rest.  The socket's free between pages.
+ *
+ * Reading from the start, we look for a cached listing that's still good,
+ * and if there isn't one, collect one as we go, for as long as fuse comes
+ * back for the rest where we left off.
+ */
+
+static int
+ltspfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+	       off_t offset, struct fuse_file_info *fi)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_READDIRPAGE;
+  int  res, more, eof = FALSE;
+  char *ptr;
+  char *names[SHARE_MAX];
+  int  i, count;
+  off_t next;
+  struct stat dirst;
+  struct odir *od = (struct odir *)(unsigned long)fi->fh;
+  unsigned int handle = od ? od->handle : 0;
+
+  if (multi && !strcmp(path, "/")) {		/* list the shares */
+    count = share_names(names);
+    res = filler(buf, ".", NULL, 0);
+    if (!res)
+      res = filler(buf, "..", NULL, 0);
+    for (i = 0; i < count; i++) {
+      if (!res)
+        res = filler(buf, names[i], NULL, 0);
+      free(names[i]);
+    }
+    return res;
+  }
+
+  if (od && !offset) {				/* from the start */
+    dir_release(od);
+    if (!getattr_cached(path, &dirst) &&
+        !(od->list = dir_find(path, &dirst)))
+      od->fill = dir_start(&dirst);
+  }
+
+  if (od && od->list) {
+    if (!readdir_cached(od, buf, filler, offset))
+      return OK;
+    dir_release(od);				/* lost our place, ask ltspfsd */
+  }
+
+  if (od && od->fill && od->fill->next != offset) {
+    dir_end(od->fill);				/* a gap, it's no good now */
+    od->fill = NULL;
+  }
+
+  while (!eof) {
+    do {
+      init_pkt(&in, &out, inbuf, outbuf);	/* Initialize packets */
+
+      xdr_int(&out, &opcode);			/* build opcode */
+      xdr_u_int(&out, &handle);			/* build stream handle */
+      xdr_longlong_t(&out, &offset);		/* build cookie */
+      build_path(&out, path);			/* build path */
+
+      send_recv_shared(&in, &out, inbuf, outbuf);	/* or share an answer */
+    } while (stale(&in));
+
+    if (!xdr_int(&in, &res))
+      return -EACCES;
+    if (res)
+      return parse_return(&in);
+    if (!xdr_u_int(&in, &handle))
+      return -EACCES;
+    if (od)
+      od->handle = handle;			/* keep using this stream */
+
+    while (xdr_int(&in, &more) && more) {
+      struct stat st;
+      unsigned char type;
+      char dirpath[PATH_MAX];
+
+      ptr = dirpath;
+      memset(&st, 0, sizeof (st));
+      if (!xdr_u_longlong_t(&in, &st.st_ino) ||	/* grab returned inode */
+          !xdr_u_char(&in, &type) ||		/* grab returned type */
+          !xdr_string(&in, &ptr, PATH_MAX) ||	/* grab dirent name */
+          !xdr_longlong_t(&in, &next))		/* grab next cookie */
+        return -EACCES;
+
+      st.st_mode = type << 12;			/* More magic */
+      if (filler(buf, dirpath, &st, next))	/* full, fuse will be back */
+        return OK;
+      offset = next;
+
+      if (od && od->fill && !dir_collect(od->fill, &st, type, dirpath, next)) {
+        dir_end(od->fill);			/* too big to keep */
+        od->fill = NULL;
+      }
+    }
+
+    if (!xdr_int(&in, &eof))
+      return -EACCES;
+    xdr_destroy(&in);
+  }
+
+  if (od && od->fill) {
+    dir_add(path, od->fill);
+    dir_end(od->fill);
+    od->fill = NULL;
+  }
+
+  return OK;
+}
+#endif
+
+
+/*
+ * ltspfs_mknod:
+ *
+ * Handles the mknod filesystem call.  
+ */
+
+static int
+ltspfs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_MKNOD;
+
+  if (at_root(path))
+    return -EPERM;
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_u_int(&out, &mode);			/* build mode */
+    xdr_u_longlong_t(&out, &rdev);		/* build rdev */
+    build_path(&out, path);			/* build path */
+
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
+
+  attr_forget(path, FORGET_PARENT);
+  return parse_return(&in);
+}
+
+/*
+ * share_attach:
+ *
+ * Attaches a share to a multi mount, by mounting the export it lives in on
+ * the terminal.
+ */
+
+static int
+share_attach(const char *share)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  char path[PATH_MAX];
+  int  opcode = LTSPFS_MOUNT;
+  char *ptr = path;
+  const char *name = share + 1;			/* skip leading '/' */
+  unsigned int id;
+  int  i, res;
+
+  if (share_find(share, NULL, NULL) >= 0)
+    return -EEXIST;
+
+  pthread_mutex_lock(&node_lock);
+  for (i = 0; i < SHARE_MAX && shares[i].name; i++)
+    ;
+  if (i < SHARE_MAX && !(shares[i].name = strdup(name)))
+    i = -1;
+  pthread_mutex_unlock(&node_lock);
+
+  if (i < 0)
+    return -ENOMEM;
+  if (i == SHARE_MAX)
+    return -ENOSPC;
+
+  snprintf(path, PATH_MAX, "%s/%s", export_base, name);
+
+  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+  xdr_int(&out, &opcode);			/* build opcode */
+  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+
+  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+
+  if (!xdr_int(&in, &res) || res || !xdr_u_int(&in, &id)) {
+    pthread_mutex_lock(&node_lock);
+    free(shares[i].name);
+    shares[i].name = NULL;
+    pthread_mutex_unlock(&node_lock);
+    return res ? parse_return(&in) : -EACCES;
+  }
+
+  xdr_destroy(&in);
+
+  pthread_mutex_lock(&node_lock);
+  shares[i].id = id;
+  pthread_mutex_unlock(&node_lock);
+
+  attr_forget(share, FORGET_TREE);		/* whatever was here before */
+#if FUSE_MINOR_VERSION >= 3
+  if (prewarm)
+    prewarm_start(share);
+#endif
+
+  return OK;
+}
+
+/*
+ * share_detach:
+ *
+ * Detaches a share from a multi mount.
+ */
+
+static int
+share_detach(const char *path)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_UMOUNT;
+  unsigned int id;
+  int  i;
+
+  if ((i = share_find(path, &id, NULL)) < 0)
+    return -ENOENT;
+
+  node_forget(path);
+  attr_forget(path, FORGET_TREE);
+
+  pthread_mutex_lock(&node_lock);
+  free(shares[i].name);
+  shares[i].name = NULL;
+  pthread_mutex_unlock(&node_lock);
+
+  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+  xdr_int(&out, &opcode);			/* build opcode */
+  xdr_u_int(&out, &id);				/* build export */
+
+  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+
+  return parse_return(&in);
+}
+
+/*
+ * ltspfs_mkdir:
+ *
+ * Handles the mkdir filesystem call.  
+ */
+
+static int
+ltspfs_mkdir(const char *path, mode_t mode)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_MKDIR;
+
+  if (at_root(path))
+    return share_attach(path);
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_u_int(&out, &mode);			/* build mode */
+    build_path(&out, path);			/* build path */
+
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
+
+  attr_forget(path, FORGET_PARENT);
+  return parse_return(&in);
+}
+
+/*
+ * ltspfs_onepath:
+ *
+ * Handles single path filesystem calls.  
+ */
+
+static int
+ltspfs_onepath(int opcode, const char *path)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    build_path(&out, path);			/* build path */
+
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
+
+  attr_forget(path, FORGET_PARENT | FORGET_TREE);
+  return parse_return(&in);
+}
+
+/*
+ * ltspfs_unlink:
+ *
+ * Handles the unlink filesystem call.  
+ */
+
+static int
+ltspfs_unlink(const char *path)
+{
+  if (at_root(path))
+    return -EPERM;
+
+  return ltspfs_onepath(LTSPFS_UNLINK, path);
+}
+
+/*
+ * ltspfs_rmdir:
+ *
+ * Handles the rmdir filesystem call.  
+ */
+
+static int
+ltspfs_rmdir(const char *path)
+{
+  if (at_root(path))
+    return share_detach(path);
+
+  node_forget(path);
+  return ltspfs_onepath(LTSPFS_RMDIR, path);
+}
+
+/*
+ * ltspfs_twopath:
+ *
+ * Handles generic path filesystem calls.  
+ */
+
+static int
+ltspfs_twopath(int opcode, const char *from, const char *to)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  char *ptr;
+  unsigned int root = 0;
+  int  owed;
+
+  if (at_root(to) || (opcode != LTSPFS_SYMLINK && at_root(from)))
+    return -EPERM;
+
+  if (multi && opcode != LTSPFS_SYMLINK &&
+      share_find(from, NULL, NULL) != share_find(to, NULL, NULL))
+    return -EXDEV;				/* different exports */
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    if (opcode == LTSPFS_SYMLINK) {		/* link target isn't a node */
+      ptr = (char *)from;
+      xdr_u_int(&out, &root);
+      xdr_string(&out, &ptr, PATH_MAX);		/* build from */
+    } else
+      build_path(&out, from);			/* build from */
+    build_path(&out, to);			/* build to */
+
+    sock_lock(SCHED_META);			/* Wait our turn */
+    owed = pending_count;
+    writepacket(&out, outbuf);			/* Send out packet */
+    readpacket(&in, inbuf);			/* Read response */
+    if (!owed)					/* just ours, so time it */
+      op_done(0);
+    if (opcode == LTSPFS_RENAME &&		/* before any get resent */
+        packet_word(inbuf, 1) == LTSP_STATUS_OK)
+      pending_move(from, to);
+    sock_unlock();				/* Let the next one go */
+  } while (stale(&in));
+
+  if (opcode != LTSPFS_SYMLINK)			/* link count, or it's gone */
+    attr_forget(from, FORGET_PARENT | FORGET_TREE);
+  attr_forget(to, FORGET_PARENT | FORGET_TREE);
+  return parse_return(&in);
+}
+
+/*
+ * ltspfs_symlink:
+ *
+ * Handles the symlink filesystem call.  
+ */
+
+static int
+ltspfs_symlink(const char *from, const char *to)
+{
+  return ltspfs_twopath(LTSPFS_SYMLINK, from, to);
+}
+
+/*
+ * ltspfs_rename:
+ *
+ * Handles the rename filesystem call.  
+ */
+
+static int
+ltspfs_rename(const char *from, const char *to)
+{
+  node_forget(from);
+  node_forget(to);
+  return ltspfs_twopath(LTSPFS_RENAME, from, to);
+}
+
+/*
+ * ltspfs_link:
+ *
+ * Handles the link filesystem call.  
+ */
+
+static int
+ltspfs_link(const char *from, const char *to)
+{
+  return ltspfs_twopath(LTSPFS_LINK, from, to);
+}
+
+/*
+ * ltspfs_chmod:
+ *
+ * Handles the chmod filesystem call.  The update is queued, and any error
+ * comes back at the next flush or fsync.
+ */
+
+static int
+ltspfs_chmod(const char *path, mode_t mode)
+{
+  struct pending *p;
+
+  if (!(p = calloc(1, sizeof(struct pending))))
+    return -ENOMEM;
+
+  p->opcode = LTSPFS_CHMOD;
+  p->arg1   = mode;
+
+  return queue_meta(p, path);
+}
+
+/*
+ * ltspfs_chown:
+ *
+ * Handles the chown filesystem call.  Queued, like chmod.
+ */
+
+static int
+ltspfs_chown(const char *path, uid_t uid, gid_t gid)
+{
+  struct pending *p;
+
+  if (!(p = calloc(1, sizeof(struct pending))))
+    return -ENOMEM;
+
+  p->opcode = LTSPFS_CHOWN;
+  p->arg1   = uid;
+  p->arg2   = gid;
+
+  return queue_meta(p, path);
+}
+
+/*
+ * ltspfs_truncate:
+ *
+ * Handles the truncate filesystem call.  
+ */
+
+static int
+ltspfs_truncate(const char *path, off_t size)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_TRUNCATE;
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_longlong_t(&out, &size);		/* build size */
+    build_path(&out, path);			/* build path */
+
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
+
+  attr_forget(path, 0);
+  return parse_return(&in);
+}
+
+/*
+ * ltspfs_utime:
+ *
+ * Handles the utime filesystem call.  Queued, like chmod.
+ */
+
+static int
+ltspfs_utime(const char *path, struct utimbuf *buf)
+{
+  struct pending *p;
+
+  if (!(p = calloc(1, sizeof(struct pending))))
+    return -ENOMEM;
+
+  p->opcode  = LTSPFS_UTIME;
+  p->actime  = buf->actime;
+  p->modtime = buf->modtime;
+
+  return queue_meta(p, path);
+}
+
+/*
+ * open_handle:
+ *
+ * Sets up a handle for a file ltspfsd has said we can open, from what it
+ * told us about the file.  An older ltspfsd won't send the size and mtime.
+ * Then the kernel has to drop its cache every time, like it always did.
+ * Returns FALSE if the file wasn't all there was to the answer.
+ */
+
+static int
+open_handle(const char *path, XDR *in, struct fuse_file_info *fi)
+{
+  off_t size;
+  long mtime, nsec;
+  u_quad_t ino, volume;
+  struct ofile *of;
+
+  if ((of = calloc(1, sizeof(struct ofile))))	/* no big deal if not */
+    of->seek = TRUE;
+  fi->fh = (unsigned long)of;
+
+  if (!xdr_longlong_t(in, &size) || !xdr_long(in, &mtime) ||
+      !xdr_long(in, &nsec))
+    return FALSE;
+
+  if (fver_check(path, size, mtime, nsec)) {
+#if FUSE_MINOR_VERSION >= 4
+    fi->keep_cache = 1;
+#endif
+  }
+
+  if (!xdr_u_longlong_t(in, &ino) || !xdr_u_longlong_t(in, &volume))
+    return FALSE;
+
+  if (of) {
+    of->ident  = TRUE;
+    of->volume = volume;
+    of->ino    = ino;
+    of->size   = size;
+    of->mtime  = mtime;
+    of->nsec   = nsec;
+  }
+
+  return TRUE;
+}
+
+/*
+ * ltspfs_open:
+ *
+ * Handles the open filesystem call.  A file whose head was just prefetched
+ * can be opened for reading without asking.
+ */
+
+static int
+ltspfs_open(const char *path, struct fuse_file_info *fi)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_OPEN;
+  int  res;
+
+  if (head_open(path, fi))			/* just fetched its head */
+    return OK;
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_int(&out, &fi->flags);			/* build open flags */
+    build_path(&out, path);			/* build path */
+
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
+
+  if (!xdr_int(&in, &res))
+    return -EACCES;
+  if (res)
+    return parse_return(&in);
+
+  open_handle(path, &in, fi);
+  xdr_destroy(&in);
+
+  return OK;
+}
+
+#if FUSE_USE_VERSION >= 25
+/*
+ * ltspfs_create:
+ *
+ * Handles the create filesystem call.  Without it, fuse would mknod, look
+ * the file up and open it, a round trip each.  ltspfsd does all three in
+ * one go, and hands back the new file's attributes along with what an
+ * open does, so the lookup fuse does next comes from the cache.
+ */
+
+static int
+ltspfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_CREATE;
+  int  res;
+  struct stat stbuf;
+
+  if (at_root(path))
+    return -EPERM;
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_int(&out, &fi->flags);			/* build open flags */
+    xdr_u_int(&out, &mode);			/* build mode */
+    build_path(&out, path);			/* build path */
+
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
+
+  attr_forget(path, FORGET_PARENT);
+
+  if (!xdr_int(&in, &res))
+    return -EACCES;
+  if (res)
+    return parse_return(&in);
+
+  memset(&stbuf, 0, sizeof(stbuf));
+  if (open_handle(path, &in, fi) && parse_stat(&in, &stbuf))
+    attr_add(path, &stbuf, attr_generation());
+  xdr_destroy(&in);
+
+  return OK;
+}
+#endif
+
+/*
+ * seek_remote:
+ *
+ * lseek()s a file on the terminal.  Returns the new offset, or -errno.
+ */
+
+static off_t
+seek_remote(const char *path, off_t offset, int whence)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_SEEK;
+  int  res;
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_longlong_t(&out, &offset);		/* build offset */
+    xdr_int(&out, &whence);			/* build whence */
+    build_path(&out, path);			/* build path */
+
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
+
+  if (!xdr_int(&in, &res))
+    return -EACCES;
+  if (res)
+    return parse_return(&in);
+  if (!xdr_longlong_t(&in, &offset))
+    return -EACCES;
+
+  xdr_destroy(&in);
+  return offset;
+}
+
+/*
+ * hole_at:
+ *
+ * For large reads.  Returns how many bytes from pos on are a hole, and
+ * don't need fetching.  If pos is data, returns 0, and trims *len so the
+ * chunk doesn't run past the end of the data.  Past the end of the file,
+ * or if the terminal couldn't say, it's 0 too, and the read just goes
+ * ahead; only a terminal that can't look for holes at all stops us
+ * asking.
+ */
+
+static off_t
+hole_at(const char *path, struct ofile *of, off_t pos, int *len)
+{
+  off_t from, to, data;
+
+  pthread_mutex_lock(&ofile_lock);
+  from = of->from;
+  to   = of->to;
+  pthread_mutex_unlock(&ofile_lock);
+
+  if (pos < from || pos >= to) {
+    data = seek_remote(path, pos, SEEK_DATA);
+    if (data == -ENXIO)				/* nothing but hole to EOF */
+      data = seek_remote(path, 0, SEEK_END);
+    if (data > pos)
+      return data - pos;
+    to = data == pos ? seek_remote(path, pos, SEEK_HOLE) : data;
+
+    if (to <= pos) {
+      if (to == -EINVAL || to == -ENOSYS) {	/* can't, don't try again */
+        pthread_mutex_lock(&ofile_lock);
+        of->seek = FALSE;
+        pthread_mutex_unlock(&ofile_lock);
+      }
+      return 0;					/* EOF, or just this read */
+    }
+
+    pthread_mutex_lock(&ofile_lock);
+    of->from = from = pos;
+    of->to   = to;
+    pthread_mutex_unlock(&ofile_lock);
+  }
+
+  if (pos + *len > to)
+    *len = to - pos;
+
+  return 0;
+}
+
+/*
+ * shm_attach:
+ *
+ * Maps the shared cache, creating it, and setting it up, if we're first.
+ */
+
+static void
+shm_attach(void)
+{
+  char   name[NAME_MAX];
+  struct stat st;
+  pthread_mutexattr_t attr;
+  size_t sets;
+  void   *map;
+  int    fd;
+
+  if ((fd = shm_open(SHM_NAME, O_RDWR, 0)) < 0) {	/* everyone's */
+    snprintf(name, sizeof(name), "%s-%d", SHM_NAME, (int)getuid());
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) < 0)	/* ours */
+      return;
+  }
+
+  flock(fd, LOCK_EX);				/* one of us sets it up */
+
+  if (!fstat(fd, &st) && !st.st_size && !ftruncate(fd, (off_t)shm_budget))
+    st.st_size = (off_t)shm_budget;
+
+  sets = (st.st_size - sizeof(struct shm_head)) /
+         (SHM_WAYS * (sizeof(struct shm_slot) + SHM_BLOCK));
+
+  if (st.st_size > (off_t)sizeof(struct shm_head) && sets &&
+      (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0)) != MAP_FAILED) {
+    shm       = map;
+    shm_size  = st.st_size;
+    shm_slots = (struct shm_slot *)(shm + 1);
+    shm_data  = (char *)(shm_slots + sets * SHM_WAYS);
+
+    if (shm->magic != SHM_MAGIC || shm->sets != sets) {
+      memset(shm, 0, (char *)shm_data - (char *)shm);
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_init(&shm->lock, &attr);
+      pthread_mutexattr_destroy(&attr);
+      shm->sets  = sets;
+      shm->magic = SHM_MAGIC;
+    }
+  }
+
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+/*
+ * shm_lock:
+ *
+ * Locks the shared cache.  If whoever had it died holding it, the lock's
+ * still good: a slot's only marked used once its data's all there.
+ */
+
+static void
+shm_lock(void)
+{
+  if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&shm->lock);
+}
+
+/*
+ * shm_set:
+ *
+ * Returns the first slot of the set a block goes in.  Must be called with
+ * the shared cache locked.
+ */
+
+static struct shm_slot *
+shm_set(struct shm_key *key)
+{
+  return shm_slots + SHM_WAYS *
+         (block_sum((unsigned char *)key, sizeof(*key)) % shm->sets);
+}
+
+/*
+ * shm_get:
+ *
+ * Copies a block out of the shared cache.  Returns its length, or -1 if
+ * it's not there.
+ */
+
+static int
+shm_get(struct shm_key *key, char *buf)
+{
+  struct shm_slot *s;
+  int    i, len = -1;
+
+  shm_lock();
+  s = shm_set(key);
+  for (i = 0; i < SHM_WAYS; i++, s++)
+    if (s->used && !memcmp(&s->key, key, sizeof(*key))) {
+      len = s->len;
+      memcpy(buf, shm_data + (size_t)(s - shm_slots) * SHM_BLOCK, len);
+      s->stamp = ++shm->clock;
+      break;
+    }
+  pthread_mutex_unlock(&shm->lock);
+
+  return len;
+}
+
+/*
+ * shm_put:
+ *
+ * Puts a block in the shared cache, in place of the least recently used
+ * one in its set.
+ */
+
+static void
+shm_put(struct shm_key *key, const char *buf, int len)
+{
+  struct shm_slot *s, *victim = NULL;
+  int    i;
+
+  shm_lock();
+  s = shm_set(key);
+  for (i = 0; i < SHM_WAYS; i++, s++) {
+    if (s->used && !memcmp(&s->key, key, sizeof(*key))) {
+      victim = s;				/* replace it */
+      break;
+    }
+    if (!victim || !s->used || (victim->used && s->stamp < victim->stamp))
+      victim = s;
+  }
+
+  victim->used = FALSE;				/* not till the data's in */
+  memcpy(shm_data + (size_t)(victim - shm_slots) * SHM_BLOCK, buf, len);
+  victim->key   = *key;
+  victim->len   = len;
+  victim->stamp = ++shm->clock;
+  victim->used  = TRUE;
+  pthread_mutex_unlock(&shm->lock);
+}
+
+/*
+ * shm_drop:
  *
- * Sets up an input and output packets.
+ * Throws a block out of the shared cache.  It didn't match the terminal's.
  */
 
-void
-init_pkt(XDR *in, XDR *out, char *inbuf, char *outbuf)
+static void
+shm_drop(struct shm_key *key)
 {
-  int i = 0;
-  xdrmem_create(in,  inbuf,  LTSP_MAXBUF, XDR_DECODE);
-  xdrmem_create(out, outbuf, LTSP_MAXBUF, XDR_ENCODE);
-  xdr_int(out, &i);				/* reserve length field */
+  struct shm_slot *s;
+  int    i;
+
+  shm_lock();
+  s = shm_set(key);
+  for (i = 0; i < SHM_WAYS; i++, s++)
+    if (s->used && !memcmp(&s->key, key, sizeof(*key)))
+      s->used = FALSE;
+  shm->bad++;
+  pthread_mutex_unlock(&shm->lock);
 }
 
+/*
+ * block_key:
+ *
+ * Fills in the shared cache key for a block of an open file.
+ */
+
+static void
+block_key(struct shm_key *key, struct ofile *of, off_t block)
+{
+  memset(key, 0, sizeof(*key));
+  key->volume = of->volume;
+  key->ino    = of->ino;
+  key->size   = of->size;
+  key->mtime  = of->mtime;
+  key->nsec   = of->nsec;
+  key->block  = block;
+}
 
 /*
- * timeout():
- * This handles a timeout on a read or write operation. 
- * Close the socket, unmount the fuse mount, and exit the program.
- * This will improve over time, retry's are a possibility, etc.
+ * checksum_remote:
+ *
+ * Has ltspfsd sum count SHM_BLOCK blocks of a file, starting at block
+ * first.  Returns how many it summed, which is fewer at end of file, or
+ * an error.
  */
 
-void
-timeout()
+static int
+checksum_remote(const char *path, off_t first, int count, u_quad_t *sums)
 {
-  close(sockfd);
-  fuse_unmount(fuse_mount_point);
-  exit(0);
+  XDR   in, out;
+  char  inbuf[LTSP_MAXBUF];
+  char  outbuf[LTSP_MAXBUF];
+  int   opcode = LTSPFS_CHECKSUM;
+  u_int bsize = SHM_BLOCK;
+  off_t offset = first * SHM_BLOCK;
+  int   res, i;
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_u_int(&out, &bsize);			/* build block size */
+    xdr_longlong_t(&out, &offset);		/* build offset */
+    xdr_int(&out, &count);			/* build block count */
+    build_path(&out, path);			/* build path */
+
+    sock_lock(SCHED_READ);			/* someone's waiting on it */
+    writepacket(&out, outbuf);
+    readpacket(&in, inbuf);			/* Read response */
+    sock_unlock();
+  } while (stale(&in));
+
+  if (!xdr_int(&in, &res))
+    return -EACCES;
+  if (res)
+    return parse_return(&in);
+  if (!xdr_int(&in, &res) || res > count)
+    return -EACCES;
+
+  for (i = 0; i < res; i++)
+    if (!xdr_u_longlong_t(&in, &sums[i]))
+      return -EACCES;
+  xdr_destroy(&in);
+
+  return res;
 }
 
 /*
- * readpacket():
- * Helper command to read packets in, since we first have to read the packet
- * length, then the rest of the packet.
+ * shm_read:
+ *
+ * Tries to satisfy a read from the shared cache.  Only if every block it
+ * touches is there, and ltspfsd agrees they're what's in the file, is it
+ * used.  Returns the bytes read, or -1 if it has to go over the wire.
  */
 
-int readpacket(XDR *in, char *packetbuffer)
+static int
+shm_read(const char *path, struct ofile *of, char *buf, size_t size,
+	 off_t offset)
 {
-  char *pktptr = packetbuffer;
-  int len;
+  struct shm_key key;
+  u_quad_t sums[SHM_VERIFY_MAX];
+  off_t  first, end;
+  char   *blocks;
+  int    i, count, len, ok = TRUE;
+
+  end = offset + size;
+  if (end > of->size)
+    end = of->size;
+  if (offset >= end)
+    return -1;
+
+  first = offset / SHM_BLOCK;
+  count = (end - 1) / SHM_BLOCK - first + 1;
+  if (count > SHM_VERIFY_MAX || !(blocks = malloc(count * SHM_BLOCK)))
+    return -1;
+
+  for (i = 0; i < count && ok; i++) {
+    block_key(&key, of, first + i);
+    len = shm_get(&key, blocks + i * SHM_BLOCK);
+    ok = len == SHM_BLOCK || (len > 0 && i == count - 1);
+  }
 
-  /*
-   * First, read in the first BYTES_PER_XDR_UNIT bytes, which should
-   * have the packet length in them.
-   */
+  shm_lock();
+  if (ok)
+    shm->hits++;
+  else
+    shm->misses++;
+  pthread_mutex_unlock(&shm->lock);
+
+  if (ok && checksum_remote(path, first, count, sums) == count)
+    for (i = 0; i < count && ok; i++) {
+      len = i < count - 1 ? SHM_BLOCK : of->size - (first + i) * SHM_BLOCK;
+      if (len > SHM_BLOCK)
+        len = SHM_BLOCK;
+      if (block_sum((unsigned char *)blocks + i * SHM_BLOCK, len) != sums[i]) {
+        block_key(&key, of, first + i);
+        shm_drop(&key);
+        ok = FALSE;
+      }
+    }
+  else
+    ok = FALSE;
+
+  if (ok)
+    memcpy(buf, blocks + (offset - first * SHM_BLOCK), end - offset);
+  free(blocks);
 
-  readn(sockfd, pktptr, BYTES_PER_XDR_UNIT);	/* Read length */
-  xdr_int(in, &len);				/* decode it */
-  len -= BYTES_PER_XDR_UNIT;			/* reduce count */
-  pktptr += BYTES_PER_XDR_UNIT;			/* skip over count in buffer */
-  return readn(sockfd, pktptr, len);		/* and read the rest */
+  return ok ? end - offset : -1;
 }
 
 /*
- * packetlen():
- * Fixes up the length of the packet.  Returns the packet length.
+ * shm_fill:
+ *
+ * Puts whole blocks from a read we've done into the shared cache.
  */
 
-int
-writepacket(XDR *out, char *packetbuffer)
+static void
+shm_fill(struct ofile *of, const char *buf, size_t size, off_t offset)
 {
-  int i;
-  
-  i = xdr_getpos(out);				/* Grab the current streampos */
-  xdr_setpos(out, 0);				/* rewind to beginning */
+  struct shm_key key;
+  off_t  block, start;
+  int    len;
+
+  for (block = (offset + SHM_BLOCK - 1) / SHM_BLOCK;
+       (start = block * SHM_BLOCK) < of->size; block++) {
+    len = of->size - start > SHM_BLOCK ? SHM_BLOCK : of->size - start;
+    if (start + len > offset + (off_t)size)
+      break;
+    block_key(&key, of, block);
+    shm_put(&key, buf + (start - offset), len);
+  }
+}
 
-  /*
-   * Since the first thing we do when initializing a packet is leave a space
-   * for an int at the beginning, this is the space for the packet length.
-   * Now, write out the proper length back at the beginning.
-   */
+/*
+ * head_unlink:
+ *
+ * Takes a head out of the list and frees it.  Returns how much that was.
+ * Called with head_lock held.
+ */
 
-  xdr_int(out, &i);				/* Write proper length */
-  i = writen(sockfd, packetbuffer, i);		/* Write the packet to socket */
+static size_t
+head_unlink(struct head *h, struct head *prev)
+{
+  size_t freed;
 
-  /*
-   *  since we've finished sending, destroy the output stream
-   */
+  if (prev)
+    prev->next = h->next;
+  else
+    heads = h->next;
+  if (heads_tail == h)
+    heads_tail = prev;
 
-  xdr_destroy(out);
-  return i;
+  freed  = mem_put(h->data);
+  freed += mem_put(h->path);
+  freed += mem_put(h);
+
+  return freed;
 }
 
 /*
- * send_recv():
+ * head_forget:
  *
- * For most of the functions, this will handle the communications.  Mutexes
- * handle the locking and unlocking of the communication stream.
+ * Drops the head we've got for a path, and with FORGET_TREE, any for what's
+ * underneath it.
  */
 
-void
-send_recv(XDR *in, XDR *out, char *inbuf, char *outbuf)
+static void
+head_forget(const char *path, int how)
 {
-  pthread_mutex_lock(&lock);			/* Lock mutex */
-  writepacket(out, outbuf);			/* Send out packet */
-  readpacket(in, inbuf);			/* Read response */
-  pthread_mutex_unlock(&lock);			/* Unlock mutex */
+  struct head *h, *prev = NULL, *next;
+  int len = strlen(path);
+
+  pthread_mutex_lock(&head_lock);
+  for (h = heads; h; h = next) {
+    next = h->next;
+    if (!strcmp(h->path, path) ||
+        ((how & FORGET_TREE) && !strncmp(h->path, path, len) &&
+         h->path[len] == '/'))
+      head_unlink(h, prev);
+    else
+      prev = h;
+  }
+  pthread_mutex_unlock(&head_lock);
+}
+
+/*
+ * head_shrink:
+ *
+ * Frees up to want bytes of heads, oldest first, for mem_reclaim().
+ * Called with head_lock held.
+ */
+
+static size_t
+head_shrink(size_t want)
+{
+  size_t freed = 0;
+
+  while (heads && freed < want)
+    freed += head_unlink(heads, NULL);
+
+  return freed;
+}
+
+/*
+ * head_add:
+ *
+ * Keeps a head that's come in, unless anything's been forgotten since the
+ * batch was asked for.  It may have been this file changing.
+ */
+
+static void
+head_add(const char *path, const char *data, unsigned int len,
+	 struct ofile *of, unsigned int gen)
+{
+  struct head *h;
+
+  head_forget(path, 0);				/* replaces any we had */
+
+  pthread_mutex_lock(&head_lock);
+  if (gen == attr_generation() &&
+      (h = mem_get(MEM_HEAD, sizeof(struct head)))) {
+    h->path = mem_strdup(MEM_HEAD, path);
+    h->data = mem_get(MEM_HEAD, len);
+    if (!h->path || !h->data) {
+      mem_put(h->path);
+      mem_put(h->data);
+      mem_put(h);
+    } else {
+      memcpy(h->data, data, len);
+      h->len     = len;
+      h->size    = of->size;
+      h->mtime   = of->mtime;
+      h->nsec    = of->nsec;
+      h->volume  = of->volume;
+      h->ino     = of->ino;
+      h->expires = time(NULL) + ATTR_TTL;
+      h->used    = FALSE;
+      h->next  = NULL;
+      if (heads_tail)
+        heads_tail->next = h;
+      else
+        heads = h;
+      heads_tail = h;
+      head_fetched++;
+    }
+  }
+  pthread_mutex_unlock(&head_lock);
+}
+
+/*
+ * head_read:
+ *
+ * Copies as much of a read as it can from the head we've got for the
+ * file, if it's still good.  Returns how much that was.
+ */
+
+static size_t
+head_read(const char *path, struct ofile *of, char *buf, size_t size,
+	  off_t offset)
+{
+  struct head *h;
+  size_t n = 0;
+
+  pthread_mutex_lock(&head_lock);
+
+  for (h = heads; h; h = h->next)
+    if (!strcmp(h->path, path))
+      break;
+
+  if (h && h->size == of->size && h->mtime == of->mtime &&
+      h->nsec == of->nsec && offset < h->len) {
+    n = h->len - offset;
+    if (n > size)
+      n = size;
+    memcpy(buf, h->data + offset, n);
+    if (!h->used)
+      head_hits++;
+    h->used = TRUE;
+    mem_hit(MEM_HEAD);
+  }
+
+  pthread_mutex_unlock(&head_lock);
+
+  return n;
+}
+
+/*
+ * head_open:
+ *
+ * Opens a file for reading without asking ltspfsd, if we've got its head
+ * and it was fetched just now.  ltspfsd could read the file then, and told
+ * us all an open would have.  Only for the first open; after that, the
+ * head's old news.  Returns FALSE if it has to go over the wire.
+ */
+
+static int
+head_open(const char *path, struct fuse_file_info *fi)
+{
+  struct head  *h;
+  struct ofile *of;
+
+  if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC) ||
+      !(of = calloc(1, sizeof(struct ofile))))
+    return FALSE;
+
+  pthread_mutex_lock(&head_lock);
+
+  for (h = heads; h; h = h->next)
+    if (!strcmp(h->path, path))
+      break;
+
+  if (!h || h->used || h->expires <= time(NULL)) {
+    pthread_mutex_unlock(&head_lock);
+    free(of);
+    return FALSE;
+  }
+
+  of->seek   = TRUE;
+  of->ident  = TRUE;
+  of->size   = h->size;
+  of->mtime  = h->mtime;
+  of->nsec   = h->nsec;
+  of->volume = h->volume;
+  of->ino    = h->ino;
+
+  pthread_mutex_unlock(&head_lock);
+
+  fi->fh = (unsigned long)of;
+  if (fver_check(path, of->size, of->mtime, of->nsec)) {
+#if FUSE_MINOR_VERSION >= 4
+    fi->keep_cache = 1;
+#endif
+  }
+
+  return TRUE;
+}
+
+/*
+ * head_fetch:
+ *
+ * Thread that fetches a batch of heads.  There's only ever one at a time.
+ * The batch is one request, with the heads all streamed back after it, so
+ * it's bulk traffic.
+ */
+
+static void *
+head_fetch(void *arg)
+{
+  struct headreq *r = arg;
+  XDR   in, out;
+  char  inbuf[LTSP_MAXBUF];
+  char  outbuf[LTSP_MAXBUF];
+  char  name[PATH_MAX];
+  char  path[PATH_MAX];
+  char  *ptr, *data;
+  int   opcode = LTSPFS_READHEADS;
+  int   statcode = LTSP_STATUS_FAIL;
+  int   len, got = 0;
+  unsigned int gen = attr_generation(), total = 0;
+  struct ofile of;				/* what an open would say */
+
+  name[0] = '\0';
+
+  if ((data = malloc(r->size))) {
+    shape(r->size * r->count);
+
+    do {
+      init_pkt(&in, &out, inbuf, outbuf);	/* Initialize packets */
+
+      xdr_int(&out, &opcode);			/* build opcode */
+      xdr_u_int(&out, &r->size);		/* build head size */
+      xdr_int(&out, &r->count);			/* build file count */
+      ptr = r->after;
+      xdr_string(&out, &ptr, PATH_MAX);		/* build where to start */
+      build_path(&out, r->dir);			/* build dir path */
+
+      sock_lock(SCHED_BULK);			/* Wait our turn */
+      op_expect(r->size * r->count);
+      writepacket(&out, outbuf);
+      readpacket(&in, inbuf);			/* Read response */
+      if (!stale(&in))
+        break;
+      sock_unlock();				/* resend with full path */
+    } while (TRUE);
+
+    while (xdr_int(&in, &statcode) && statcode == LTSP_STATUS_CONT) {
+      ptr = name;
+      if (!xdr_string(&in, &ptr, PATH_MAX) || !xdr_int(&in, &len) ||
+          !xdr_longlong_t(&in, &of.size) || !xdr_long(&in, &of.mtime) ||
+          !xdr_long(&in, &of.nsec) || !xdr_u_longlong_t(&in, &of.ino) ||
+          !xdr_u_longlong_t(&in, &of.volume) ||
+          len < 0 || (unsigned int)len > r->size) {
+        statcode = LTSP_STATUS_FAIL;		/* lost track of the answers */
+        break;
+      }
+
+      readn(sock.fd, data, len);			/* read the head itself */
+      total += len;
+      if (snprintf(path, PATH_MAX, "%s/%s", strcmp(r->dir, "/") ? r->dir : "",
+                   name) < PATH_MAX)		/* or it's no use to anyone */
+        head_add(path, data, len, &of, gen);
+      got++;
+
+      xdr_setpos(&in, 0);			/* rewind data packet */
+      readpacket(&in, inbuf);			/* Read the next one */
+    }
+
+    if (total)
+      op_done(total);
+    sock_unlock();				/* Let the next one go */
+    free(data);
+  }
+
+  pthread_mutex_lock(&head_lock);
+  if (statcode != LTSP_STATUS_OK && !head_fetched)
+    head_usable = FALSE;			/* an older ltspfsd */
+  if (!strcmp(r->dir, head_dir)) {
+    if (got < r->count)				/* that's the lot */
+      head_stop = TRUE;
+    if (got)
+      strcpy(head_end, name);
+  }
+  head_busy = FALSE;
+  pthread_mutex_unlock(&head_lock);
+
+  free(r);
+  return NULL;
+}
+
+/*
+ * head_note:
+ *
+ * Watches for runs of reads from the start of files in one directory, and
+ * sends for the next batch of heads when it's time.  A read of more than
+ * a head from the last file means whoever's reading wants more than a
+ * look at each one, and ends the run.
+ */
+
+static void
+head_note(const char *path, size_t size, off_t offset)
+{
+  struct headreq *r = NULL;
+  struct head *h;
+  pthread_t thread;
+  char  dir[PATH_MAX];
+  const char *name = strrchr(path, '/') + 1;
+  unsigned int batch, ahead = 0;
+
+  if (name - path > 1) {
+    memcpy(dir, path, name - path - 1);
+    dir[name - path - 1] = '\0';
+  } else
+    strcpy(dir, "/");
+
+  pthread_mutex_lock(&head_lock);
+
+  if (offset || size > HEAD_MAX) {
+    if (offset + size > HEAD_MAX && !strcmp(dir, head_dir) &&
+        !strcmp(name, head_last))
+      head_run = 0;
+    pthread_mutex_unlock(&head_lock);
+    return;
+  }
+
+  if (strcmp(dir, head_dir)) {			/* a new run */
+    strcpy(head_dir, dir);
+    head_last[0] = head_end[0] = '\0';
+    head_run  = 0;
+    head_size = 0;
+    head_stop = FALSE;
+  }
+
+  if (strcmp(name, head_last)) {
+    strcpy(head_last, name);
+    head_run++;
+  }
+  if (size > head_size)
+    head_size = size;
+
+  if (head_usable && !head_busy && !head_stop && head_run >= HEAD_RUN) {
+    for (h = heads; h; h = h->next)
+      if (!h->used)
+        ahead++;
+
+    pthread_mutex_lock(&mem_lock);
+    batch = mem_limit / 2 / head_size;		/* leave the rest some room */
+    pthread_mutex_unlock(&mem_lock);
+    if (batch > HEAD_BATCH)
+      batch = HEAD_BATCH;
+
+    if (batch && ahead <= batch / 2 && (r = malloc(sizeof(struct headreq)))) {
+      strcpy(r->dir, dir);
+      strcpy(r->after, ahead && head_end[0] ? head_end : name);
+      r->size   = head_size;
+      r->count  = batch;
+      head_busy = TRUE;
+    }
+  }
+
+  pthread_mutex_unlock(&head_lock);
+
+  if (!r)
+    return;
+
+  if (pthread_create(&thread, NULL, head_fetch, r)) {
+    pthread_mutex_lock(&head_lock);
+    head_busy = FALSE;
+    pthread_mutex_unlock(&head_lock);
+    free(r);
+    return;
+  }
+
+  pthread_detach(thread);
+}
+
+/*
+ * read_size:
+ *
+ * How big the pieces of a large read should be: READ_CHUNK_TIME worth at
+ * the throughput we've measured, or more if that's what it takes for
+ * READ_WINDOW of them to keep the link busy over a round trip.  Until we
+ * know the throughput, SCHED_CHUNK.
+ */
+
+static unsigned int
+read_size(void)
+{
+  double size;
+
+  if (!xput)
+    return SCHED_CHUNK;
+
+  size = xput * READ_CHUNK_TIME / 1000.0;
+  if (size < 2 * xput * rtt_srtt / READ_WINDOW)
+    size = 2 * xput * rtt_srtt / READ_WINDOW;
+  if (size < READ_CHUNK_MIN)
+    size = READ_CHUNK_MIN;
+  if (size > READ_CHUNK_MAX)
+    size = READ_CHUNK_MAX;
+
+  return (unsigned int)size & ~(READ_CHUNK_MIN - 1);
+}
+
+/*
+ * send_read:
+ *
+ * Asks for one piece of a file.  Called with the socket.
+ */
+
+static void
+send_read(const char *path, unsigned int size, off_t offset)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_READ;
+
+  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+  xdr_int(&out, &opcode);			/* build opcode */
+  xdr_u_int(&out, &size);			/* build packet size */
+  xdr_longlong_t(&out, &offset);		/* build file offset size */
+  build_path(&out, path);			/* build path */
+
+  writepacket(&out, outbuf);
+  xdr_destroy(&in);
+}
+
+/*
+ * read_window:
+ *
+ * Reads up to size bytes of a file, split into read_size() pieces.  Up to
+ * READ_WINDOW of them are sent before the first answer comes back, so
+ * ltspfsd is reading the next one off the disk while the last one's on
+ * the wire, and as each comes in another goes out, as long as nobody else
+ * is waiting for the socket.  The answers come back in order, straight
+ * into buf.
+ *
+ * Returns the bytes read, which may be short of size if we gave up the
+ * socket, or ltspfsd flushed our node ids.  *eof is set if there's no
+ * point in asking for any more, at the end of the file or after an error.
+ */
+
+static int
+read_window(const char *path, char *buf, size_t size, off_t offset,
+	    int class, int *eof)
+{
+  XDR          in;
+  char         inbuf[LTSP_MAXBUF];
+  unsigned int chunk, len, sent, asked, got, first;
+  int          res, returned, stop = FALSE, err = 0;
+  size_t       done = 0;
+
+  *eof  = FALSE;
+  chunk = read_size();
+  if (rate_ceiling && size > (size_t)READ_WINDOW * chunk)
+    size = (size_t)READ_WINDOW * chunk;	/* no more than we've shaped */
+  shape(size);
+
+  sock_lock(class);				/* Wait our turn */
+
+  first = sock.sent + 1;				/* the READs go in a row */
+  for (sent = asked = 0; sent < READ_WINDOW && asked < size; sent++) {
+    len = size - asked > chunk ? chunk : size - asked;
+    send_read(path, len, offset + asked);
+    asked += len;
+  }
+  op_expect(asked);
+
+  for (got = 0; got < sent; got++) {
+    xdrmem_create(&in, inbuf, LTSP_MAXBUF, XDR_DECODE);
+    readanswer(&in, inbuf, first + got);	/* Read response */
+
+    if (!stop && stale(&in))			/* resend with full path */
+      stop = TRUE;
+
+    if (!xdr_int(&in, &res) || !xdr_int(&in, &returned)) {
+      sock_unlock();				/* lost track of the answers */
+      *eof = TRUE;
+      return done ? (int)done : -EACCES;
+    }
+    xdr_destroy(&in);
+
+    len = size - got * chunk > chunk ? chunk : size - got * chunk;
+
+    /*
+     * An error has no payload.  Anything after a gap is read, so the
+     * answers stay in step, but not counted.
+     */
+
+    if (res) {
+      if (!stop) {
+        err  = -returned;
+        stop = *eof = TRUE;
+      }
+      continue;
+    }
+
+    readn(sock.fd, buf + got * chunk, returned);	/* read data payload */
+    if (stop)
+      continue;
+    done += returned;
+
+    if ((unsigned int)returned < len)		/* end of file */
+      stop = *eof = TRUE;
+    else if (op_cancelled) {			/* no use asking for more */
+      err  = -EINTR;
+      stop = *eof = TRUE;
+    } else if (asked < size && !sock_wanted()) {
+      len = size - asked > chunk ? chunk : size - asked;
+      send_read(path, len, offset + asked);
+      asked += len;
+      sent++;
+      op_expect(asked);
+    }
+  }
+
+  if (done)
+    op_done(done);
+  sock_unlock();				/* Let the next one go */
+
+  return done || !err ? (int)done : err;
+}
+
+/*
+ * ltspfs_read:
+ *
+ * Handles the read filesystem call.  The first piece is what whoever's
+ * reading is waiting on, so it goes ahead of bulk traffic.  Anything past
+ * that is most likely readahead, and waits behind interactive requests.
+ * Large reads skip over holes in sparse files, and the start of a file
+ * may already be here, prefetched.
+ */
+
+static int
+ltspfs_read(const char *path, char *buf, size_t size, off_t offset,
+	    struct fuse_file_info *fi)
+{
+  struct ofile *of = (struct ofile *)(unsigned long)fi->fh;
+  size_t done = 0;
+  int    class = SCHED_READ;
+  int    chunk, r, eof;
+  off_t  hole;
+
+  if (shm && of && of->ident && (r = shm_read(path, of, buf, size, offset)) >= 0)
+    return r;
+
+  if (of && of->ident) {
+    done = head_read(path, of, buf, size, offset);
+    head_note(path, size, offset);
+    if (done == size || (done && offset + (off_t)done >= of->size))
+      return done;
+  }
+
+  while (done < size) {
+    chunk = size - done;
+    if (size > SCHED_CHUNK && of && of->seek &&
+        (hole = hole_at(path, of, offset + done, &chunk))) {
+      if (hole > (off_t)(size - done))
+        hole = size - done;
+      memset(buf + done, 0, hole);		/* no need to fetch zeros */
+      done += hole;
+      continue;
+    }
+    r = read_window(path, buf + done, chunk, offset + done, class, &eof);
+    if (r < 0)
+      return done ? (int)done : r;
+    done += r;
+    if (eof)
+      break;
+    class = SCHED_BULK;
+  }
+
+  if (shm && of && of->ident)
+    shm_fill(of, buf, done, offset);
+
+  return done;
+}
+
+/*
+ * write_chunk:
+ *
+ * Writes one chunk of a file.
+ */
+
+static int
+write_chunk(const char *path, const char *buf, unsigned int size,
+	    off_t offset)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_WRITE;
+  int  res, returned;
+
+  shape(size);
+
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_u_int(&out, &size);			/* build packet size */
+    xdr_longlong_t(&out, &offset);		/* build file offset */
+    build_path(&out, path);			/* build path */
+
+    sock_lock(SCHED_BULK);			/* Wait our turn */
+    op_expect(size);
+    writepacket(&out, outbuf);
+    writen(sock.fd, (char *)buf, size);		/* Send data buffer */
+    readpacket(&in, inbuf);			/* Read response */
+    op_done(size);
+    sock_unlock();				/* Let the next one go */
+  } while (stale(&in));
+
+  /*
+   * Parse the return.
+   */
+
+  if (!xdr_int(&in, &res))
+    return -EACCES;
+  if (!xdr_int(&in, &returned))
+    return -EACCES;
+
+  xdr_destroy(&in);
+
+  if (res)					/* Error, return error code */
+    return -returned;
+
+  return returned;				/* Return bytes written */
 }
 
-#if FUSE_MINOR_VERSION >= 3
 /*
- * ping_timeout:
+ * write_window:
  *
- * This function will handle sendig a "PING" packet to the server once every
- * x minutes.   If it doesn't get a response back, then it will exit the
- * timeout function will unmount the ltspfs filesystem and exit. 
+ * How much a file can have written that ltspfsd hasn't acknowledged yet:
+ * twice what the link holds over a round trip, as far as we've measured
+ * it.
  */
 
-void
-ping_timeout(void *nothing __attribute__((unused)))
+static unsigned int
+write_window(void)
 {
-  XDR    in, out;
-  int    i;
-  char   pingin[LTSP_MAXBUF];
-  char   pingout[LTSP_MAXBUF];
-  struct timespec ping_interval;
-
-  init_pkt(&in, &out, pingin, pingout);		/* Initialize packets */
+  double window = 2 * xput * rtt_srtt;
 
-  i = LTSPFS_PING;
-  xdr_int(&out, &i);
-  i = xdr_getpos(&out);
-  xdr_setpos(&out, 0);
-  xdr_int(&out, &i);
-
-  ping_interval.tv_sec  = PING_INTERVAL;
-  ping_interval.tv_nsec = 0;
+  if (window < WRITE_WINDOW_MIN)
+    window = WRITE_WINDOW_MIN;
+  if (window > WRITE_WINDOW_MAX)
+    window = WRITE_WINDOW_MAX;
 
-  while (TRUE)
-  {
-    nanosleep(&ping_interval, NULL);
-    pthread_mutex_lock(&lock);			/* Lock mutex */
-    writen(sockfd, pingout, i);			/* Send command */
-    readpacket(&in, pingin);			/* Read response */
-    xdr_setpos(&in, 0);
-    pthread_mutex_unlock(&lock);		/* Unlock mutex */
-  }
+  return window;
 }
-#endif
 
 /*
- * parse_return:
- * Simplifies several functions by handling simple "000" or 001|errno returns.
+ * write_stream:
+ *
+ * Sends one chunk of a sequential write without waiting for the answer.
+ * If the file's got a window's worth owed already, the oldest answers are
+ * collected first.  Once one's failed, there's no knowing which of the
+ * rest will, so it waits for the answer with write_chunk().  Returns
+ * size, or what write_chunk() does.
  */
 
 static int
-parse_return(XDR *xdr)
+write_stream(const char *path, const char *buf, unsigned int size,
+	     off_t offset, struct ofile *of)
 {
-  int res, retcode;
-
-  /*
-   * rewind to the beginning.
-   */
+  struct pending *p;
+  unsigned int window;
+
+  if (!(p = calloc(1, sizeof(struct pending))) ||
+      !(p->path = strdup(path)) || !(p->data = malloc(size))) {
+    if (p)
+      free(p->path);
+    free(p);
+    return write_chunk(path, buf, size, offset);	/* just wait, then */
+  }
 
-  xdr_setpos(xdr, 0);			/* rewind to the beginning of packet */
-  xdr_int(xdr, &res);			/* read over the length */
+  memcpy(p->data, buf, size);
+  p->opcode = LTSPFS_WRITE;
+  p->size   = size;
+  p->offset = offset;
+  p->of     = of;
+
+  shape(size);
+  sock_lock(SCHED_BULK);			/* Wait our turn */
+
+  window = write_window();
+  while (pending_head &&
+         (of->wowed + size > window || pending_count >= PENDING_MAX))
+    collect_one();
+  resend_stale();				/* ahead of what follows them */
+
+  if (of->werr) {
+    sock_unlock();
+    free(p->path);
+    free(p->data);
+    free(p);
+    return write_chunk(path, buf, size, offset);
+  }
 
-  if (!xdr_int(xdr, &res))		/* try to grab the return code */
-    retcode = EACCES;			/* Couldnt grab, so goto out */
-  else if (!res)			/* If OK, goto out */
-    retcode =  OK;
-  else if (!xdr_int(xdr, &retcode)) 	/* If fail, then grab the code */
-    retcode = EACCES;
+  send_pending(p);
+  sock_unlock();				/* Let the next one go */
 
-  xdr_destroy(xdr);			/* Last bit, so destroy the stream */
-  return -retcode;
+  return size;
 }
 
 /*
- * ltspfs_sendauth:
+ * forget_data:
  *
- * Grabs our $DISPLAY, and sends our XAUTH info for verification on the other
- * side.
+ * The file's been changed through this handle, so what we know about its
+ * holes may not be true any more.
  */
 
-int
-ltspfs_sendauth()
+static void
+forget_data(struct fuse_file_info *fi)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  char xauth_command[LTSP_MAXBUF];		/* xauth command */
-  char *display;				/* DISPLAY environment var */
-  int  size;
-  char *auth_file;				/* buffer to hold file */
-  FILE *pcmd;
-  int  opcode = LTSPFS_XAUTH;
+  struct ofile *of = (struct ofile *)(unsigned long)fi->fh;
 
-  /*
-   * Get the xauth token for our display.
-   */
-
-  display = getenv("DISPLAY");
-  if (!display) {
-    fprintf(stderr, "Error: $DISPLAY variable not set!\n");
-    exit(1);
-  }
+  if (!of)
+    return;
 
-  /*
-   * If our DISPLAY variable starts with "localhost", we're probably trying
-   * to be run under Ubuntu, which tunnels the X connection over ssh.  At
-   * this point, dapper hasn't been officially released yet, so we'll
-   * send a "dummy" packet if this is the case.  This will require the
-   * -a option on the server.  We'll figure this out later.
-   */
+  pthread_mutex_lock(&ofile_lock);
+  of->from = of->to = 0;
+  pthread_mutex_unlock(&ofile_lock);
+}
 
-  if (!strncmp(display, "localhost", 9)) {
-    auth_file = strdup("DUMMY AUTH");
-    size = strlen(auth_file);
-  } else {
-    sprintf(xauth_command, "xauth extract - %s", display);
-  
-    /*
-     * Allocate a buffer.
-     */
+/*
+ * ltspfs_write:
+ *
+ * Handles the write filesystem call.  Writes are bulk traffic, and go in
+ * chunks, so they don't hold up anyone else for long.  A write that picks
+ * up where the last one on the handle left off is streamed, so copying a
+ * file onto the terminal doesn't wait a round trip for every chunk.
+ */
 
-    if ((auth_file = malloc(BUFSIZ)) == NULL) {
-      fprintf(stderr, "Cannot malloc %d bytes\n", BUFSIZ);
-      exit(1);
-    }
+static int
+ltspfs_write(const char *path, const char *buf, size_t size,
+	     off_t offset, struct fuse_file_info *fi)
+{
+  struct ofile *of = (struct ofile *)(unsigned long)fi->fh;
+  size_t done = 0;
+  int    chunk, r = 0, stream = FALSE;
 
-    pcmd = popen(xauth_command, "r");
+  forget_data(fi);				/* may be filling a hole */
 
-    if (!pcmd) {
-      free(auth_file);
-      fprintf(stderr, "Error: could not execute \"%s\"\n", xauth_command);
-      exit(1);
-    }
+  if (of) {
+    pthread_mutex_lock(&ofile_lock);
+    stream = offset == of->wnext;
+    pthread_mutex_unlock(&ofile_lock);
+  }
 
-    size = fread(auth_file, sizeof(char), BUFSIZ, pcmd);
+  while (done < size) {
+    chunk = size - done > SCHED_CHUNK ? SCHED_CHUNK : size - done;
+    if (stream)
+      r = write_stream(path, buf + done, chunk, offset + done, of);
+    else
+      r = write_chunk(path, buf + done, chunk, offset + done);
+    if (r < 0)
+      break;
+    done += r;
+    if (r < chunk)				/* short write, disk full? */
+      break;
+  }
 
-    pclose(pcmd);
+  if (of) {
+    pthread_mutex_lock(&ofile_lock);
+    of->wnext = offset + done;
+    pthread_mutex_unlock(&ofile_lock);
   }
 
-  /*
-   * Now, send the authorization.
-   */
+  attr_forget(path, 0);				/* size and mtime moved */
+  return done ? (int)done : r;
+}
 
-  init_pkt(&in, &out, inbuf, outbuf);
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_int(&out, &size);				/* build auth packet size */
+/*
+ * fs_slot:
+ *
+ * Returns where in fs_cache a path's statfs answer goes, or -1 if it's
+ * not the root of the mount, or of a share, and doesn't get cached.
+ */
 
-  writepacket(&out, outbuf);			/* Send command */
-  writen(sockfd, auth_file, size);		/* Send authfile */
-  readpacket(&in, inbuf);			/* Read response */
-  free(auth_file);
-  return parse_return(&in);
+static int
+fs_slot(const char *path)
+{
+  if (!multi)
+    return strcmp(path, "/") ? -1 : 0;
+
+  return at_root(path) ? share_find(path, NULL, NULL) : -1;
 }
 
 /*
- * ltspfs_getattr:
+ * statfs_remote:
  *
- * Handles the getattr filesystem call.  
+ * Asks ltspfsd about the filesystem a path is on.
  */
 
 static int
-ltspfs_getattr(const char *path, struct stat *stbuf)
+statfs_remote(const char *path, struct fsattr *fs)
 {
-  XDR   out, in;
-  char  outbuf[LTSP_MAXBUF];
-  char  inbuf[LTSP_MAXBUF];
-  char  *ptr = (char *)path;
-  int   opcode = LTSPFS_GETATTR;
-  int   res;
-  uid_t uid;
-  gid_t gid;
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  int  opcode = LTSPFS_STATFS;
+  int  ret;
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
-  
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+    xdr_int(&out, &opcode);			/* build opcode */
+    build_path(&out, path);			/* build path */
 
-  if (!xdr_int(&in, &res))		 	/* Did we get error? */
-    return -EACCES;				/* bad arg */
-  if (res)
-    return parse_return(&in);			/* bad result */
+    send_recv_shared(&in, &out, inbuf, outbuf);	/* or share an answer */
+  } while (stale(&in));
 
   /*
-   * Parse the return and populate the structure
+   * Parse the return
    */
 
-  if (!fc)					/* Initialized fc? */
-    fc = fuse_get_context();			/* Grab the context */
-
-  if (!xdr_u_longlong_t(&in, &stbuf->st_dev))
-    return -EACCES;
-  if (!xdr_u_longlong_t(&in, &stbuf->st_ino))
-    return -EACCES;
-  if (!xdr_u_int  (&in, &stbuf->st_mode))
-    return -EACCES;
-  if (!xdr_u_int  (&in, &stbuf->st_nlink))
-    return -EACCES;
-  if (!xdr_u_int  (&in, &uid))
-    return -EACCES;
-  if (!xdr_u_int  (&in, &gid))
+  if (!xdr_int(&in, &ret))
     return -EACCES;
 
-  /* 
-   * We get back the uid and gid from the remote filesystem, but we don't
-   * use it.  Basically, we use the fuse context, which tells us who
-   * mounted the filesystem.  This way, the user always "owns" the files
-   * on the remote media.  This should probably by an overridable option,
-   * just on the off chance that someone DOES have a "real" filesystem
-   * (i.e. one that knows about userids) on the remote side.
-   */
-
-  stbuf->st_uid = fc->uid;
-  stbuf->st_gid = fc->gid;
+  if (ret)
+    return parse_return(&in);
 
-  if (!xdr_u_longlong_t(&in, &stbuf->st_rdev))
-    return -EACCES;
-  if (!xdr_longlong_t(&in, &stbuf->st_size))
-    return -EACCES;
-  if (!xdr_long (&in, &stbuf->st_blksize))
-    return -EACCES;
-  if (!xdr_longlong_t(&in, &stbuf->st_blocks))
-    return -EACCES;
-  if (!xdr_long (&in, &stbuf->st_atime))
-    return -EACCES;
-  if (!xdr_long (&in, &stbuf->st_mtime))
-    return -EACCES;
-  if (!xdr_long (&in, &stbuf->st_ctime))
-    return -EACCES;
-  xdr_destroy(&in);
+  xdr_int(&in, &fs->type);                      /* type of fs */
+  xdr_int(&in, &fs->bsize);                     /* optimal transfer block sz */
+  xdr_u_longlong_t(&in, &fs->blocks);           /* total data blocks in fs */
+  xdr_u_longlong_t(&in, &fs->bfree);            /* free blks in fs */
+  xdr_u_longlong_t(&in, &fs->bavail);           /* free blks avail to non-su */
+  xdr_u_longlong_t(&in, &fs->files);            /* total file nodes in fs */
+  xdr_u_longlong_t(&in, &fs->ffree);            /* free file nodes in fs */
+  xdr_int(&in, &fs->namelen);            
 
   return OK;
 }
 
 /*
- * ltspfs_readlink:
+ * statfs_cached:
  *
- * Handles the readlink filesystem call.  
+ * Gets the statfs answer for a path from the cache if we can, or from
+ * ltspfsd if we can't.
  */
 
 static int
-ltspfs_readlink(const char *path, char *buf, size_t size)
+statfs_cached(const char *path, struct fsattr *fs)
 {
-  XDR  out, in;
-  char outbuf[LTSP_MAXBUF];
-  char inbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_READLINK;
-  int  ret, retcode;
-  char *ptr = (char *)path;
-
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
-
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
-
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+  unsigned int gen;
+  int slot = fs_slot(path);
+  int res;
+
+  if (slot < 0)
+    return statfs_remote(path, fs);
+
+  pthread_mutex_lock(&attr_lock);
+  if (fs_cache[slot].expires > time(NULL)) {
+    *fs = fs_cache[slot];
+    pthread_mutex_unlock(&attr_lock);
+    return OK;
+  }
+  gen = attr_gen;
+  pthread_mutex_unlock(&attr_lock);
 
-  /*
-   * Parse the return and populate returning link name buffer.
-   */
+  if ((res = statfs_remote(path, fs)))
+    return res;
 
-  if (!xdr_int(&in, &ret))
-    return -EACCES;
-  if (ret) {
-    if (!xdr_int(&in, &retcode)) {
-      retcode = EACCES;
-    } 
-    xdr_destroy(&in);
-    return -retcode;
+  pthread_mutex_lock(&attr_lock);
+  if (gen == attr_gen) {
+    fs_cache[slot] = *fs;
+    fs_cache[slot].expires = time(NULL) + STATFS_TTL;
   }
-  
-  ptr = buf;
-
-  if (!xdr_string(&in, &ptr, PATH_MAX))		/* return link target */
-    return -EACCES;
-	
-  xdr_destroy(&in);
+  pthread_mutex_unlock(&attr_lock);
 
   return OK;
 }
 
-#if FUSE_MINOR_VERSION < 3
 /*
- * ltspfs_getdir:
+ * ltspfs_statfs:
  *
- * Handles the readdir filesystem call.  
- * The logic's a little complicated on this one.  You've got a few different
- * scenarios here:
- * 1) filler returns nonzero, server's still sending direntries.  You want
- *    to stop calling the filler command, but keep reading from the server
- *    so you don't have "leftovers" next function call.
- * 2) filler's ok, but the server on the remote end sends us a "001" error.
- * 3) (hopefully 99.99% of the time) everything's a-ok.
+ * Handles the statfs filesystem call.  
  */
 
+#if FUSE_USE_VERSION >= 25
 static int
-ltspfs_getdir(const char *path, fuse_dirh_t h, fuse_dirfil_t filler)
+ltspfs_statfs(const char *path, struct statvfs *stbuf)
+#else
+static int
+ltspfs_statfs(const char *path, struct statfs *stbuf)
+#endif
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_READDIR;
-  int  r = 0;
-  int  statcode;
-  char *ptr = (char *)path;
+  struct fsattr fs;
+  int  res;
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  memset(stbuf, 0, sizeof(*stbuf));
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  if (multi && !strcmp(path, "/")) {		/* not on any one device */
+    stbuf->f_bsize   = BUFSIZ;
+#if FUSE_USE_VERSION >= 25
+    stbuf->f_namemax = NAME_MAX;
+#else
+    stbuf->f_namelen = NAME_MAX;
+#endif
+    return OK;
+  }
 
-  pthread_mutex_lock(&lock);			/* Lock mutex */
-  writepacket(&out, outbuf);
-  readpacket(&in, inbuf);			/* Read response */
+  if ((res = statfs_cached(path, &fs)))
+    return res;
+
+  stbuf->f_bsize  = fs.bsize;
+  stbuf->f_blocks = fs.blocks;
+  stbuf->f_bfree  = fs.bfree;
+  stbuf->f_bavail = fs.bavail;
+  stbuf->f_files  = fs.files;
+  stbuf->f_ffree  = fs.ffree;
+#if FUSE_USE_VERSION >= 25
+  stbuf->f_frsize  = fs.bsize;			/* statvfs has no f_type */
+  stbuf->f_namemax = fs.namelen;
+#else
+  stbuf->f_type    = fs.type;
+  stbuf->f_namelen = fs.namelen;
+#endif
 
-  xdr_int(&in, &statcode);
-  while (statcode == LTSP_STATUS_CONT) {	/* Continue? */
-    if (!r) {
-      ino_t inode;
-      unsigned char type;
-      char dirpath[PATH_MAX];
+  return OK;
+}
 
-      ptr = dirpath;
-      xdr_u_longlong_t(&in, &inode);
-      xdr_u_char(&in, &type);
-      xdr_string(&in, &ptr, PATH_MAX); 
-      r = filler(h, dirpath, type, inode);
-    }
+/*
+ * ltspfs_release:
+ *
+ * Handles the release filesystem call.  
+ * Since filesystem is stateless, there's nothing to tell ltspfsd, but any
+ * writes still owed an answer have to be collected before the handle goes.
+ * By now, nobody's listening for how they went, so an error's logged.
+ */
 
-    xdr_setpos(&in, 0);				/* rewind data packet */
-    readpacket(&in, inbuf);			/* Read the next line */
-    xdr_int(&in, &statcode);			/* And grab the statcode */
+static int
+ltspfs_release (const char *path, struct fuse_file_info *fi)
+{
+  struct ofile *of = (struct ofile *)(unsigned long)fi->fh;
+  int err = 0;
+
+  if (of && (of->wowed || of->werr)) {
+    sock_lock(SCHED_META);			/* Wait our turn */
+    collect_all();
+    err = of->werr;
+    sock_unlock();				/* Let the next one go */
   }
 
-  pthread_mutex_unlock(&lock);			/* Unlock mutex */
+  if (err)
+    syslog(LOG_WARNING, "writing %s: %s", path, strerror(err));
 
-  if (r)					/* if filler died */
-    return r;					/* return it first */
-  else
-    return parse_return(&in);			/* Return result */
+  free(of);
+  return -err;
 }
-#else
+
 /*
- * ltspfs_readdir:
+ * ltspfs_flush:
  *
- * Handles the readdir filesystem call.  
- * The logic's a little complicated on this one.  You've got a few different
- * scenarios here:
- * 1) filler returns nonzero, server's still sending direntries.  You want
- *    to stop calling the filler command, but keep reading from the server
- *    so you don't have "leftovers" next function call.
- * 2) filler's ok, but the server on the remote end sends us a "001" error.
- * 3) (hopefully 99.99% of the time) everything's a-ok.
+ * Handles the flush filesystem call, which happens on every close().
+ * Reports any error from queued updates for the file, or streamed writes
+ * through this handle.
+ */
+
+static int
+ltspfs_flush (const char *path, struct fuse_file_info *fi)
+{
+  return sync_meta(path, (struct ofile *)(unsigned long)fi->fh);
+}
+
+#if FUSE_USE_VERSION >= 26 && FUSE_MINOR_VERSION >= 9
+/*
+ * ltspfs_fallocate:
+ *
+ * Handles the fallocate filesystem call, for preallocating space, or
+ * punching holes.
  */
 
 static int
-ltspfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-	       off_t offset, struct fuse_file_info *fi)
+ltspfs_fallocate (const char *path, int mode, off_t offset, off_t length,
+  struct fuse_file_info *fi)
 {
   XDR  in, out;
   char inbuf[LTSP_MAXBUF];
   char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_READDIR;
-  int  r = 0;
-  int  statcode;
-  char *ptr = (char *)path;
+  int  opcode = LTSPFS_FALLOCATE;
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  forget_data(fi);				/* may punch a hole */
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  do {
+    init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
 
-  pthread_mutex_lock(&lock);			/* Lock mutex */
-  writepacket(&out, outbuf);
-  readpacket(&in, inbuf);			/* Read response */
+    xdr_int(&out, &opcode);			/* build opcode */
+    xdr_int(&out, &mode);			/* build mode */
+    xdr_longlong_t(&out, &offset);		/* build offset */
+    xdr_longlong_t(&out, &length);		/* build length */
+    build_path(&out, path);			/* build path */
 
-  xdr_int(&in, &statcode);
-  while (statcode == LTSP_STATUS_CONT) {	/* Continue? */
-    if (!r) {					/* filler ok? */
-      struct stat st;
-      unsigned char type;
-      char dirpath[PATH_MAX];
+    send_recv(&in, &out, inbuf, outbuf);	/* send output, recv response */
+  } while (stale(&in));
 
-      ptr = dirpath;
-      memset(&st, 0, sizeof (st));
-      xdr_u_longlong_t(&in, &st.st_ino);	/* grab returned inode */
-      xdr_u_char(&in, &type);			/* grab returned type */
-      xdr_string(&in, &ptr, PATH_MAX); 		/* grab dirent name */
-      
-      st.st_mode = type << 12;			/* More magic */
-      r = filler(buf, dirpath, &st, 0);		/* Call the filler function */
-    }						/* endif !r */
-    xdr_setpos(&in, 0);				/* reset our input buffer */
-    readpacket(&in, inbuf);			/* Read the next line */
-    xdr_int(&in, &statcode);			/* And grab the statcode */
-  }
+  attr_forget(path, 0);
+  return parse_return(&in);
+}
+#endif
 
-  pthread_mutex_unlock(&lock);			/* Unlock mutex */
+#if FUSE_USE_VERSION >= 26 && FUSE_MINOR_VERSION >= 9
+/*
+ * side_get, side_put:
+ *
+ * How packets get read and written on a connection of a job's own.  How
+ * long the job takes is nobody else's business, so they wait as long as
+ * it does; keepalive drops the connection if the terminal goes away.  If
+ * fuse gives up on the job, ltspfsd is told to stop.
+ */
 
-  if (r)					/* if filler died */
-    return r;					/* return it first */
-  else
-    return parse_return(&in);			/* Return result */
+static int
+side_get(struct pkt_conn *c, char *buf, int len)
+{
+  XDR  out;
+  char outbuf[LTSP_MAXBUF];
+  int  n, got = 0;
+
+  while (got < len) {
+    if ((n = read(c->fd, buf + got, len - got)) > 0)
+      got += n;
+    else if (n < 0 && errno == EINTR) {
+      if (fuse_interrupted()) {
+        pkt_start(&out, outbuf, LTSPFS_CANCEL);
+        xdr_u_int(&out, &c->sent);		/* the job's the last one */
+        pkt_send(c, &out, outbuf);
+      }
+    } else
+      break;
+  }
+
+  return got;
 }
-#endif
 
+static int
+side_put(struct pkt_conn *c, const char *buf, int len)
+{
+  int n, put = 0;
+
+  while (put < len)
+    if ((n = write(c->fd, buf + put, len - put)) > 0)
+      put += n;
+    else if (n < 0 && errno != EINTR)
+      break;
+
+  return put;
+}
 
 /*
- * ltspfs_mknod:
+ * side_open:
  *
- * Handles the mknod filesystem call.  
+ * Opens a connection of its own to ltspfsd, for a job that would hold up
+ * everything else for too long on ours, and mounts the export path is in
+ * on it.  ltspfsd runs a process per connection, so the job and everything
+ * else go on side by side.  Node ids are only good on the connection that
+ * got them, so *name is what to send, with node 0, for path.  Returns 0,
+ * or -errno.
  */
 
 static int
-ltspfs_mknod(const char *path, mode_t mode, dev_t rdev)
+side_open(struct pkt_conn *c, const char *path, const char **name)
 {
-  XDR  in, out;
+  XDR  in;
   char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_MKNOD;
-  char *ptr = (char *)path;
+  char export[PATH_MAX];
+  char ticket[PATH_MAX];
+  char *display = getenv("DISPLAY");
+  const char *share = path + 1;
+  int  err;
+
+  if (!multi) {
+    snprintf(export, PATH_MAX, "%s", mount_dir);
+    *name = path;
+  } else {
+    if (!(*name = strchr(share, '/')))
+      *name = share + strlen(share);
+    snprintf(export, PATH_MAX, "%s/%.*s", export_base, (int)(*name - share),
+             share);
+    if (!**name)
+      *name = "/";
+  }
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  c->get = side_get;
+  c->put = side_put;
+  if (pkt_connect(c, mount_host, PORT))
+    return -errno;
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_u_int(&out, &mode);			/* build mode */
-  xdr_u_longlong_t(&out, &rdev);		/* build rdev */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  if ((!display || ticket_path(mount_host, display, ticket, sizeof(ticket)) ||
+       !ticket_resume(c, ticket)) &&
+      (pkt_authorize(c, &in, inbuf) || pkt_status(&in)))
+    goto fail;
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+  if (pkt_mount(c, export))
+    goto fail;
 
-  return parse_return(&in);
+  return 0;
+
+ fail:
+  err = errno;
+  close(c->fd);
+  return -err;
 }
 
 /*
- * ltspfs_mkdir:
+ * remove_more:
  *
- * Handles the mkdir filesystem call.  
+ * Looks at the next answer to a REMOVE_TREE.  If it's just to say how far
+ * ltspfsd's got, notes that, and returns TRUE.  Otherwise it's left for
+ * remove_done().
  */
 
 static int
-ltspfs_mkdir(const char *path, mode_t mode)
+remove_more(XDR *in, unsigned int *removed)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_MKDIR;
-  char *ptr = (char *)path;
+  int pos = xdr_getpos(in);
+  int statcode;
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  if (xdr_int(in, &statcode) && statcode == LTSP_STATUS_CONT) {
+    xdr_u_int(in, removed);			/* how far it's got */
+    return TRUE;
+  }
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_u_int(&out, &mode);			/* build mode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  xdr_setpos(in, pos);
+  return FALSE;
+}
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+/*
+ * remove_done:
+ *
+ * Reads the last answer to a REMOVE_TREE.  Returns 0 or an errno.
+ */
 
-  return parse_return(&in);
+static int
+remove_done(XDR *in, const char *path, unsigned int *removed)
+{
+  char failed[PATH_MAX];
+  char *ptr = failed;
+  int  statcode, res = 0;
+
+  if (!xdr_int(in, &statcode))
+    res = EIO;
+  else if (statcode == LTSP_STATUS_OK)
+    xdr_u_int(in, removed);
+  else if (!xdr_int(in, &res))
+    res = EACCES;
+  else if (xdr_u_int(in, removed) && xdr_string(in, &ptr, PATH_MAX) &&
+           res != EINTR)			/* we stopped it */
+    syslog(LOG_WARNING, "removing %s: %s: %s", path, failed, strerror(res));
+
+  return res;
 }
 
 /*
- * ltspfs_onepath:
+ * remove_tree:
  *
- * Handles single path filesystem calls.  
+ * Has ltspfsd remove a file, or a directory and everything in it, on the
+ * terminal, rather than us going through it an entry at a time.  That can
+ * take a while, so it's done on a connection of its own, and everything
+ * else carries on meanwhile.  If ltspfsd won't take another connection
+ * (with -d, it only serves the one), it's done on ours, as bulk traffic.
+ * ltspfsd says how far it's got every so often.  Returns 0 or -errno, and
+ * how many entries went in *removed.
  */
 
 static int
-ltspfs_onepath(int opcode, const char *path)
+remove_tree(const char *path, unsigned int *removed)
 {
+  struct pkt_conn c;
   XDR  in, out;
   char inbuf[LTSP_MAXBUF];
   char outbuf[LTSP_MAXBUF];
-  char *ptr = (char *)path;
+  const char *name;
+  int  opcode = LTSPFS_REMOVE_TREE;
+  int  res, ok;
+
+  *removed = 0;
+  node_forget(path);
+
+  if (!side_open(&c, path, &name)) {
+    pkt_start(&out, outbuf, LTSPFS_REMOVE_TREE);
+    pkt_path(&out, 0, name);
+
+    xdrmem_create(&in, inbuf, LTSP_MAXBUF, XDR_DECODE);
+    if ((ok = pkt_send(&c, &out, outbuf) >= 0))
+      while ((ok = pkt_recv(&c, &in, inbuf) >= 0) &&
+             remove_more(&in, removed))
+        ;
+    res = ok ? remove_done(&in, path, removed) : EIO;
+    close(c.fd);
+  } else {
+    do {
+      init_pkt(&in, &out, inbuf, outbuf);	/* Initialize packets */
+
+      xdr_int(&out, &opcode);			/* build opcode */
+      build_path(&out, path);			/* build path */
+
+      sock_lock(SCHED_BULK);			/* Wait our turn */
+      writepacket(&out, outbuf);
+      readpacket(&in, inbuf);			/* Read response */
+      if (!stale(&in))
+        break;
+      sock_unlock();				/* resend with full path */
+    } while (TRUE);
+
+    while (remove_more(&in, removed)) {
+      op_start();				/* it's still going */
+      xdr_setpos(&in, 0);			/* rewind data packet */
+      readpacket(&in, inbuf);			/* Read the next one */
+    }
+    res = remove_done(&in, path, removed);
+    sock_unlock();				/* Let the next one go */
+  }
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  xdr_destroy(&in);
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  attr_forget(path, FORGET_PARENT | FORGET_TREE);
+  return -res;
+}
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+/*
+ * ltspfs_ioctl:
+ *
+ * Handles the ioctl filesystem call, which is how the tools ask for things
+ * there's no system call for.  LTSPFS_IOC_RMTREE removes what it's called
+ * on, and everything in it, and hands back how many entries that was.
+ */
 
-  return parse_return(&in);
+static int
+ltspfs_ioctl(const char *path, int cmd, void *arg __attribute__((unused)),
+	     struct fuse_file_info *fi __attribute__((unused)),
+	     unsigned int flags __attribute__((unused)), void *data)
+{
+  if ((unsigned int)cmd != LTSPFS_IOC_RMTREE)
+    return -ENOTTY;
+
+  if (!strcmp(path, "/") || at_root(path))	/* not the whole mount */
+    return -EPERM;
+
+  return remove_tree(path, data);
 }
+#endif
 
 /*
- * ltspfs_unlink:
+ * ltspfs_fsync:
  *
- * Handles the unlink filesystem call.  
+ * Handles the fsync filesystem call.  
+ * Since filesystem is stateless, all we have to do is collect the results
+ * of any queued metadata updates and streamed writes.
  */
 
 static int
-ltspfs_unlink(const char *path)
+ltspfs_fsync (const char *path,
+  int isdatasync __attribute__((unused)),
+  struct fuse_file_info *fi)
 {
-  return ltspfs_onepath(LTSPFS_UNLINK, path);
+  return sync_meta(path, (struct ofile *)(unsigned long)fi->fh);
 }
 
+#if FUSE_MINOR_VERSION >= 3
 /*
- * ltspfs_rmdir:
+ * Names collected for pre-warming.
+ */
+
+struct warmlist {
+  char *name[PREWARM_MAX];
+  int  count;
+};
+
+/*
+ * prewarm_fill:
  *
- * Handles the rmdir filesystem call.  
+ * Directory filler for pre-warming.  Just collects the names, up to
+ * PREWARM_MAX of them, but takes the rest too, so the whole listing gets
+ * cached.
  */
 
 static int
-ltspfs_rmdir(const char *path)
+prewarm_fill(void *buf, const char *name,
+	     const struct stat *st __attribute__((unused)),
+	     off_t off __attribute__((unused)))
 {
-  return ltspfs_onepath(LTSPFS_RMDIR, path);
+  struct warmlist *w = buf;
+
+  if (w->count < PREWARM_MAX && strcmp(name, ".") && strcmp(name, "..") &&
+      (w->name[w->count] = strdup(name)))
+    w->count++;
+
+  return 0;
 }
 
 /*
- * ltspfs_twopath:
+ * prewarm_dir:
  *
- * Handles generic path filesystem calls.  
+ * Pre-warming thread.  Fetches statfs for a freshly mounted directory,
+ * then its attributes, its listing, and the attributes of everything in
+ * it, into the cache.  File managers want all of that before they'll draw
+ * a window.  The listing's only kept for a directory that's open, so it's
+ * read the way fuse would, between an opendir and a releasedir.
  */
 
-static int
-ltspfs_twopath(int opcode, const char *from, const char *to)
+static void *
+prewarm_dir(void *arg)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  char *ptr;
+  char   *dir = arg;
+  char   path[PATH_MAX];
+  struct warmlist w;
+  struct fsattr fs;
+  struct stat st;
+  struct fuse_file_info fi;
+  int    i;
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  statfs_cached(dir, &fs);
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  ptr = (char *)from;
-  xdr_string(&out, &ptr, PATH_MAX);		/* build from */
-  ptr = (char *)to;
-  xdr_string(&out, &ptr, PATH_MAX);		/* build to */
+  memset(&fi, 0, sizeof(fi));
+  if (!getattr_cached(dir, &st) && !ltspfs_opendir(dir, &fi) && fi.fh) {
+    w.count = 0;
+    ltspfs_readdir(dir, &w, prewarm_fill, 0, &fi);
+    ltspfs_releasedir(dir, &fi);
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+    for (i = 0; i < w.count; i++) {
+      snprintf(path, PATH_MAX, "%s/%s", strcmp(dir, "/") ? dir : "",
+               w.name[i]);
+      getattr_cached(path, &st);
+      free(w.name[i]);
+    }
+  }
 
-  return parse_return(&in);
+  free(dir);
+  return NULL;
 }
 
 /*
- * ltspfs_symlink:
+ * prewarm_start:
  *
- * Handles the symlink filesystem call.  
+ * Kicks off pre-warming for a directory in the background.
  */
 
-static int
-ltspfs_symlink(const char *from, const char *to)
+static void
+prewarm_start(const char *path)
 {
-  return ltspfs_twopath(LTSPFS_SYMLINK, from, to);
+  pthread_t thread;
+  char *dir;
+
+  if (!(dir = strdup(path)))
+    return;
+
+  if (pthread_create(&thread, NULL, prewarm_dir, dir)) {
+    free(dir);
+    return;
+  }
+
+  pthread_detach(thread);
 }
 
 /*
- * ltspfs_rename:
+ * ltspfs_init:
  *
- * Handles the rename filesystem call.  
+ * Called after the mainline's forked and daemonized.  Create a pinger 
+ * thread that will sit in the background and ping the server every
+ * PING_INTERVAL seconds.  In the event that the LTSP terminal is shut off
+ * without a proper fusermount -u being executed, this will unmount
+ * the filesystem automatically, so that dead mounts aren't hanging around.
  */
 
-static int
-ltspfs_rename(const char *from, const char *to)
+#if FUSE_USE_VERSION >= 26
+static void *
+ltspfs_init (struct fuse_conn_info *conn __attribute__((unused)))
+#else
+static void *
+ltspfs_init (void)
+#endif
 {
-  return ltspfs_twopath(LTSPFS_RENAME, from, to);
+  pthread_t ping_thread;
+
+  /*
+   * Kick off our pinger thread.
+   */
+
+  if (pthread_create(&ping_thread, NULL, (void *)&ping_timeout,
+                    (void *)NULL) < 0) {
+    close(sock.fd);
+    exit(1);
+  }
+
+  pthread_detach(ping_thread);
+
+  /*
+   * handle_mount() happened before we daemonized, which a thread wouldn't
+   * have survived, so pre-warming gets started from here.
+   */
+
+  if (prewarm && !multi)
+    prewarm_start("/");
+
+  return NULL;
 }
+#endif
 
 /*
- * ltspfs_link:
+ * handle_connect:
  *
- * Handles the link filesystem call.  
+ * Opens our socket to ltspfsd on host.
  */
 
-static int
-ltspfs_link(const char *from, const char *to)
+void
+handle_connect(char *host)
 {
-  return ltspfs_twopath(LTSPFS_LINK, from, to);
+  sock.get = sock_get;
+  sock.put = sock_put;
+
+  if (pkt_connect(&sock, host, PORT)) {
+    fprintf(stderr, "ERROR connecting to %s: %s\n", host, strerror(errno));
+    exit(1);
+  }
 }
 
 /*
- * ltspfs_chmod:
+ * handle_mount:
  *
- * Handles the chmod filesystem call.  
+ * Mounts the export on the terminal, for a normal (not multi) mount.
  */
 
-static int
-ltspfs_chmod(const char *path, mode_t mode)
+void
+handle_mount(char *mp)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_CHMOD;
-  char *ptr = (char *)path;
+  if (pkt_mount(&sock, mp)) {
+    fprintf(stderr, "Couldn't mount %s\n", mp);
+    close(sock.fd);
+    exit(1);
+  }
+}
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+/* 
+ * Populate our FUSE function callout table.
+ */
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_u_int(&out, &mode);			/* build mode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+static struct fuse_operations ltspfs_oper = {
+  .getattr    = ltspfs_getattr,
+  .readlink   = ltspfs_readlink,
+#if FUSE_MINOR_VERSION < 3
+  .getdir     = ltspfs_getdir ,			/* older getdir() interface */
+#else
+  .opendir    = ltspfs_opendir,
+  .readdir    = ltspfs_readdir,			/* newer readdir() interface */
+  .releasedir = ltspfs_releasedir,
+#endif
+  .mknod      = ltspfs_mknod,
+  .mkdir      = ltspfs_mkdir,
+  .symlink    = ltspfs_symlink,
+  .unlink     = ltspfs_unlink,
+  .rmdir      = ltspfs_rmdir,
+  .rename     = ltspfs_rename,
+  .link       = ltspfs_link,
+  .chmod      = ltspfs_chmod,
+  .chown      = ltspfs_chown,
+  .truncate   = ltspfs_truncate,
+  .utime      = ltspfs_utime,
+  .open       = ltspfs_open,
+#if FUSE_USE_VERSION >= 25
+  .create     = ltspfs_create,			/* no create pre 2.5 */
+#endif
+  .read       = ltspfs_read,
+  .write      = ltspfs_write,
+  .statfs     = ltspfs_statfs,
+  .flush      = ltspfs_flush,
+  .release    = ltspfs_release,
+  .fsync      = ltspfs_fsync,
+#if FUSE_USE_VERSION >= 26 && FUSE_MINOR_VERSION >= 9
+  .fallocate  = ltspfs_fallocate,		/* no fallocate pre 2.9 */
+  .ioctl      = ltspfs_ioctl,			/* nor directory ioctls */
+#endif
+#if FUSE_MINOR_VERSION >= 3
+  .init       = ltspfs_init,			/* no init pre 2.3 */
+#endif
+};
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+/*
+ * ltspfs_opt:
+ *
+ * Checks a single -o option, to see if it's one of ours rather than one of
+ * fuse's.  Returns TRUE if it was ours.
+ */
 
-  return parse_return(&in);
+static int
+ltspfs_opt(const char *opt)
+{
+  if (!strcmp(opt, "multi"))
+    multi = TRUE;
+  else if (!strncmp(opt, "ratelimit=", 10))
+    rate_ceiling = atof(opt + 10) * 1024.0;
+  else if (!strcmp(opt, "adaptive"))
+    adaptive = TRUE;
+  else if (!strcmp(opt, "prewarm"))
+    prewarm = TRUE;
+  else if (!strncmp(opt, "sharedcache=", 12))
+    shm_budget = atof(opt + 12) * 1024.0 * 1024.0;
+  else if (!strncmp(opt, "memlimit=", 9))
+    mem_budget = atof(opt + 9) * 1024.0;
+  else if (!strncmp(opt, "servermemlimit=", 15))
+    mem_server = atof(opt + 15) * 1024.0 * 1024.0;
+  else
+    return FALSE;
+
+  return TRUE;
 }
 
 /*
- * ltspfs_chown:
+ * strip_opts:
  *
- * Handles the chown filesystem call.  
+ * Takes our options out of a comma separated -o list, leaving fuse's.
+ * Returns NULL if there's none of fuse's left.
  */
 
-static int
-ltspfs_chown(const char *path, uid_t uid, gid_t gid)
+static char *
+strip_opts(const char *opts)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_CHOWN;
-  char *ptr = (char *)path;
+  char *copy, *rest, *opt;
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  if (!(copy = strdup(opts)) || !(rest = calloc(1, strlen(opts) + 1))) {
+    fprintf(stderr, "calloc() failed to allocate memory\n");
+    exit(1);
+  }
+
+  for (opt = strtok(copy, ","); opt; opt = strtok(NULL, ","))
+    if (!ltspfs_opt(opt)) {
+      if (*rest)
+        strcat(rest, ",");
+      strcat(rest, opt);
+    }
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_u_int(&out, &uid);			/* build uid */
-  xdr_u_int(&out, &gid);			/* build gid */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  free(copy);
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+  if (!*rest) {
+    free(rest);
+    return NULL;
+  }
 
-  return parse_return(&in);
+  return rest;
 }
 
 /*
- * ltspfs_truncate:
+ * A tree ltspfs-get or ltspfs-put is part way through copying, and what
+ * ltspfsd's said about it.
+ */
+
+struct copy {
+  struct transfer tr;				/* first, so the hooks find us */
+  int          status;				/* ltspfsd's, once it's done */
+  XDR          in;				/* what it's sending */
+  char         inbuf[LTSP_MAXBUF];
+};
+
+static char *tree_prog;				/* ltspfs-get or ltspfs-put */
+
+/*
+ * tree_entry:
  *
- * Handles the truncate filesystem call.  
+ * Sends ltspfsd an entry of a tree we're putting, as tree_pack() has it.
+ * The data for a file follows it.
  */
 
-static int
-ltspfs_truncate(const char *path, off_t size)
+static void
+tree_entry(struct transfer *tr)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
+  XDR  out;
   char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_TRUNCATE;
-  char *ptr = (char *)path;
-
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
-
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_longlong_t(&out, &size);			/* build size */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  int  i = 0;
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+  xdrmem_create(&out, outbuf, LTSP_MAXBUF, XDR_ENCODE);
+  xdr_int(&out, &i);				/* reserve length field */
+  tree_pack(&out, tr);				/* what it is */
 
-  return parse_return(&in);
+  op_start();					/* it's still going */
+  writepacket(&out, outbuf);
 }
 
 /*
- * ltspfs_utime:
+ * tree_next:
  *
- * Handles the utime filesystem call.  
+ * Reads the next entry of a tree ltspfsd's sending us (they come with a 2
+ * status in front).  Returns FALSE once it's done, and the copy's status
+ * has how that went.
  */
 
 static int
-ltspfs_utime(const char *path, struct utimbuf *buf)
+tree_next(struct transfer *tr)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_UTIME;
-  char *ptr = (char *)path;
-
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  struct copy *cp = (struct copy *)tr;
+  int  statcode;
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_long(&out, &buf->actime);			/* build accesstime */
-  xdr_long(&out, &buf->modtime);		/* build modtime */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  op_start();					/* it's still going */
+  if (op_stop)
+    interrupted();				/* ^C since the last one */
+  xdr_setpos(&cp->in, 0);
+  readpacket(&cp->in, cp->inbuf);
+
+  if (!xdr_int(&cp->in, &statcode))
+    statcode = LTSP_STATUS_FAIL;
+  if (statcode != LTSP_STATUS_CONT) {
+    cp->status = statcode;
+    return FALSE;
+  }
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+  if (tree_unpack(&cp->in, tr))
+    return TRUE;
 
-  return parse_return(&in);
+  fprintf(stderr, "%s: lost track of what the terminal's sending\n",
+          tree_prog);
+  exit(1);
 }
 
 /*
- * ltspfs_open:
+ * tree_read, tree_write:
  *
- * Handles the open filesystem call.  
+ * Move a file's data in a tree, after the entry for it.
  */
 
 static int
-ltspfs_open(const char *path, struct fuse_file_info *fi)
+tree_read(struct transfer *tr, char *buf, int len)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_OPEN;
-  char *ptr = (char *)path;
-
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
-
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_int(&out, &fi->flags);			/* build open flags */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
-
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+  op_start();
+  return readn(tr->fd, buf, len);
+}
 
-  return parse_return(&in);
+static int
+tree_write(struct transfer *tr, const char *buf, int len)
+{
+  op_start();
+  return writen(tr->fd, (char *)buf, len);
 }
 
 /*
- * ltspfs_read:
+ * tree_result:
  *
- * Handles the read filesystem call.  
+ * Reports how it went, once ltspfsd's done with a tree (see ltspfsd's
+ * tree_done()), and how it went at our end.  Returns OK if all of it got
+ * copied.
  */
 
 static int
-ltspfs_read(const char *path, char *buf, size_t size, off_t offset,
-	    struct fuse_file_info *fi )
+tree_result(struct copy *cp)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_READ;
-  char *ptr = (char *)path;
-  int  res, returned;
+  char failed[PATH_MAX];
+  char *ptr = failed;
+  unsigned int entries;
+  int  res = OK;
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
-
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_u_int(&out, &size);			/* build packet size */
-  xdr_longlong_t(&out, &offset);		/* build file offset size */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  if (cp->tr.err)
+    fprintf(stderr, "%s: %s: %s\n", tree_prog, cp->tr.failed,
+            strerror(cp->tr.err));
 
-  pthread_mutex_lock(&lock);			/* Lock mutex */
-  writepacket(&out, outbuf);
-  readpacket(&in, inbuf);			/* Read response */
+  if (cp->status == LTSP_STATUS_OK)
+    return cp->tr.err ? ERROR : OK;
 
-  /*
-   * Parse the return and populate the read buffer passed to us.
-   */
+  if (!xdr_int(&cp->in, &res))
+    res = EACCES;
 
-  if (!xdr_int(&in, &res))
-    return -EACCES;
-  if (!xdr_int(&in, &returned))
-    return -EACCES;
+  if (xdr_u_int(&cp->in, &entries) && xdr_string(&cp->in, &ptr, PATH_MAX))
+    fprintf(stderr, "%s: terminal: %s: %s\n", tree_prog, failed,
+            strerror(res));
+  else
+    fprintf(stderr, "%s: terminal: %s\n", tree_prog, strerror(res));
 
-  xdr_destroy(&in);
+  return ERROR;
+}
 
-  if (res)					/* Error, return error code */
-    return -returned;
+/*
+ * sig_stop:
+ *
+ * ^C while ltspfs-get's going: have the terminal stop sending, and finish
+ * up what's been got so far.  Another ^C doesn't wait for that.
+ */
 
-  readn(sockfd, buf, returned);			/* read data payload */
-  pthread_mutex_unlock(&lock);			/* Unlock mutex */
-  
-  return returned;				/* Return bytes read */
+static void
+sig_stop(int signo __attribute__((unused)))
+{
+  op_stop = TRUE;
+  signal(SIGINT, SIG_DFL);
 }
 
 /*
- * ltspfs_write:
+ * tree_get:
  *
- * Handles the write filesystem call.  
+ * Copies remote, a path in the export, into the local directory dir.
+ * Setuid and setgid bits are dropped, unless -p asked to keep them.
  */
 
 static int
-ltspfs_write(const char *path, const char *buf, size_t size,
-	     off_t offset, struct fuse_file_info *fi)
+tree_get(struct copy *cp, char *remote, char *dir)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
+  XDR  out;
   char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_WRITE;
-  char *ptr = (char *)path;
-  int  res, returned;
+  int  opcode = LTSPFS_GET_TREE;
+  int  fd;
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1) {
+    fprintf(stderr, "%s: %s: %s\n", tree_prog, dir, strerror(errno));
+    return ERROR;
+  }
 
+  init_pkt(&cp->in, &out, cp->inbuf, outbuf);	/* Initialize packets */
   xdr_int(&out, &opcode);			/* build opcode */
-  xdr_u_int(&out, &size);			/* build packet size */
-  xdr_longlong_t(&out, &offset);		/* build file offset */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  build_path(&out, remote);			/* build path */
 
-  pthread_mutex_lock(&lock);			/* Lock mutex */
+  op_start();
   writepacket(&out, outbuf);
-  writen(sockfd, (char *)buf, size);		/* Send data buffer */
-  readpacket(&in, inbuf);			/* Read response */
-  pthread_mutex_unlock(&lock);			/* Unlock mutex */
-
-  /*
-   * Parse the return.
-   */
-
-  if (!xdr_int(&in, &res))
-    return -EACCES;
-  if (!xdr_int(&in, &returned))
-    return -EACCES;
-
-  xdr_destroy(&in);
+  signal(SIGINT, sig_stop);
 
-  if (res)					/* Error, return error code */
-    return -returned;
+  cp->tr.next = tree_next;
+  cp->tr.get  = tree_read;
+  while (tree_recv(&cp->tr, fd))		/* there's no TREE_UP at */
+    ;						/* the top, but just in case */
 
-  return returned;				/* Return bytes written */
+  close(fd);
+  return tree_result(cp);
 }
 
 /*
- * ltspfs_statfs:
+ * tree_put:
  *
- * Handles the statfs filesystem call.  
+ * Copies local into remote, a directory in the export.
  */
 
 static int
-ltspfs_statfs(const char *path, struct statfs *stbuf)
+tree_put(struct copy *cp, char *local, char *remote)
 {
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
+  XDR  out;
   char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_STATFS;
-  char *ptr = (char *)path;
-  int  ret;
-
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  char real[PATH_MAX];
+  char *as;
+  int  opcode = LTSPFS_PUT_TREE;
+  int  res, len;
 
+  init_pkt(&cp->in, &out, cp->inbuf, outbuf);	/* Initialize packets */
   xdr_int(&out, &opcode);			/* build opcode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  build_path(&out, remote);			/* build path */
 
-  send_recv(&in, &out, inbuf, outbuf);		/* send output, recv response */
+  op_start();
+  writepacket(&out, outbuf);
+  readpacket(&cp->in, cp->inbuf);		/* Can we go ahead? */
+  if ((res = parse_return(&cp->in))) {
+    fprintf(stderr, "%s: terminal: %s: %s\n", tree_prog, remote,
+            strerror(-res));
+    return ERROR;
+  }
 
   /*
-   * Parse the return and populate the stbuf structure
+   * It goes by the last part of its name, like cp -r does it.
    */
 
-  if (!xdr_int(&in, &ret))
-    return -EACCES;
-
-  if (ret)
-    return parse_return(&in);
-
-  xdr_int(&in, &stbuf->f_type);                 /* type of fs */
-  xdr_int(&in, &stbuf->f_bsize);                /* optimal transfer block sz */
-  xdr_u_longlong_t(&in, &stbuf->f_blocks);      /* total data blocks in fs */
-  xdr_u_longlong_t(&in, &stbuf->f_bfree);       /* free blks in fs */
-  xdr_u_longlong_t(&in, &stbuf->f_bavail);      /* free blks avail to non-su */
-  xdr_u_longlong_t(&in, &stbuf->f_files);       /* total file nodes in fs */
-  xdr_u_longlong_t(&in, &stbuf->f_ffree);       /* free file nodes in fs */
-  xdr_int(&in, &stbuf->f_namelen);            
-
-  return OK;
+  strncpy(real, local, PATH_MAX - 1);
+  for (len = strlen(real); len > 1 && real[len - 1] == '/'; len--)
+    real[len - 1] = '\0';
+  as = (as = strrchr(real, '/')) ? as + 1 : real;
+  if (!tree_name(as) && realpath(local, real))
+    as = strrchr(real, '/') + 1;		/* "." and so on */
+
+  cp->tr.entry = tree_entry;
+  cp->tr.put   = tree_write;
+  tree_send(&cp->tr, AT_FDCWD, local, as);
+  cp->tr.type = TREE_END;
+  tree_entry(&cp->tr);
+
+  init_pkt(&cp->in, &out, cp->inbuf, outbuf);
+  readpacket(&cp->in, cp->inbuf);		/* Read how it went */
+  if (!xdr_int(&cp->in, &cp->status))
+    cp->status = LTSP_STATUS_FAIL;
+  xdr_destroy(&out);
+
+  return tree_result(cp);
 }
 
 /*
- * ltspfs_release:
+ * tree_main:
  *
- * Handles the release filesystem call.  
- * Since filesystem is stateless, this is a null function.
- */
-
-static int
-ltspfs_release (const char *path __attribute__((unused)),
-  struct fuse_file_info *fi __attribute__((unused)))
-{
-  return OK;
-}
-
-/*
- * ltspfs_fsync:
+ * Run as ltspfs-get or ltspfs-put (through a link by that name), ltspfs
+ * copies a whole tree from or to the terminal, without mounting anything.
+ * The tree goes in one stream, rather than a request per file, or per
+ * piece of one:
  *
- * Handles the fsync filesystem call.  
- * Since filesystem is stateless, this is a null function.
- */
-
-static int
-ltspfs_fsync (const char *path __attribute__((unused)),
-  int isdatasync, struct fuse_file_info *fi __attribute__((unused)))
-{
-  return OK;
-}
-
-#if FUSE_MINOR_VERSION >= 3
-/*
- * ltspfs_init:
+ * ltspfs-get [-v] [-p] host:/dir/to/mount /path/in/it localdir
+ * ltspfs-put [-v] host:/dir/to/mount localpath /dir/in/it
  *
- * Called after the mainline's forked and daemonized.  Create a pinger 
- * thread that will sit in the background and ping the server every
- * PING_INTERVAL seconds.  In the event that the LTSP terminal is shut off
- * without a proper fusermount -u being executed, this will unmount
- * the filesystem automatically, so that dead mounts aren't hanging around.
+ * copies /path/in/it, or localpath, into the directory given last, as
+ * cp -r would.  -v says how much went, and how fast.  -p keeps the
+ * setuid and setgid bits on what's got, which are dropped otherwise.
  */
 
-static void *
-ltspfs_init (void)
+static int
+tree_main(char *prog, int argc, char *argv[])
 {
-  pthread_t ping_thread;
-
-  /*
-   * Kick off our pinger thread.
-   */
-
-  if (pthread_create(&ping_thread, NULL, (void *)&ping_timeout,
-                    (void *)NULL) < 0) {
-    close(sockfd);
+  struct copy    *cp;
+  struct timeval start, now;
+  char   *host, *mountpoint, *remote;
+  int    put = !strcmp(prog, "ltspfs-put");
+  int    verbose = FALSE, keep = FALSE, i, r;
+  double t;
+
+  for (i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-v"))
+      verbose = TRUE;
+    else if (!put && !strcmp(argv[i], "-p"))
+      keep = TRUE;
+    else
+      break;
+
+  remote = argc - i == 3 ? argv[i + (put ? 2 : 1)] : NULL;
+  if (!remote || !strchr(argv[i], ':') || *remote != '/') {
+    fprintf(stderr, "Usage: %s [-v]%s host:/dir/to/mount %s\n", prog,
+            put ? "" : " [-p]",
+            put ? "localpath /dir/in/it" : "/path/in/it localdir");
     exit(1);
   }
 
-  pthread_detach(ping_thread);
-
-  return NULL;
-}
-#endif
-
-void
-handle_mount(char *mp)
-{
-  XDR  in, out;
-  char inbuf[LTSP_MAXBUF];
-  char outbuf[LTSP_MAXBUF];
-  int  opcode = LTSPFS_MOUNT;
-  char *ptr = mp;
-  int  res;
+  if (!(cp = calloc(1, sizeof(struct copy)))) {
+    fprintf(stderr, "calloc() failed to allocate memory\n");
+    exit(1);
+  }
 
-  init_pkt(&in, &out, inbuf, outbuf);		/* Initialize packets */
+  host = argv[i];
+  mountpoint = strchr(host, ':');
+  *mountpoint++ = '\0';
 
-  xdr_int(&out, &opcode);			/* build opcode */
-  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+  if (*mountpoint != '/') {
+    fprintf(stderr, "No mountpoint specified!\n");
+    exit(1);
+  }
 
-  writepacket(&out, outbuf);
-  readpacket(&in, inbuf);			/* Read response */
+  tree_prog = prog;
+  handle_connect(host);
 
-  xdr_int(&in, &res);
-  if (res) {
-    fprintf(stderr, "Couldn't mount %s\n", mp);
-    close(sockfd);
+  op_start();
+  if (ltspfs_sendauth(host) != 0) {
+    fprintf(stderr, "Authentication failed.\n");
     exit(1);
   }
-}
 
-/* 
- * Populate our FUSE function callout table.
- */
+  op_start();
+  handle_mount(mountpoint);
 
-static struct fuse_operations ltspfs_oper = {
-  .getattr    = ltspfs_getattr,
-  .readlink   = ltspfs_readlink,
-#if FUSE_MINOR_VERSION < 3
-  .getdir     = ltspfs_getdir ,			/* older getdir() interface */
-#else
-  .readdir    = ltspfs_readdir,			/* newer readdir() interface */
-#endif
-  .mknod      = ltspfs_mknod,
-  .mkdir      = ltspfs_mkdir,
-  .symlink    = ltspfs_symlink,
-  .unlink     = ltspfs_unlink,
-  .rmdir      = ltspfs_rmdir,
-  .rename     = ltspfs_rename,
-  .link       = ltspfs_link,
-  .chmod      = ltspfs_chmod,
-  .chown      = ltspfs_chown,
-  .truncate   = ltspfs_truncate,
-  .utime      = ltspfs_utime,
-  .open       = ltspfs_open,
-  .read       = ltspfs_read,
-  .write      = ltspfs_write,
-  .statfs     = ltspfs_statfs,
-  .release    = ltspfs_release,
-  .fsync      = ltspfs_fsync,
-#if FUSE_MINOR_VERSION >= 3
-  .init       = ltspfs_init,			/* no init pre 2.3 */
-#endif
-};
+  cp->tr.fd   = sock.fd;
+  cp->tr.keep = keep;
+  gettimeofday(&start, NULL);
+  if (put)
+    r = tree_put(cp, argv[i + 1], remote);
+  else
+    r = tree_get(cp, remote, argv[i + 2]);
+  gettimeofday(&now, NULL);
+
+  if (verbose) {
+    t = elapsed(&start, &now);
+    printf("%u entries, %llu bytes in %.1f secs (%.0f KB/s)\n",
+           cp->tr.entries, (unsigned long long)cp->tr.bytes, t,
+           t > 0 ? cp->tr.bytes / t / 1024 : 0);
+  }
+
+  close(sock.fd);
+  free(cp);
+  return r;
+}
 
 /*
  * MAINLINE
@@ -1101,7 +6504,11 @@ main (int argc, char *argv[])
 {
   int  i, myargc = 0;
   char *host = NULL, *mountpoint = NULL, *hostmount = NULL;
+  char *opts, *prog;
   char **myargv;
+#if FUSE_USE_VERSION >= 26
+  char intr_opt[32];
+#endif
 
   /*
    * Argument handling.
@@ -1125,16 +6532,37 @@ main (int argc, char *argv[])
    * handling timeouts.   When we get a timeout, we want to execute a 
    * fuse_unmount command, so we'll assume that something that looks like 
    * "/..." is the local directory mount point.
+   *
+   * Our own options ride along in -o with fuse's, so strip those out too.
+   * With "-o multi", host:/dir is the directory the terminal's shares are
+   * under, and each one gets attached by making a directory for it in the
+   * root of the mount:
+   *
+   * ltspfs -o multi host:/tmp/drives /mountpoint
+   * mkdir /mountpoint/usbdisk
+   *
+   * "-o ratelimit=<KB/s>" caps the rate file data moves at, and
+   * "-o adaptive" backs off from that when the link gets congested.
+   * "-o prewarm" fetches the root of a mount (or of each share as it's
+   * attached) in the background, so it's cached before anyone asks.
+   * "-o sharedcache=<MB>" keeps file data where the other ltspfs
+   * processes on this server can use it too.
+   * "-o memlimit=<KB>" is what all our caches can use between them, and
+   * "-o servermemlimit=<MB>" what every ltspfs on the server can.
    */
 
-    if (argc < 3) {
-      fprintf(stderr, 
-	      "Usage: %s host:/dir/to/mount /mountpoint <fuse options>\n",
-	      argv[0]);
-      exit(1);
-    }
+  prog = (prog = strrchr(argv[0], '/')) ? prog + 1 : argv[0];
+  if (!strcmp(prog, "ltspfs-get") || !strcmp(prog, "ltspfs-put"))
+    return tree_main(prog, argc, argv);	/* not a mount at all */
+
+  if (argc < 3) {
+    fprintf(stderr, 
+	    "Usage: %s host:/dir/to/mount /mountpoint <fuse options>\n",
+	    argv[0]);
+    exit(1);
+  }
 
-  myargv = calloc(argc, sizeof(char *)); 	/* allocate same size */
+  myargv = calloc(argc * 2 + 1, sizeof(char *));	/* room to split -oX */
 
   if (!myargv) {
     fprintf(stderr, "calloc() failed to allocate memory\n");
@@ -1144,13 +6572,34 @@ main (int argc, char *argv[])
   myargv[myargc++] = argv[0];			/* program name */
  
   for (i = 1; i < argc; i++)			/* rest of arguments */
-    if (strchr(argv[i], ':'))
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      if ((opts = strip_opts(argv[++i]))) {
+        myargv[myargc++] = "-o";
+        myargv[myargc++] = opts;
+      }
+    } else if (!strncmp(argv[i], "-o", 2)) {
+      if ((opts = strip_opts(argv[i] + 2))) {
+        myargv[myargc++] = "-o";
+        myargv[myargc++] = opts;
+      }
+    } else if (strchr(argv[i], ':'))
       hostmount = strdup(argv[i]);		/* duplicate our parameter */
     else {
       if (*argv[i] == '/')
         fuse_mount_point = argv[i];		/* point to the local mount */
       myargv[myargc++] = argv[i];		/* copy the rest */
     }
+
+#if FUSE_USE_VERSION >= 26
+  /*
+   * Have fuse tell us when a request's interrupted, so we can cancel it
+   * (see interrupted()).  It's done with a signal, which can't be SIGUSR1,
+   * as that's for the stats.
+   */
+
+  snprintf(intr_opt, sizeof(intr_opt), "-ointr,intr_signal=%d", SIGUSR2);
+  myargv[myargc++] = intr_opt;
+#endif
     
   /*
    * Now hostmount contains the string for the host, and the directory.
@@ -1180,24 +6629,50 @@ main (int argc, char *argv[])
    * Open up our socket
    */
 
-  sockfd = opensocket(host, PORT);
+  handle_connect(host);
 
   /*
-   * Initialize our mutex.
+   * Initialize our scheduler.
    */
 
-  pthread_mutex_init(&lock, NULL);
+  for (i = 0; i < SCHED_CLASSES; i++)
+    pthread_cond_init(&sched_cond[i], NULL);
+
+  openlog("ltspfs", LOG_PID, LOG_DAEMON);
+  signal(SIGUSR1, sig_stats);
+
+  if (adaptive && !rate_ceiling)
+    rate_ceiling = RATE_DEFAULT * 1024.0;
+  rate = rate_ceiling;
+  gettimeofday(&rate_last, NULL);
+
+  if (shm_budget)
+    shm_attach();
+
+  if (!mem_budget)
+    mem_budget = MEM_DEFAULT * 1024;
+  mem_limit = mem_budget;
+  if (mem_server)
+    mem_attach();
 
   /*
    * The connection's plumbed.  Issue our mount command.
    */
 
-  if (ltspfs_sendauth() != 0) {
+  op_start();					/* no socket lock yet */
+  if (ltspfs_sendauth(host) != 0) {
     fprintf(stderr, "Authentication failed.\n");
     exit(1);
   }
 
-  handle_mount(mountpoint);
+  op_start();
+  if (multi)
+    export_base = mountpoint;			/* shares get attached later */
+  else
+    handle_mount(mountpoint);
+
+  mount_host = host;
+  mount_dir  = mountpoint;
 
   /*
    * We're mounted.  Fire up fuse.
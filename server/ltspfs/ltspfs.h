@@ -2,14 +2,15 @@
  * The maximum sized command we have is the symlink command.
  * We'll need: 1 BYTES_PER_XDR_UNIT for the packet length.
  *             1 BYTES_PER_XDR_UNIT for the packet type
- *             2 * (BYTES_PER_XDR_UNIT + PATH_MAX) for the paths.
+ *             2 * (2 * BYTES_PER_XDR_UNIT + PATH_MAX) for the node ids
+ *             and paths.
  * So:
  *
- * ((4 * BYTES_PER_XDR_UNIT) + (2 * PATH_MAX))
+ * ((6 * BYTES_PER_XDR_UNIT) + (2 * PATH_MAX))
  */
 
 #define PORT          9220
-#define LTSP_MAXBUF   ((4 * BYTES_PER_XDR_UNIT) + (2 * PATH_MAX))
+#define LTSP_MAXBUF   ((6 * BYTES_PER_XDR_UNIT) + (2 * PATH_MAX))
 
 /*
  * Field handling
@@ -19,10 +20,121 @@
 #define FIELD_ERRNO 1
 
 #define PING_INTERVAL  60	/* 1 minute ping interval */
-#define LTSPFS_TIMEOUT 30 	/* 30 second timeout */
+#define NOTIFY_INTERVAL 1	/* check for notifications every second */
+#define LTSPFS_TIMEOUT 30 	/* timeout till we've timed the link */
+#define TIMEOUT_MIN    5	/* never time out a request sooner */
+#define TIMEOUT_MAX    120	/* nor later, if the terminal's still there */
+#define TIMEOUT_SCALE  4	/* times as long as it ought to take */
+#define XPUT_MIN       16384	/* smaller payloads aren't timed for rate */
+#define NODE_MAX       1024	/* max directory nodes we'll remember */
+#define NODE_HASH      1024	/* buckets in the node and attr caches */
+#define PENDING_MAX    64	/* max queued metadata updates in flight */
+#define SHARE_MAX      16	/* shares in a multi mount */
+#define SHARE_NONE     (~(NODE_MAX - 1))	/* export id that never exists */
+#define SCHED_CHUNK    65536	/* bulk transfers go in pieces this big */
+#define READ_WINDOW    4	/* pieces of a large read in flight at once */
+#define READ_CHUNK_MIN 16384	/* smallest piece they're split into */
+#define READ_CHUNK_MAX 262144	/* and the biggest */
+#define READ_CHUNK_TIME 10	/* msecs worth of data in a piece */
+#define WRITE_WINDOW_MIN 262144	/* bytes a file can have written, unacked */
+#define WRITE_WINDOW_MAX 4194304	/* however fast and far away the link is */
+#define HEAD_MAX       131072	/* reads from the start this big are heads */
+#define HEAD_RUN       3	/* files in a row before heads are prefetched */
+#define HEAD_BATCH     16	/* most heads asked for at once */
+#define STAT_BATCH     64	/* most stats libltspfs has in flight */
+#define RATE_DEFAULT   12500	/* KB/s ceiling for -o adaptive, 100Mbit */
+#define RATE_FLOOR     64	/* KB/s adaptive never goes below */
+#define RATE_BURST     10	/* bucket holds 1/10th sec worth */
+#define RATE_INFLATE   2	/* rtt this many times the best is congested */
+#define RATE_SLACK     5	/* plus this many msecs, for jitter */
+#define ATTR_TTL       10	/* secs cached attributes are good for */
+#define STATFS_TTL     10	/* secs cached statfs answers are good for */
+#define PREWARM_MAX    256	/* max entries pre-warmed in a new mount */
+#define DIRLIST_MAX    4096	/* biggest listing that gets cached */
+#define SHM_NAME       "/ltspfs-cache"	/* shared cache segment */
+#define SHM_MAGIC      0x4c544331	/* "LTC1" */
+#define SHM_BLOCK      65536	/* shared cache block size */
+#define SHM_WAYS       8	/* slots per set */
+#define SHM_VERIFY_MAX 64	/* most blocks checked in one go */
+#define TICKET_LEN     16	/* bytes in a session ticket */
+#define MEM_DEFAULT    2048	/* KB the caches can have, per process */
+#define MEM_FLOOR      256	/* KB a server-wide budget leaves us, at least */
+#define MEM_SLACK      8	/* make room for 1/8th more than asked */
+#define MEM_SHM_NAME   "/ltspfs-mem"	/* server-wide usage */
+#define MEM_PROCS      1024	/* processes it has room for */
 #define LTSP_STATUS_OK     0
 #define LTSP_STATUS_FAIL   1
 #define LTSP_STATUS_CONT   2
+#define LTSP_STATUS_NOTIFY 3
+
+/*
+ * lseek() whences for finding holes, if libc's too old to know them
+ */
+
+#ifndef SEEK_DATA
+#define SEEK_DATA          3
+#define SEEK_HOLE          4
+#endif
+
+/*
+ * Scheduling classes for the socket, most important first
+ */
+
+#define SCHED_META         0		/* metadata, directory listings */
+#define SCHED_READ         1		/* reads someone's waiting on */
+#define SCHED_BULK         2		/* readahead, writes */
+#define SCHED_CLASSES      3
+
+/*
+ * Caches that allocate through the memory budget
+ */
+
+#define MEM_NODE           0		/* node ids */
+#define MEM_ATTR           1		/* attributes */
+#define MEM_FVER           2		/* close-to-open versions */
+#define MEM_HEAD           3		/* prefetched file heads */
+#define MEM_DIR            4		/* directory listings */
+#define MEM_CACHES         5
+
+/*
+ * What else attr_forget() drops along with a path
+ */
+
+#define FORGET_PARENT      1		/* the directory it's in */
+#define FORGET_TREE        2		/* everything underneath it */
+
+/*
+ * Change notifications from ltspfsd
+ */
+
+#define NOTIFY_CHANGED     1		/* contents or attributes changed */
+#define NOTIFY_CREATED     2		/* entry created or moved in */
+#define NOTIFY_REMOVED     3		/* entry deleted or moved away */
+
+/*
+ * Static tracepoints, for perf and bpftrace (ltspfs:packet__send and so
+ * on).  They're a nop till something's attached, and without <sys/sdt.h>
+ * they aren't there at all, and neither is the clock reading for them,
+ * TRACE_CLOCK().
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_CLOCK(t)            gettimeofday(&(t), NULL)
+#define TRACE2(name, a, b)        DTRACE_PROBE2(ltspfs, name, a, b)
+#define TRACE3(name, a, b, c)     DTRACE_PROBE3(ltspfs, name, a, b, c)
+#else
+#define TRACE_CLOCK(t)            ((void)(t))
+#define TRACE2(name, a, b)        do { if (0) (void)(a), (void)(b); } while (0)
+#define TRACE3(name, a, b, c) \
+  do { if (0) (void)(a), (void)(b), (void)(c); } while (0)
+#endif
+
+/*
+ * ioctls the tools use, on a file or directory in the mount
+ */
+
+#define LTSPFS_IOC_RMTREE  _IOR('L', 1, unsigned int)	/* rm -rf, in one go */
 
 /*
  * Packet types
@@ -56,3 +168,16 @@
 #define LTSPFS_MOUNT       25
 #define LTSPFS_PING        26
 #define LTSPFS_QUIT        27
+#define LTSPFS_LOOKUP      28
+#define LTSPFS_UMOUNT      29
+#define LTSPFS_SEEK        30
+#define LTSPFS_FALLOCATE   31
+#define LTSPFS_READDIRPAGE 32
+#define LTSPFS_CHECKSUM    33
+#define LTSPFS_RESUME      34
+#define LTSPFS_CREATE      35
+#define LTSPFS_READHEADS   36
+#define LTSPFS_REMOVE_TREE 37
+#define LTSPFS_GET_TREE    38
+#define LTSPFS_PUT_TREE    39
+#define LTSPFS_CANCEL      40
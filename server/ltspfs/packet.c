@@ -0,0 +1,398 @@
+/*
+ * packet.c: the ltspfsd protocol, shared by ltspfs and libltspfs: setting
+ * up a connection, building, sending and reading packets, and unpacking
+ * what comes back.  Nothing here prints anything, or exits: failures come
+ * back as -1 with errno set, for the caller to deal with its own way.
+ *
+ * This file is licensed under the GNU GPL.  Please see the "Copying" file
+ * for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "ltspfs.h"
+#include "packet.h"
+
+/*
+ * pkt_connect:
+ *
+ * Opens a connection to ltspfsd on host, trying each of its addresses
+ * in turn.
+ */
+
+int
+pkt_connect(struct pkt_conn *c, const char *host, int port)
+{
+  struct addrinfo hints, *res, *ai;
+  char portname[16];
+  int  one = 1, err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(portname, sizeof(portname), "%d", port);
+
+  if ((err = getaddrinfo(host, portname, &hints, &res))) {
+    errno = err == EAI_SYSTEM ? errno : EHOSTUNREACH;
+    return -1;
+  }
+
+  c->fd = -1;
+  for (ai = res; ai && c->fd < 0; ai = ai->ai_next) {
+    c->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (c->fd >= 0 && connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+      err = errno;
+      close(c->fd);
+      c->fd = -1;
+      errno = err;
+    }
+  }
+  freeaddrinfo(res);
+
+  if (c->fd < 0)
+    return -1;
+
+  /*
+   * Requests are small, and often sent without waiting for the answer to
+   * the last one.  Don't let them sit waiting for an ack.
+   */
+
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  /*
+   * A terminal that's pulled off the network never says so.  Probe it once
+   * things have been quiet for TIMEOUT_MIN: a live one acks, which is how
+   * a slow answer's told from a dead terminal, and a dead one's dropped
+   * after TIMEOUT_MIN probes go unanswered, or TIMEOUT_MAX with something
+   * we sent still unacked.
+   */
+
+  setsockopt(c->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef TCP_KEEPIDLE
+  {
+    int idle = TIMEOUT_MIN, intvl = 1, cnt = TIMEOUT_MIN;
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+  }
+#endif
+#ifdef TCP_USER_TIMEOUT
+  {
+    unsigned int ms = TIMEOUT_MAX * 1000;
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms));
+  }
+#endif
+
+  c->sent = 0;
+
+  return 0;
+}
+
+/*
+ * pkt_authorize:
+ *
+ * Sends the X cookie for our $DISPLAY, or a dummy one when the display's
+ * tunnelled over ssh, which needs the -a option on the terminal.  The
+ * answer's left in in, just past the length, for the caller to look at.
+ */
+
+int
+pkt_authorize(struct pkt_conn *c, XDR *in, char *inbuf)
+{
+  XDR  out;
+  char outbuf[LTSP_MAXBUF];
+  char command[LTSP_MAXBUF];
+  char auth[BUFSIZ];
+  char *display;
+  FILE *pcmd;
+  int  size;
+
+  if (!(display = getenv("DISPLAY"))) {
+    errno = EACCES;
+    return -1;
+  }
+
+  if (!strncmp(display, "localhost", 9)) {
+    strcpy(auth, "DUMMY AUTH");
+    size = strlen(auth);
+  } else {
+    snprintf(command, sizeof(command), "xauth extract - %s", display);
+    if (!(pcmd = popen(command, "r")))
+      return -1;
+    size = fread(auth, sizeof(char), sizeof(auth), pcmd);
+    pclose(pcmd);
+  }
+
+  pkt_start(&out, outbuf, LTSPFS_XAUTH);
+  xdr_int(&out, &size);				/* build auth packet size */
+
+  if (pkt_send(c, &out, outbuf) < 0)
+    return -1;
+  if (c->put(c, auth, size) != size) {		/* send authfile */
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  xdrmem_create(in, inbuf, LTSP_MAXBUF, XDR_DECODE);
+  return pkt_recv(c, in, inbuf) < 0 ? -1 : 0;
+}
+
+/*
+ * pkt_mount:
+ *
+ * Mounts dir on the terminal, for this connection.
+ */
+
+int
+pkt_mount(struct pkt_conn *c, const char *dir)
+{
+  XDR  in, out;
+  char inbuf[LTSP_MAXBUF];
+  char outbuf[LTSP_MAXBUF];
+  char *ptr = (char *)dir;
+
+  pkt_start(&out, outbuf, LTSPFS_MOUNT);
+  xdr_string(&out, &ptr, PATH_MAX);		/* build path */
+
+  xdrmem_create(&in, inbuf, LTSP_MAXBUF, XDR_DECODE);
+  if (pkt_send(c, &out, outbuf) < 0 || pkt_recv(c, &in, inbuf) < 0)
+    return -1;
+
+  return pkt_status(&in);
+}
+
+/*
+ * init_pkt()
+ *
+ * Sets up an input and output packets.
+ */
+
+void
+init_pkt(XDR *in, XDR *out, char *inbuf, char *outbuf)
+{
+  int i = 0;
+  xdrmem_create(in,  inbuf,  LTSP_MAXBUF, XDR_DECODE);
+  xdrmem_create(out, outbuf, LTSP_MAXBUF, XDR_ENCODE);
+  xdr_int(out, &i);				/* reserve length field */
+}
+
+/*
+ * pkt_start:
+ *
+ * Starts a request packet, leaving room for the length.
+ */
+
+void
+pkt_start(XDR *out, char *outbuf, int opcode)
+{
+  int i = 0;
+
+  xdrmem_create(out, outbuf, LTSP_MAXBUF, XDR_ENCODE);
+  xdr_int(out, &i);				/* reserve length field */
+  xdr_int(out, &opcode);			/* build opcode */
+}
+
+/*
+ * pkt_path:
+ *
+ * Adds a path to a request: a node id ltspfsd handed back from a LOOKUP
+ * and a name in that directory, or node 0 and a path from the top of what
+ * was mounted.
+ */
+
+void
+pkt_path(XDR *out, unsigned int id, const char *name)
+{
+  char *ptr = (char *)name;
+
+  xdr_u_int(out, &id);				/* build node */
+  xdr_string(out, &ptr, PATH_MAX);		/* build name */
+}
+
+/*
+ * pkt_send:
+ *
+ * Fills in the length of a request, and sends it.  Returns the length, or
+ * -1 if it didn't all go.
+ */
+
+int
+pkt_send(struct pkt_conn *c, XDR *out, char *outbuf)
+{
+  int len;
+
+  len = xdr_getpos(out);			/* Grab the current streampos */
+  xdr_setpos(out, 0);				/* rewind to beginning */
+  xdr_int(out, &len);				/* Write proper length */
+  xdr_destroy(out);
+
+  c->sent++;
+  if (c->put(c, outbuf, len) != len) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  return len;
+}
+
+/*
+ * pkt_recv:
+ *
+ * Reads the next packet in, the length first, then the rest of it, and
+ * leaves in just past the length.  Returns the length, or -1 if the packet
+ * was cut short, or its length makes no sense: either way, there's no
+ * telling where the next one starts.
+ */
+
+int
+pkt_recv(struct pkt_conn *c, XDR *in, char *inbuf)
+{
+  int len;
+
+  xdr_setpos(in, 0);
+  if (c->get(c, inbuf, BYTES_PER_XDR_UNIT) != BYTES_PER_XDR_UNIT ||
+      !xdr_int(in, &len) || len <= BYTES_PER_XDR_UNIT || len > LTSP_MAXBUF)
+    goto lost;
+
+  if (c->get(c, inbuf + BYTES_PER_XDR_UNIT, len - BYTES_PER_XDR_UNIT) !=
+      len - BYTES_PER_XDR_UNIT)
+    goto lost;
+
+  return len;
+
+ lost:
+  errno = ENOTCONN;
+  return -1;
+}
+
+/*
+ * packet_word:
+ *
+ * The nth XDR unit of a packet: its opcode or status is the second.
+ */
+
+int
+packet_word(const char *packetbuffer, int n)
+{
+  uint32_t w;
+
+  memcpy(&w, packetbuffer + n * BYTES_PER_XDR_UNIT, sizeof(w));
+  return (int)ntohl(w);
+}
+
+/*
+ * pkt_status:
+ *
+ * Reads the status at the start of an answer.  0 if it's OK, otherwise
+ * -1 with errno set to what ltspfsd said went wrong.
+ */
+
+int
+pkt_status(XDR *in)
+{
+  int res, err;
+
+  if (!xdr_int(in, &res)) {
+    errno = EIO;
+    return -1;
+  }
+  if (res == LTSP_STATUS_OK)
+    return 0;
+
+  errno = xdr_int(in, &err) ? err : EIO;
+  return -1;
+}
+
+/*
+ * pkt_stale:
+ *
+ * Peeks at an answer, and returns TRUE if ltspfsd said the node id it was
+ * sent is no good any more, so it wants resending with the full path.
+ */
+
+int
+pkt_stale(XDR *in)
+{
+  int pos = xdr_getpos(in);
+  int res, retcode;
+  int r;
+
+  r = xdr_int(in, &res) && res == LTSP_STATUS_FAIL &&
+      xdr_int(in, &retcode) && retcode == ESTALE;
+
+  xdr_setpos(in, pos);
+  return r;
+}
+
+/*
+ * parse_stat:
+ *
+ * Unpacks attributes the way ltspfsd packs them.  Returns FALSE if they
+ * don't all come out.  Only whole seconds come; see parse_nsec().
+ */
+
+int
+parse_stat(XDR *in, struct stat *stbuf)
+{
+  u_quad_t dev, ino, rdev;
+  quad_t   size, blocks;
+  u_int    mode, nlink, uid, gid;
+  long     blksize, atime, mtime, ctime;
+
+  if (!xdr_u_longlong_t(in, &dev) || !xdr_u_longlong_t(in, &ino) ||
+      !xdr_u_int(in, &mode) || !xdr_u_int(in, &nlink) ||
+      !xdr_u_int(in, &uid) || !xdr_u_int(in, &gid) ||
+      !xdr_u_longlong_t(in, &rdev) || !xdr_longlong_t(in, &size) ||
+      !xdr_long(in, &blksize) || !xdr_longlong_t(in, &blocks) ||
+      !xdr_long(in, &atime) || !xdr_long(in, &mtime) ||
+      !xdr_long(in, &ctime))
+    return FALSE;
+
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_dev     = dev;
+  stbuf->st_ino     = ino;
+  stbuf->st_mode    = mode;
+  stbuf->st_nlink   = nlink;
+  stbuf->st_uid     = uid;
+  stbuf->st_gid     = gid;
+  stbuf->st_rdev    = rdev;
+  stbuf->st_size    = size;
+  stbuf->st_blksize = blksize;
+  stbuf->st_blocks  = blocks;
+  stbuf->st_atime   = atime;
+  stbuf->st_mtime   = mtime;
+  stbuf->st_ctime   = ctime;
+
+  return TRUE;
+}
+
+/*
+ * parse_nsec:
+ *
+ * Newer ltspfsd ends a LOOKUP answer with the mtime and ctime nanoseconds.
+ * Older ones don't, and what's past the end of the answer is left over
+ * from something else, so they're only read if the answer's long enough.
+ */
+
+void
+parse_nsec(XDR *in, const char *inbuf, struct stat *stbuf)
+{
+  long mnsec, cnsec;
+
+  if (xdr_getpos(in) < (unsigned int)packet_word(inbuf, 0) &&
+      xdr_long(in, &mnsec) && xdr_long(in, &cnsec)) {
+    stbuf->st_mtim.tv_nsec = mnsec;
+    stbuf->st_ctim.tv_nsec = cnsec;
+  }
+}
@@ -0,0 +1,48 @@
+/*
+ * packet.h: the ltspfsd protocol, as ltspfs and libltspfs both speak it.
+ */
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/types.h>
+#include <rpc/xdr.h>
+
+/*
+ * A connection to ltspfsd.  get and put move exactly len bytes, and return
+ * len, or anything else if they couldn't: it's up to them how long to wait,
+ * and what to do if ltspfsd takes too long.  sent counts the packets sent,
+ * the same as ltspfsd does, since that's how a CANCEL says which request
+ * it means.
+ */
+
+struct pkt_conn {
+  int          fd;
+  int          (*get)(struct pkt_conn *c, char *buf, int len);
+  int          (*put)(struct pkt_conn *c, const char *buf, int len);
+  unsigned int sent;
+};
+
+/*
+ * function prototypes
+ */
+
+int  pkt_connect(struct pkt_conn *c, const char *host, int port);
+int  pkt_authorize(struct pkt_conn *c, XDR *in, char *inbuf);
+int  pkt_mount(struct pkt_conn *c, const char *dir);
+
+void init_pkt(XDR *in, XDR *out, char *inbuf, char *outbuf);
+void pkt_start(XDR *out, char *outbuf, int opcode);
+void pkt_path(XDR *out, unsigned int id, const char *name);
+int  pkt_send(struct pkt_conn *c, XDR *out, char *outbuf);
+int  pkt_recv(struct pkt_conn *c, XDR *in, char *inbuf);
+int  packet_word(const char *packetbuffer, int n);
+
+int  pkt_status(XDR *in);
+int  pkt_stale(XDR *in);
+int  parse_stat(XDR *in, struct stat *stbuf);
+void parse_nsec(XDR *in, const char *inbuf, struct stat *stbuf);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * ltspfs-rmtree: removes files and directories on an ltspfs mount, and
+ * everything in the directories, like rm -rf.  The removing's done by
+ * ltspfsd on the terminal, in one request, rather than by ltspfs a round
+ * trip at a time.
+ *
+ * Usage: ltspfs-rmtree [-v] <path>...
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "ltspfs.h"
+
+int
+main(int argc, char **argv)
+{
+  unsigned int removed;
+  int i = 1, fd, verbose = 0, ret = 0;
+
+  if (argc > 1 && !strcmp(argv[1], "-v")) {
+    verbose = 1;
+    i++;
+  }
+
+  if (i >= argc) {
+    fprintf(stderr, "Usage: %s [-v] <path>...\n", argv[0]);
+    return 1;
+  }
+
+  for (; i < argc; i++) {
+    fd = open(argv[i], O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    if (fd == -1 && errno == ELOOP) {		/* a symlink, just unlink it */
+      if (unlink(argv[i]) == -1) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+        ret = 1;
+      }
+      continue;
+    }
+
+    if (fd == -1) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+      ret = 1;
+      continue;
+    }
+
+    if (ioctl(fd, LTSPFS_IOC_RMTREE, &removed) == -1) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i],
+              errno == ENOTTY ? "not on an ltspfs mount" : strerror(errno));
+      ret = 1;
+    } else if (verbose)
+      printf("%s: %u removed\n", argv[i], removed);
+
+    close(fd);
+  }
+
+  return ret;
+}
@@ -0,0 +1,384 @@
+/*
+ * transfer.c: what both ends of the ltspfsd protocol have to do the same
+ * way.  ltspfs-get and ltspfs-put copy trees with the same code ltspfsd
+ * does, so the stream can't mean one thing at one end and another at the
+ * other, and ltspfs checks blocks against the sums ltspfsd makes with the
+ * same block_sum().  Nothing here knows which end it's at: the stream's
+ * reached through the hooks in struct transfer.
+ *
+ * This file is licensed under the GNU GPL.  Please see the "Copying" file
+ * for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "transfer.h"
+
+/*
+ * tree_fail:
+ *
+ * Notes an error copying something, if it's the first one.
+ */
+
+void
+tree_fail(struct transfer *tr, char *name)
+{
+  if (tr->err)
+    return;
+
+  tr->err = errno;
+  if (snprintf(tr->failed, PATH_MAX, "%s%s%s", tr->path,
+               *tr->path ? "/" : "", name) >= PATH_MAX)
+    strcpy(tr->failed + PATH_MAX - 4, "...");	/* it's only to report */
+}
+
+/*
+ * tree_name:
+ *
+ * Checks a name in a tree coming from the other end is just that, and
+ * can't lead anywhere outside of it.
+ */
+
+int
+tree_name(char *name)
+{
+  return *name && !strchr(name, '/') && strcmp(name, ".") &&
+         strcmp(name, "..");
+}
+
+/*
+ * tree_push, tree_pop:
+ *
+ * Go into, and back out of, a directory, as far as tr->path is concerned.
+ * tree_push() returns where to cut the path back to.
+ */
+
+static int
+tree_push(struct transfer *tr, char *name)
+{
+  int len = strlen(tr->path);
+
+  snprintf(tr->path + len, PATH_MAX - len, "%s%s", len ? "/" : "", name);
+  return len;
+}
+
+static void
+tree_pop(struct transfer *tr, int len)
+{
+  tr->path[len] = '\0';
+}
+
+/*
+ * tree_pack:
+ *
+ * Adds the entry in tr to a packet:
+ *
+ * <type>|<name>|<mode>|<size>|<mtime>|<nsec>[|<target>]
+ *
+ * with the target for a symlink.  TREE_UP, TREE_BAD and TREE_END are just
+ * <type>.  The data for a file follows the packet.
+ */
+
+void
+tree_pack(XDR *out, struct transfer *tr)
+{
+  char *ptr;
+
+  xdr_int(out, &tr->type);			/* what it is */
+  if (tr->type == TREE_DIR || tr->type == TREE_FILE ||
+      tr->type == TREE_LINK) {
+    ptr = tr->name;
+    xdr_string(out, &ptr, PATH_MAX);		/* what it's called */
+    xdr_u_int(out, &tr->mode);			/* its mode */
+    xdr_longlong_t(out, &tr->size);		/* size */
+    xdr_long(out, &tr->mtime);			/* and mtime */
+    xdr_long(out, &tr->nsec);
+    if (tr->type == TREE_LINK) {
+      ptr = tr->target;
+      xdr_string(out, &ptr, PATH_MAX);		/* where it points */
+    }
+  }
+}
+
+/*
+ * tree_unpack:
+ *
+ * Reads an entry tree_pack() made into tr.  Returns FALSE if it's not
+ * one, in which case there's no telling where the stream's got to.
+ */
+
+int
+tree_unpack(XDR *in, struct transfer *tr)
+{
+  char *ptr;
+
+  if (!xdr_int(in, &tr->type))
+    return FALSE;
+
+  if (tr->type == TREE_END || tr->type == TREE_UP || tr->type == TREE_BAD)
+    return TRUE;
+
+  if (tr->type != TREE_DIR && tr->type != TREE_FILE &&
+      tr->type != TREE_LINK)
+    return FALSE;
+
+  ptr = tr->name;
+  if (!xdr_string(in, &ptr, PATH_MAX) || !xdr_u_int(in, &tr->mode) ||
+      !xdr_longlong_t(in, &tr->size) || !xdr_long(in, &tr->mtime) ||
+      !xdr_long(in, &tr->nsec) || tr->size < 0)
+    return FALSE;
+
+  ptr = tr->target;
+  return tr->type != TREE_LINK || xdr_string(in, &ptr, PATH_MAX);
+}
+
+/*
+ * tree_send:
+ *
+ * Sends name, in dirfd, to the other end as as, and if it's a directory,
+ * everything in it.  Symlinks are sent as they are, and devices, fifos and
+ * sockets aren't sent at all.  Once a file's been said to be so big, that
+ * much data has to follow, so if it can't all be read, the rest is made
+ * up, and then it's marked TREE_BAD.  stop() is asked between entries.
+ */
+
+void
+tree_send(struct transfer *tr, int dirfd, char *name, char *as)
+{
+  struct stat stbuf;
+  struct dirent *de;
+  DIR   *dp = NULL;
+  off_t sent;
+  int   fd = -1, len, n;
+
+  if (tr->stopped)
+    return;
+  if (tr->stop && tr->stop(tr)) {
+    tr->stopped = TRUE;
+    tree_fail(tr, as);				/* where it stopped */
+    return;
+  }
+
+  if (fstatat(dirfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1) {
+    tree_fail(tr, as);
+    return;
+  }
+
+  if (S_ISLNK(stbuf.st_mode)) {
+    if ((n = readlinkat(dirfd, name, tr->target, PATH_MAX - 1)) < 0) {
+      tree_fail(tr, as);
+      return;
+    }
+    tr->target[n] = '\0';
+    tr->type = TREE_LINK;
+  } else if (S_ISREG(stbuf.st_mode)) {
+    fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    if (fd == -1 || fstat(fd, &stbuf) == -1) {
+      tree_fail(tr, as);
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    tr->type = TREE_FILE;
+  } else if (S_ISDIR(stbuf.st_mode)) {
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    dp = fd < 0 ? NULL : fdopendir(fd);
+    if (dp == NULL) {
+      tree_fail(tr, as);
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    tr->type = TREE_DIR;
+  } else
+    return;
+
+  strncpy(tr->name, as, PATH_MAX - 1);
+  tr->mode  = stbuf.st_mode & 07777;
+  tr->size  = tr->type == TREE_FILE ? stbuf.st_size : 0;
+  tr->mtime = stbuf.st_mtime;
+  tr->nsec  = stbuf.st_mtim.tv_nsec;
+  tr->entry(tr);
+  tr->entries++;
+
+  if (tr->type == TREE_FILE) {
+    for (sent = 0; sent < stbuf.st_size; sent += len) {
+      len = stbuf.st_size - sent > TREE_CHUNK ? TREE_CHUNK
+                                              : stbuf.st_size - sent;
+      if (fd >= 0) {
+        if ((n = read(fd, tr->buf, len)) > 0)
+          len = n;
+        else {
+          if (!n)
+            errno = EIO;			/* it's shrunk */
+          tree_fail(tr, as);
+          close(fd);
+          fd = -1;
+        }
+      }
+      if (fd < 0)
+        memset(tr->buf, 0, len);
+      tr->put(tr, tr->buf, len);
+    }
+    tr->bytes += sent;
+
+    if (fd < 0) {
+      tr->type = TREE_BAD;
+      tr->entry(tr);
+    } else
+      close(fd);
+  } else if (tr->type == TREE_DIR) {
+    len = tree_push(tr, as);
+    while (!tr->stopped && (de = readdir(dp)) != NULL)
+      if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+        tree_send(tr, fd, de->d_name, de->d_name);
+    tree_pop(tr, len);
+    closedir(dp);
+
+    tr->type = TREE_UP;
+    tr->entry(tr);
+  }
+}
+
+/*
+ * tree_recv:
+ *
+ * Makes the entries the other end sends in dirfd, and everything under
+ * the directories in them, up to the TREE_UP that finishes dirfd (or the
+ * TREE_END that finishes the tree).  Anything that can't be made is
+ * skipped, along with what's in it, but still has to be read.  dirfd is -1
+ * while skipping.  Setuid and setgid bits are dropped, unless tr->keep
+ * says otherwise.  Returns FALSE once next() or get() runs out.
+ */
+
+int
+tree_recv(struct transfer *tr, int dirfd)
+{
+  struct timespec times[2];
+  off_t got;
+  u_int mode;
+  int   fd, len, n, ok, made = FALSE;
+
+  while (tr->next(tr)) {
+    if (tr->type == TREE_END || tr->type == TREE_UP)
+      return TRUE;
+
+    if (tr->type == TREE_BAD) {			/* the last file */
+      if (made) {
+        unlinkat(dirfd, tr->name, 0);
+        tr->entries--;
+        tr->bytes -= tr->size;
+      }
+      errno = EIO;
+      tree_fail(tr, tr->name);
+      made = FALSE;
+      continue;
+    }
+
+    ok = tree_name(tr->name);
+    if (!ok) {
+      errno = EINVAL;
+      tree_fail(tr, tr->name);
+    }
+
+    times[0].tv_sec  = times[1].tv_sec  = tr->mtime;
+    times[0].tv_nsec = times[1].tv_nsec = tr->nsec;
+    mode = tr->mode & 07777;
+    if (!tr->keep)
+      mode &= ~(S_ISUID | S_ISGID);
+    made = FALSE;
+    fd = -1;
+
+    if (tr->type == TREE_FILE) {
+      if (ok && dirfd >= 0) {
+        fd = openat(dirfd, tr->name,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode);
+        if (fd == -1)
+          tree_fail(tr, tr->name);
+      }
+
+      for (got = 0; got < tr->size; got += len) {
+        len = tr->size - got > TREE_CHUNK ? TREE_CHUNK : tr->size - got;
+        if (tr->get(tr, tr->buf, len) != len)
+          return FALSE;
+        if (fd >= 0 && (n = write(fd, tr->buf, len)) != len) {
+          if (n >= 0)
+            errno = ENOSPC;
+          tree_fail(tr, tr->name);
+          close(fd);
+          fd = -1;
+        }
+      }
+
+      if (fd >= 0) {
+        futimens(fd, times);
+        close(fd);
+        tr->bytes += got;
+        tr->entries++;
+        made = TRUE;
+      }
+    } else if (tr->type == TREE_LINK) {
+      if (ok && dirfd >= 0) {
+        if (symlinkat(tr->target, dirfd, tr->name) == -1)
+          tree_fail(tr, tr->name);
+        else {
+          utimensat(dirfd, tr->name, times, AT_SYMLINK_NOFOLLOW);
+          tr->entries++;
+        }
+      }
+    } else {
+      if (ok && dirfd >= 0) {
+        if (mkdirat(dirfd, tr->name, mode | S_IRWXU) == -1 &&
+            errno != EEXIST)
+          tree_fail(tr, tr->name);
+        else if ((fd = openat(dirfd, tr->name,
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1)
+          tree_fail(tr, tr->name);
+      }
+
+      len = tree_push(tr, tr->name);
+      if (!tree_recv(tr, fd)) {
+        if (fd >= 0)
+          close(fd);
+        return FALSE;
+      }
+      tree_pop(tr, len);
+
+      if (fd >= 0) {
+        fchmod(fd, mode);			/* now it's filled */
+        futimens(fd, times);
+        close(fd);
+        tr->entries++;
+      }
+    }
+  }
+
+  return FALSE;
+}
+
+/*
+ * block_sum:
+ *
+ * 64 bit FNV-1a hash of a block.  ltspfs compares what it's got against
+ * the sums ltspfsd sends back, so they both use this one.
+ */
+
+u_quad_t
+block_sum(const unsigned char *buf, int len)
+{
+  u_quad_t sum = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    sum ^= *buf++;
+    sum *= 0x100000001b3ULL;
+  }
+
+  return sum;
+}
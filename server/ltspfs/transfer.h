@@ -0,0 +1,74 @@
+/*
+ * transfer.h: what both ends of the ltspfsd protocol have to do the same
+ * way: copying a whole tree in one stream, and summing blocks.  ltspfsd
+ * builds transfer.c from here too.
+ */
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include <rpc/types.h>
+#include <rpc/xdr.h>
+
+#define TREE_CHUNK         (64 * 1024)	/* tree copies move pieces this big */
+
+/*
+ * Entries in the stream of a tree being copied, by ltspfs-get and
+ * ltspfs-put, or GET_TREE and PUT_TREE.
+ */
+
+#define TREE_END           0		/* that's all of it */
+#define TREE_DIR           1		/* a directory, then what's in it */
+#define TREE_FILE          2		/* a file, then its data */
+#define TREE_LINK          3		/* a symlink */
+#define TREE_UP            4		/* out of the last directory */
+#define TREE_BAD           5		/* the last file's data is no good */
+
+/*
+ * A tree that's part way through being copied, and the entry in the stream
+ * that's going by.  How entries and file data get to and from the other
+ * end is up to the hooks: entry() sends the one in tr, next() reads the
+ * next one into it, and returns FALSE if there isn't one, and get() and
+ * put() move exactly len bytes of file data, and return len if they did.
+ * stop(), if there is one, returns TRUE when the other end's had enough.
+ */
+
+struct transfer {
+  int          fd;				/* the stream's on */
+  unsigned int entries;				/* copied so far */
+  u_quad_t     bytes;				/* and file data */
+  int          err;				/* first errno, or 0 */
+  char         failed[PATH_MAX];		/* and what it was for */
+  char         path[PATH_MAX];			/* where we've got to */
+  int          stopped;				/* stop() said so */
+  int          keep;				/* keep setuid and setgid bits */
+  int          type;				/* TREE_FILE and so on */
+  char         name[PATH_MAX];
+  u_int        mode;
+  off_t        size;
+  long         mtime, nsec;
+  char         target[PATH_MAX];		/* what a symlink points at */
+  void         (*entry)(struct transfer *tr);
+  int          (*next)(struct transfer *tr);
+  int          (*get)(struct transfer *tr, char *buf, int len);
+  int          (*put)(struct transfer *tr, const char *buf, int len);
+  int          (*stop)(struct transfer *tr);
+  char         buf[TREE_CHUNK];			/* file data on its way */
+};
+
+/*
+ * function prototypes
+ */
+
+void     tree_fail(struct transfer *tr, char *name);
+int      tree_name(char *name);
+void     tree_pack(XDR *out, struct transfer *tr);
+int      tree_unpack(XDR *in, struct transfer *tr);
+void     tree_send(struct transfer *tr, int dirfd, char *name, char *as);
+int      tree_recv(struct transfer *tr, int dirfd);
+
+u_quad_t block_sum(const unsigned char *buf, int len);
+
+#endif